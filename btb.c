@@ -26,328 +26,4077 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
 
-#define NEGATIVE_ORDERS 1
-#define POSITIVE_ORDERS 10
-#define NUM_BUCKETS_PER_ORDER 1000
-#define NUM_BUCKETS (NUM_BUCKETS_PER_ORDER * (POSITIVE_ORDERS + NEGATIVE_ORDERS))
+#include "sim.h"
+
+#ifdef BTB_GPU
+#include "gpu.h"
+#endif
+
+/*
+ * Magic number and version of the transaction size table format.
+ */
+#define SIZE_TABLE_FILE_MAGIC "BTBSIZE"
+#define SIZE_TABLE_FILE_VERSION 1
+
+/*
+ * Header of a transaction size table file.  It's followed by "num_entries" alias table
+ * entries.  Like the histogram files everything is in the host's byte order and
+ * naturally aligned.
+ */
+struct size_table_file_header {
+	char magic[8];				/* SIZE_TABLE_FILE_MAGIC, NUL terminated */
+	uint32_t version;			/* SIZE_TABLE_FILE_VERSION */
+	uint32_t header_size;			/* Size of this header in bytes */
+	uint32_t num_entries;			/* Number of alias table entries that follow */
+	uint32_t min_size;			/* Smallest transaction size in the table */
+	uint32_t max_size;			/* Largest transaction size in the table */
+	uint32_t reserved;			/* Zero */
+	double mean_size;			/* Mean transaction size */
+};
+
+/*
+ * Magic number and version of the binary histogram format.
+ */
+#define HISTOGRAM_FILE_MAGIC "BTBHIST"
+#define HISTOGRAM_FILE_VERSION 4
+
+/*
+ * Header for each rate's results in the binary output format.  It's followed by
+ * "num_buckets" int64_t bucket counts and then the "num_seeds" uint64_t master seeds of
+ * the runs whose results these are, so that merge() can refuse to count a run twice.
+ * Everything is in the host's byte order, and every field is naturally aligned so
+ * there's no padding.
+ */
+struct histogram_file_header {
+	char magic[8];				/* HISTOGRAM_FILE_MAGIC, NUL terminated */
+	uint32_t version;			/* HISTOGRAM_FILE_VERSION */
+	uint32_t header_size;			/* Size of this header in bytes */
+	uint32_t buckets_per_order;		/* Number of buckets per power of 10 */
+	uint32_t negative_orders;		/* Powers of 10 below 1 second covered */
+	uint32_t num_buckets;			/* Number of bucket counts that follow */
+	int32_t num_blocks;			/* Number of blocks per simulation */
+	int64_t num_sims;			/* Number of simulations */
+	double tps;				/* Transaction arrival rate */
+	int64_t num_results;			/* Total of all the bucket counts */
+	int32_t smallest_bucket;		/* Smallest bucket index used */
+	int32_t largest_bucket;			/* Largest bucket index used */
+	uint64_t config_digest;			/* Digest of the run's configuration (see sim_config_digest()) */
+	uint32_t num_seeds;			/* Number of master seeds after the bucket counts */
+	uint32_t reserved;			/* Zero */
+	double mean;				/* Mean of the results */
+	double m2;				/* Sum of squared differences from the mean */
+	int64_t block_size;			/* Block size limit in bytes */
+};
+
+/*
+ * Number of work items that each thread should get at each rate.  Items are the unit of
+ * checkpointing and the smallest piece of work that we hand out, and workers take as
+ * many at a time as they can get through in about SIM_CHUNK_TARGET_NS.  Having lots of
+ * them lets the work be shared out evenly right up to the end of a job.
+ */
+#define ITEMS_PER_THREAD 32
+#define SIM_CHUNK_TARGET_NS 50000000.0
+
+/*
+ * Weight given to the latest measurement when a worker updates its estimate of what a
+ * simulation costs at a rate.
+ */
+#define SIM_COST_WEIGHT 0.25
+
+/*
+ * Value mixed into the configuration digest of results that were simulated on a GPU.
+ */
+#define GPU_DIGEST_KEY 0x3c6ef372fe94f82bULL
+
+/*
+ * Room that we leave in each worker's task deque, beyond the tasks that it starts with,
+ * for the pieces that tasks are split into.  Splitting in half keeps that to about
+ * log2 of the number of work items.
+ */
+#define TASK_DEQUE_SPARE 64
+
+/*
+ * Task: a run of consecutive work items at one rate.
+ */
+struct sim_task {
+	int rate;				/* Index of the rate */
+	int first_item;				/* First work item, counting across all rates */
+	int num_items;				/* Number of work items */
+};
+
+/*
+ * Chase-Lev work-stealing deque of tasks.  The worker that owns it pushes and takes
+ * tasks at the bottom, and other workers steal them from the top.  The buffer is
+ * circular, and never needs to grow as we only ever push a task if there's room for it.
+ */
+struct task_deque {
+	int64_t top __attribute__((aligned(64)));
+						/* Next task to steal */
+	int64_t bottom __attribute__((aligned(64)));
+						/* Slot after the newest task (written by the owner) */
+	struct sim_task *tasks;			/* Circular buffer of tasks */
+	int64_t mask;				/* Number of slots in "tasks", less 1 */
+};
+
+/*
+ * Outcome of trying to steal a task.
+ */
+enum steal_result {
+	STEAL_EMPTY,				/* There was nothing to steal */
+	STEAL_SUCCESS,				/* We got a task */
+	STEAL_RETRY				/* Another worker got there first */
+};
+
+/*
+ * Default number of seconds between checkpoints.
+ */
+#define CHECKPOINT_INTERVAL 300
+
+/*
+ * Magic number and version of the checkpoint format.
+ */
+#define CHECKPOINT_FILE_MAGIC "BTBCKPT"
+#define CHECKPOINT_FILE_VERSION 5
+
+/*
+ * Header of a checkpoint file.  It's followed by one byte for each work item, set to 1
+ * if the item has been completed, padded to a multiple of 8 bytes.  After that there's
+ * one record for each rate in the binary histogram format, holding the results of the
+ * completed items.
+ *
+ * Each simulation's seed only depends on the master seed and the simulation's index,
+ * so that's all of the random number generator state we need to carry on where we
+ * left off.
+ */
+struct checkpoint_file_header {
+	char magic[8];				/* CHECKPOINT_FILE_MAGIC, NUL terminated */
+	uint32_t version;			/* CHECKPOINT_FILE_VERSION */
+	uint32_t header_size;			/* Size of this header in bytes */
+	uint64_t seed;				/* Master seed for the run */
+	int32_t num_rates;			/* Number of arrival rates */
+	int32_t num_blocks;			/* Number of blocks per simulation */
+	int32_t num_sims;			/* Number of simulations at each rate */
+	int32_t item_sims;			/* Number of simulations in each work item */
+	int32_t items_per_rate;			/* Number of work items at each rate */
+	uint32_t discipline;			/* Queue discipline */
+	double tps_scale;			/* Transactions per second for each unit of TPS */
+	int64_t sims_completed;			/* Number of simulations completed */
+	uint32_t hash_model;			/* Non-zero if we're modelling the hash rate */
+	uint32_t crn;				/* Non-zero if we're using common random numbers */
+	double hash_growth;			/* Hash rate growth per retarget timespan */
+	int64_t block_size;			/* Block size limit in bytes */
+	uint64_t profile_digest;		/* Digest of the arrival rate profile, or 0 for none */
+};
+
+/*
+ * Magic number and version of the block statistics format.
+ */
+#define BLOCK_STATS_FILE_MAGIC "BTBBLKS"
+#define BLOCK_STATS_FILE_VERSION 1
+
+/*
+ * Header of a block statistics file.  It's followed by "num_rates" doubles giving the
+ * transaction arrival rates, and then by block records until the end of the file.
+ * Records from different workers are interleaved, but each simulation's records are in
+ * block order.
+ */
+struct block_stats_file_header {
+	char magic[8];				/* BLOCK_STATS_FILE_MAGIC, NUL terminated */
+	uint32_t version;			/* BLOCK_STATS_FILE_VERSION */
+	uint32_t header_size;			/* Size of this header in bytes */
+	uint32_t record_size;			/* Size of each block record in bytes */
+	int32_t num_rates;			/* Number of arrival rates */
+	int32_t num_blocks;			/* Number of blocks per simulation */
+	int32_t num_sims;			/* Number of simulations at each rate */
+};
+
+/*
+ * Magic number and version of the live results format.
+ */
+#define LIVE_FILE_MAGIC "BTBLIVE"
+#define LIVE_FILE_VERSION 1
+
+/*
+ * Time between publications of a job's live results, and between looks at them by
+ * "btb watch" unless it's told otherwise.
+ */
+#define LIVE_INTERVAL_NS 1000000000ULL
+#define WATCH_INTERVAL 1
+
+/*
+ * Header of a live results file.  It's followed by "num_records" records, one for each
+ * rate and block size, each followed by "num_buckets" int64_t bucket counts.  The file is
+ * mapped by the running job and by anything watching it, so everything is in the host's
+ * byte order and naturally aligned.
+ *
+ * The job rewrites the results in place, so "seq" works as a seqlock: it's odd while the
+ * results are being written and goes up by 2 each time they're published.  A reader
+ * that sees the same even value before and after copying the results got a consistent
+ * copy.
+ *
+ * "writer_pid" lets a watcher on the same host tell a job that's still running from one
+ * that died before it finished.
+ */
+struct live_file_header {
+	char magic[8];				/* LIVE_FILE_MAGIC, NUL terminated */
+	uint32_t version;			/* LIVE_FILE_VERSION */
+	uint32_t header_size;			/* Size of this header in bytes */
+	uint64_t seq;				/* Publication sequence number (see above) */
+	uint32_t buckets_per_order;		/* Number of buckets per power of 10 */
+	uint32_t num_buckets;			/* Number of bucket counts in each record */
+	uint32_t num_records;			/* Number of records that follow */
+	int32_t num_blocks;			/* Number of blocks per simulation */
+	int64_t sims_done;			/* Simulations completed so far */
+	int64_t total_sims;			/* Simulations in the whole job */
+	uint32_t finished;			/* Non-zero once the job is done */
+	uint32_t show_block_size;		/* Non-zero if the job simulated several block sizes */
+	uint64_t seed;				/* Master seed of the job */
+	uint64_t config_digest;			/* Digest of the job's configuration (see sim_config_digest()) */
+	int32_t writer_pid;			/* Process ID of the job */
+	uint32_t reserved;			/* Zero */
+};
+
+/*
+ * Record of live results for one rate and block size.
+ */
+struct live_file_record {
+	double tps;				/* Transaction arrival rate */
+	int64_t block_size;			/* Block size limit in bytes */
+	int64_t num_sims;			/* Number of simulations so far */
+	int64_t num_results;			/* Total of all the bucket counts */
+	int32_t smallest_bucket;		/* Smallest bucket index used */
+	int32_t largest_bucket;			/* Largest bucket index used */
+	double mean;				/* Mean of the results */
+	double m2;				/* Sum of squared differences from the mean */
+};
+
+/*
+ * Live results publisher.  Whoever holds the job lock can publish, so there's only ever
+ * one writer.
+ */
+struct live_writer {
+	struct live_file_header *hdr;		/* Mapped live results file */
+	size_t size;				/* Size of the mapping */
+	size_t record_size;			/* Size of each record and its buckets */
+	uint64_t next_ns;			/* Time of the next publication */
+};
+
+/*
+ * Size of the block statistics writer's output buffer.
+ */
+#define BLOCK_STATS_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Block statistics writer.  This runs in its own thread, draining the workers' rings
+ * into a buffered file.
+ */
+struct block_stats_writer {
+	pthread_t thread;			/* Thread running the writer */
+	FILE *f;				/* Output file */
+	struct block_ring **rings;		/* Rings to drain, one per worker */
+	int num_rings;				/* Number of rings */
+	bool finished;				/* Set once the workers have finished */
+	bool failed;				/* Did a write fail? */
+	long long int records;			/* Number of records written */
+};
+
+/*
+ * Convergence monitor for one transaction arrival rate.  We treat the percentiles of
+ * each batch of simulations as independent samples (they are, as every simulation is
+ * independent) and track their mean and variance with Welford's method.
+ */
+struct ci_monitor {
+	int num_batches;			/* Number of batches seen */
+	double mean[CI_MAX_PERCENTILES];	/* Mean of each percentile across the batches */
+	double m2[CI_MAX_PERCENTILES];		/* Sum of squared differences from the means */
+	bool converged;				/* Have all of the percentiles converged? */
+};
+
+/*
+ * Results for one transaction arrival rate.
+ */
+struct sim_rate {
+	double tps;				/* Transaction arrival rate */
+	long long int block_size;		/* Block size limit in bytes */
+	uint64_t seed;				/* Master seed of the run */
+	uint64_t config_digest;			/* Digest of the run's configuration (see sim_config_digest()) */
+	long long int num_sims;			/* Number of simulations merged into "hist" */
+	struct histogram hist;			/* Results merged from all of the workers */
+	struct ddsketch sketch;			/* Storage for "hist"'s sketch, if it has one */
+	struct ci_monitor ci;			/* Convergence of the rate's percentiles */
+};
+
+/*
+ * Simulation job shared by all of the worker threads.  The job is split into work
+ * items, each a run of consecutive simulations at one rate, which are shared out
+ * between the workers as tasks that they can steal from each other.
+ */
+struct sim_job {
+	pthread_mutex_t lock;			/* Protects item_done and the merged results */
+	struct sim_rate *rates;			/* Rates that we're simulating */
+	unsigned char *item_done;		/* Non-zero for each work item that's completed */
+	int num_rates;				/* Number of rates */
+	int num_lanes;				/* Number of block sizes at each rate */
+	int num_blocks;				/* Number of blocks per simulation */
+	int num_sims;				/* Number of simulations at each rate */
+	int item_sims;				/* Number of simulations in each work item */
+	int items_per_rate;			/* Number of work items at each rate */
+	struct sim_worker *workers;		/* Workers, whose deques hold the tasks */
+	int num_workers;			/* Number of workers */
+	long long int unclaimed_items;		/* Work items not yet taken to be run (atomic) */
+	long long int sims_done;		/* Simulations completed (atomic) */
+	long long int total_sims;		/* Simulations in the whole job */
+	long long int divisor;			/* Progress reporting interval */
+	bool merge_items;			/* Merge results as each task completes? */
+	double sketch_accuracy;			/* Accuracy of the workers' sketches, or 0 for none */
+	double tps_scale;			/* Transactions per second for each unit of TPS */
+	uint64_t seed;				/* Master seed for the run */
+	bool seed_given;			/* Was "seed" given rather than left to a checkpoint? */
+	enum queue_discipline discipline;	/* Order in which transactions are confirmed */
+	uint64_t config_digest;			/* Digest of the whole configuration */
+	bool hash_model;			/* Model hash rate growth and retargeting? */
+	double hash_growth;			/* Hash rate growth per retarget timespan */
+	bool crn;				/* Use common random numbers across rates? */
+	uint64_t profile_digest;		/* Digest of the arrival rate profile, or 0 for none */
+	bool quiet;				/* Suppress progress reports? */
+	double target_ci;			/* Relative confidence interval to stop at, or 0 */
+	int num_ci_percentiles;			/* Number of percentiles to monitor */
+	const double *ci_percentiles;		/* Percentiles to monitor (0 to 1) */
+
+	/*
+	 * Checkpointing.  The checkpoint thread waits on "wake" between checkpoints so that
+	 * it can be stopped straight away once the workers are done.  The workers merge each
+	 * task's results into "unsaved" as well as "rates", and the checkpoint thread swaps
+	 * it for an empty set when it takes a checkpoint.
+	 */
+	const char *checkpoint_name;		/* File to checkpoint the run to, or NULL */
+	int checkpoint_interval;		/* Seconds between checkpoints */
+	struct sim_rate *unsaved;		/* Results merged since the last checkpoint was taken */
+	pthread_cond_t wake;			/* Signalled when the job is finished */
+	bool finished;				/* Have all of the workers finished? */
+
+	struct live_writer *live;		/* Live results publisher, or NULL */
+};
+
+/*
+ * State for each simulation thread.
+ */
+struct sim_worker {
+	pthread_t thread;			/* Thread running this worker */
+	struct sim_context ctx;			/* Simulation context owned by this worker */
+	struct sim_job *job;			/* Job that we're working on */
+	int index;				/* Number of this worker */
+	struct task_deque deque;		/* Tasks waiting to be run or stolen */
+	uint64_t steal_state;			/* Random state for picking workers to steal from */
+	double *sim_ns;				/* Estimated cost of a simulation at each rate, or 0 */
+	struct sim_rate *results;		/* Results kept for each rate and block size, or NULL */
+};
+
+/*
+ * output_results()
+ *	Generate the output results.
+ */
+static void output_results(const struct histogram *h)
+{
+	double num_res = (double)h->num_results;
+
+	double cumulative_ratio = 0.0;
+	for (int i = h->smallest_bucket; i <= h->largest_bucket; i++) {
+		double r = (double)h->buckets[i] / num_res;
+		double bucket_start = h->tables->edge[i];
+		double bucket_end = h->tables->edge[i + 1];
+		cumulative_ratio += r;
+		printf("%d | %.6f | %.6f | %.6f | %.6f\n",
+		       i, bucket_start, r, r / (bucket_end - bucket_start), cumulative_ratio);
+	}
+}
+
+/*
+ * output_csv_header()
+ *	Generate the column names for CSV output.
+ */
+static void output_csv_header(bool block_size)
+{
+	printf("tps,%sbucket,bucket_start,bucket_end,count,ratio,density,cumulative\n", block_size ? "block_size," : "");
+}
+
+/*
+ * output_results_csv()
+ *	Generate the output results as CSV rows.  Counts are exact and the other values are
+ *	printed with enough digits to reproduce the doubles they came from.  The rows are
+ *	labelled with the block size too unless "block_size" is 0.
+ */
+static void output_results_csv(const struct histogram *h, double tps, long long int block_size)
+{
+	char label[64];
+	if (block_size) {
+		snprintf(label, sizeof(label), "%.17g,%lld", tps, block_size);
+	} else {
+		snprintf(label, sizeof(label), "%.17g", tps);
+	}
+
+	double num_res = (double)h->num_results;
+
+	double cumulative_ratio = 0.0;
+	for (int i = h->smallest_bucket; i <= h->largest_bucket; i++) {
+		double r = (double)h->buckets[i] / num_res;
+		double bucket_start = h->tables->edge[i];
+		double bucket_end = h->tables->edge[i + 1];
+		cumulative_ratio += r;
+		printf("%s,%d,%.17g,%.17g,%ld,%.17g,%.17g,%.17g\n",
+		       label, i, bucket_start, bucket_end, h->buckets[i], r, r / (bucket_end - bucket_start), cumulative_ratio);
+	}
+}
+
+/*
+ * output_summary_header()
+ *	Generate the column names for summary output.
+ */
+static void output_summary_header(bool sketch, bool block_size)
+{
+	printf("tps,%snum_blocks,num_sims,num_results,mean,stddev,p50,p90,p99%s\n",
+	       block_size ? "block_size," : "", sketch ? ",sketch_p50,sketch_p90,sketch_p99" : "");
+}
+
+/*
+ * output_results_summary()
+ *	Generate one summary row of results.  The percentiles come from the histogram, and
+ *	from the histogram's quantile sketch too if it has one.  The row is labelled with
+ *	the block size too unless "block_size" is 0.
+ */
+static void output_results_summary(const struct histogram *h, double tps, long long int block_size, int num_blocks, long long int num_sims)
+{
+	double stddev = (h->num_results > 1) ? sqrt(h->m2 / (double)(h->num_results - 1)) : NAN;
+	printf("%f,", tps);
+	if (block_size) {
+		printf("%lld,", block_size);
+	}
+
+	printf("%d,%lld,%lld,%.6f,%.6f,%.6f,%.6f,%.6f",
+	       num_blocks, num_sims, h->num_results, h->num_results ? h->mean : NAN, stddev,
+	       histogram_percentile(h, 0.5), histogram_percentile(h, 0.9), histogram_percentile(h, 0.99));
+	if (h->sketch) {
+		printf(",%.6f,%.6f,%.6f",
+		       ddsketch_quantile(h->sketch, 0.5), ddsketch_quantile(h->sketch, 0.9), ddsketch_quantile(h->sketch, 0.99));
+	}
+
+	printf("\n");
+}
+
+/*
+ * output_results_binary()
+ *	Generate the output results as a binary header followed by the bucket counts and the
+ *	"num_seeds" master seeds in "seeds" of the runs that they came from.
+ */
+static bool output_results_binary(FILE *f, const struct histogram *h, double tps, long long int block_size, int num_blocks, long long int num_sims,
+				  uint64_t config_digest, const uint64_t *seeds, uint32_t num_seeds)
+{
+	struct histogram_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, HISTOGRAM_FILE_MAGIC);
+	hdr.version = HISTOGRAM_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.buckets_per_order = h->tables->buckets_per_order;
+	hdr.negative_orders = NEGATIVE_ORDERS;
+	hdr.num_buckets = h->tables->num_buckets;
+	hdr.num_blocks = num_blocks;
+	hdr.num_sims = num_sims;
+	hdr.tps = tps;
+	hdr.num_results = h->num_results;
+	hdr.smallest_bucket = h->smallest_bucket;
+	hdr.largest_bucket = h->largest_bucket;
+	hdr.config_digest = config_digest;
+	hdr.num_seeds = num_seeds;
+	hdr.mean = h->mean;
+	hdr.m2 = h->m2;
+	hdr.block_size = block_size;
+
+	int64_t counts[NUM_BUCKETS];
+	for (uint32_t i = 0; i < hdr.num_buckets; i++) {
+		counts[i] = h->buckets[i];
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		return false;
+	}
+
+	if (fwrite(counts, sizeof(int64_t), hdr.num_buckets, f) != hdr.num_buckets) {
+		return false;
+	}
+
+	if (fwrite(seeds, sizeof(uint64_t), num_seeds, f) != num_seeds) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * input_results_binary()
+ *	Read one rate's results, as written by output_results_binary(), into histogram "h"
+ *	and header "hdr".  "h" must be zeroed or initialized, and gets whichever resolution
+ *	the results were written with.  If "seeds" isn't NULL then the results' master
+ *	seeds are read into "*seeds", which is grown as needed and has room for
+ *	"*seeds_capacity" of them; otherwise they're skipped.  Returns false if they can't
+ *	be read or weren't written with a histogram layout that we know.
+ */
+static bool input_results_binary(FILE *f, struct histogram *h, struct histogram_file_header *hdr, uint64_t **seeds, uint32_t *seeds_capacity)
+{
+	if (fread(hdr, sizeof(struct histogram_file_header), 1, f) != 1) {
+		return false;
+	}
+
+	if (memcmp(hdr->magic, HISTOGRAM_FILE_MAGIC, sizeof(hdr->magic)) ||
+	    (hdr->version != HISTOGRAM_FILE_VERSION) ||
+	    (hdr->header_size != sizeof(struct histogram_file_header))) {
+		return false;
+	}
+
+	/*
+	 * Every run adds at least one simulation, or at least a record for one in the case
+	 * of a checkpoint, so there can't be more seeds than that.
+	 */
+	if ((hdr->num_sims < 0) || ((int64_t)hdr->num_seeds > ((hdr->num_sims > 1) ? hdr->num_sims : 1))) {
+		return false;
+	}
+
+	const struct bucket_tables *t = bucket_tables_find(hdr->buckets_per_order);
+	if (!t || (hdr->negative_orders != NEGATIVE_ORDERS) || (hdr->num_buckets != (uint32_t)t->num_buckets)) {
+		return false;
+	}
+
+	int64_t counts[NUM_BUCKETS];
+	if (fread(counts, sizeof(int64_t), t->num_buckets, f) != (size_t)t->num_buckets) {
+		return false;
+	}
+
+	/*
+	 * Work out the range of buckets used from the counts rather than trusting the header.
+	 */
+	histogram_destroy(h);
+	histogram_init(h, t, NULL);
+	long long int total = 0;
+	for (int i = 0; i < t->num_buckets; i++) {
+		if (counts[i] < 0) {
+			return false;
+		}
+
+		h->buckets[i] = counts[i];
+		if (counts[i]) {
+			if (h->smallest_bucket > i) {
+				h->smallest_bucket = i;
+			}
+
+			h->largest_bucket = i;
+		}
+
+		total += counts[i];
+	}
+
+	if (total != hdr->num_results) {
+		return false;
+	}
+
+	if (seeds && (*seeds_capacity < hdr->num_seeds)) {
+		free(*seeds);
+		*seeds = malloc(hdr->num_seeds * sizeof(uint64_t));
+		if (!*seeds) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+
+		*seeds_capacity = hdr->num_seeds;
+	}
+
+	for (uint32_t i = 0; i < hdr->num_seeds; i++) {
+		uint64_t seed;
+		if (fread(&seed, sizeof(seed), 1, f) != 1) {
+			return false;
+		}
+
+		if (seeds) {
+			(*seeds)[i] = seed;
+		}
+	}
+
+	h->num_results = total;
+	h->mean = hdr->mean;
+	h->m2 = hdr->m2;
+	return true;
+}
+
+/*
+ * checkpoint_item_sims()
+ *	Return the number of simulations in a work item.
+ */
+static int checkpoint_item_sims(const struct sim_job *job, int item)
+{
+	int first_sim = (item % job->items_per_rate) * job->item_sims;
+	int end_sim = first_sim + job->item_sims;
+	if (end_sim > job->num_sims) {
+		end_sim = job->num_sims;
+	}
+
+	return end_sim - first_sim;
+}
+
+/*
+ * checkpoint_done_bytes()
+ *	Return the size of a checkpoint's work item table, including its padding.
+ */
+static size_t checkpoint_done_bytes(const struct sim_job *job)
+{
+	return ((size_t)(job->num_rates * job->items_per_rate) + 7) & ~(size_t)7;
+}
+
+/*
+ * checkpoint_write()
+ *	Write a checkpoint of a job's results, "rates", and its completed work items,
+ *	"item_done", to the job's checkpoint file.  We write to a temporary file and rename
+ *	it over the old checkpoint so that there's always one complete checkpoint on disk.
+ */
+static bool checkpoint_write(const struct sim_job *job, const struct sim_rate *rates, const unsigned char *item_done)
+{
+	size_t name_len = strlen(job->checkpoint_name);
+	char *tmp_name = malloc(name_len + 5);
+	if (!tmp_name) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	memcpy(tmp_name, job->checkpoint_name, name_len);
+	strcpy(tmp_name + name_len, ".tmp");
+
+	int num_items = job->num_rates * job->items_per_rate;
+	long long int *rate_sims = calloc(job->num_rates, sizeof(long long int));
+	unsigned char *done = calloc(checkpoint_done_bytes(job), 1);
+	if (!rate_sims || !done) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	memcpy(done, item_done, num_items);
+
+	struct checkpoint_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, CHECKPOINT_FILE_MAGIC);
+	hdr.version = CHECKPOINT_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.seed = job->seed;
+	hdr.num_rates = job->num_rates;
+	hdr.num_blocks = job->num_blocks;
+	hdr.num_sims = job->num_sims;
+	hdr.item_sims = job->item_sims;
+	hdr.items_per_rate = job->items_per_rate;
+	hdr.discipline = job->discipline;
+	hdr.tps_scale = job->tps_scale;
+	hdr.hash_model = job->hash_model;
+	hdr.crn = job->crn;
+	hdr.block_size = job->rates[0].block_size;
+	hdr.hash_growth = job->hash_model ? job->hash_growth : 0.0;
+	hdr.profile_digest = job->profile_digest;
+	for (int item = 0; item < num_items; item++) {
+		if (done[item]) {
+			int n = checkpoint_item_sims(job, item);
+			rate_sims[item / job->items_per_rate] += n;
+			hdr.sims_completed += n;
+		}
+	}
+
+	bool ok = false;
+	FILE *f = fopen(tmp_name, "wb");
+	if (f) {
+		ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1) &&
+		     (fwrite(done, checkpoint_done_bytes(job), 1, f) == 1);
+		for (int r = 0; ok && (r < job->num_rates); r++) {
+			ok = output_results_binary(f, &rates[r].hist, rates[r].tps, rates[r].block_size, job->num_blocks, rate_sims[r],
+						   job->config_digest, &job->seed, 1);
+		}
+
+		ok = ok && !fflush(f) && !fsync(fileno(f));
+		ok = !fclose(f) && ok;
+		ok = ok && !rename(tmp_name, job->checkpoint_name);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Failed to write checkpoint %s\n", job->checkpoint_name);
+		remove(tmp_name);
+	}
+
+	free(done);
+	free(rate_sims);
+	free(tmp_name);
+	return ok;
+}
+
+/*
+ * checkpoint_read()
+ *	Load the results and completed work items from a job's checkpoint file.  The job must
+ *	have been set up in exactly the same way as the one that wrote the checkpoint, and if
+ *	it was given a seed then that must be the checkpoint's too.  Returns the number of
+ *	simulations already completed.
+ */
+static long long int checkpoint_read(struct sim_job *job)
+{
+	const char *name = job->checkpoint_name;
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open checkpoint %s\n", name);
+		exit(-2);
+	}
+
+	struct checkpoint_file_header hdr;
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    memcmp(hdr.magic, CHECKPOINT_FILE_MAGIC, sizeof(hdr.magic)) ||
+	    (hdr.version != CHECKPOINT_FILE_VERSION) ||
+	    (hdr.header_size != sizeof(hdr))) {
+		fprintf(stderr, "%s is not a valid checkpoint\n", name);
+		exit(-1);
+	}
+
+	if ((hdr.num_rates != job->num_rates) ||
+	    (hdr.num_blocks != job->num_blocks) ||
+	    (hdr.num_sims != job->num_sims) ||
+	    (hdr.discipline != job->discipline) ||
+	    (hdr.tps_scale != job->tps_scale) ||
+	    (hdr.hash_model != job->hash_model) ||
+	    (hdr.crn != job->crn) ||
+	    (hdr.block_size != job->rates[0].block_size) ||
+	    (hdr.profile_digest != job->profile_digest) ||
+	    (job->hash_model && (hdr.hash_growth != job->hash_growth))) {
+		fprintf(stderr, "Checkpoint %s is for a different simulation\n", name);
+		exit(-1);
+	}
+
+	if (job->seed_given && (hdr.seed != job->seed)) {
+		fprintf(stderr, "Checkpoint %s was made with seed 0x%016" PRIx64 ", not 0x%016" PRIx64 "\n", name, hdr.seed, job->seed);
+		exit(-1);
+	}
+
+	/*
+	 * The way the runs were split into work items is part of the checkpoint, so we keep
+	 * it even if we've now got a different number of threads.
+	 */
+	job->seed = hdr.seed;
+	job->item_sims = hdr.item_sims;
+	job->items_per_rate = hdr.items_per_rate;
+	if ((job->item_sims < 1) || (job->items_per_rate != (job->num_sims + job->item_sims - 1) / job->item_sims)) {
+		fprintf(stderr, "%s is not a valid checkpoint\n", name);
+		exit(-1);
+	}
+
+	free(job->item_done);
+	job->item_done = malloc(checkpoint_done_bytes(job));
+	if (!job->item_done) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	bool ok = (fread(job->item_done, checkpoint_done_bytes(job), 1, f) == 1);
+	for (int r = 0; ok && (r < job->num_rates); r++) {
+		struct histogram_file_header rh;
+		const struct bucket_tables *tables = job->rates[r].hist.tables;
+		ok = input_results_binary(f, &job->rates[r].hist, &rh, NULL, NULL) && (rh.tps == job->rates[r].tps) &&
+		     (rh.block_size == job->rates[r].block_size) && (rh.config_digest == job->config_digest) &&
+		     (job->rates[r].hist.tables == tables);
+		job->rates[r].num_sims = rh.num_sims;
+	}
+
+	fclose(f);
+	if (!ok) {
+		fprintf(stderr, "Failed to read checkpoint %s\n", name);
+		exit(-1);
+	}
+
+	return hdr.sims_completed;
+}
+
+/*
+ * checkpoint_run()
+ *	Thread entry point that periodically checkpoints a job until it's finished.
+ *
+ * We keep our own copy of the results as of the last checkpoint, "rates".  While we hold
+ * the job lock we only swap the job's unsaved results for our empty "spare" set, and
+ * copy its completed work items, which is a byte for each.  Adding the unsaved results
+ * to our copy and writing it out are done without the lock, so the workers never wait
+ * for either.
+ */
+static void *checkpoint_run(void *arg)
+{
+	struct sim_job *job = (struct sim_job *)arg;
+	int num_items = job->num_rates * job->items_per_rate;
+
+	struct sim_rate *rates = calloc(job->num_rates, sizeof(struct sim_rate));
+	struct sim_rate *spare = calloc(job->num_rates, sizeof(struct sim_rate));
+	unsigned char *item_done = malloc(num_items);
+	if (!rates || !spare || !item_done) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	for (int r = 0; r < job->num_rates; r++) {
+		rates[r].tps = job->rates[r].tps;
+		rates[r].block_size = job->rates[r].block_size;
+		histogram_init(&rates[r].hist, job->rates[r].hist.tables, NULL);
+		histogram_init(&spare[r].hist, job->rates[r].hist.tables, NULL);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += job->checkpoint_interval;
+
+		int res = 0;
+		while (!job->finished && (res != ETIMEDOUT)) {
+			res = pthread_cond_timedwait(&job->wake, &job->lock, &deadline);
+		}
+
+		if (job->finished) {
+			break;
+		}
+
+		struct sim_rate *unsaved = job->unsaved;
+		job->unsaved = spare;
+		memcpy(item_done, job->item_done, num_items);
+		pthread_mutex_unlock(&job->lock);
+
+		for (int r = 0; r < job->num_rates; r++) {
+			histogram_merge(&rates[r].hist, &unsaved[r].hist);
+			histogram_clear(&unsaved[r].hist);
+		}
+
+		spare = unsaved;
+		checkpoint_write(job, rates, item_done);
+
+		pthread_mutex_lock(&job->lock);
+	}
+
+	pthread_mutex_unlock(&job->lock);
+
+	for (int r = 0; r < job->num_rates; r++) {
+		histogram_destroy(&rates[r].hist);
+		histogram_destroy(&spare[r].hist);
+	}
+
+	free(item_done);
+	free(spare);
+	free(rates);
+	return NULL;
+}
+
+/*
+ * live_record_size()
+ *	Return the size of a live results record and its bucket counts.
+ */
+static size_t live_record_size(uint32_t num_buckets)
+{
+	return sizeof(struct live_file_record) + ((size_t)num_buckets * sizeof(int64_t));
+}
+
+/*
+ * live_publish()
+ *	Copy a job's results into its live results file.  The caller must hold the job lock,
+ *	or be the only thread left.
+ *
+ * Results only ever grow, so the buckets outside the range that's been used are still
+ * zero from when the file was created and we don't need to touch them.
+ */
+static void live_publish(struct live_writer *lw, const struct sim_job *job, bool finished)
+{
+	struct live_file_header *hdr = lw->hdr;
+	uint64_t seq = hdr->seq;
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	int64_t sims_done = 0;
+	unsigned char *p = (unsigned char *)hdr + hdr->header_size;
+	for (uint32_t k = 0; k < hdr->num_records; k++) {
+		const struct sim_rate *rate = &job->rates[k];
+		const struct histogram *h = &rate->hist;
+		struct live_file_record *rec = (struct live_file_record *)p;
+		int64_t *buckets = (int64_t *)(p + sizeof(struct live_file_record));
+		rec->num_sims = rate->num_sims;
+		rec->num_results = h->num_results;
+		rec->smallest_bucket = h->smallest_bucket;
+		rec->largest_bucket = h->largest_bucket;
+		rec->mean = h->mean;
+		rec->m2 = h->m2;
+		for (int b = h->smallest_bucket; b <= h->largest_bucket; b++) {
+			buckets[b] = h->buckets[b];
+		}
+
+		if ((k % job->num_lanes) == 0) {
+			sims_done += rate->num_sims;
+		}
+
+		p += lw->record_size;
+	}
+
+	hdr->sims_done = sims_done;
+	hdr->finished = finished;
+
+	__atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+	lw->next_ns = now_ns() + LIVE_INTERVAL_NS;
+}
+
+/*
+ * live_open()
+ *	Create a live results file for a job and publish the results so far.  The file is
+ *	built under a temporary name and renamed into place, so that anyone watching never
+ *	sees a half-made one.
+ */
+static void live_open(struct live_writer *lw, const char *name, const struct sim_job *job, bool show_block_size)
+{
+	size_t name_len = strlen(name);
+	char *tmp_name = malloc(name_len + 5);
+	if (!tmp_name) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	memcpy(tmp_name, name, name_len);
+	strcpy(tmp_name + name_len, ".tmp");
+
+	const struct bucket_tables *tables = job->rates[0].hist.tables;
+	uint32_t num_records = job->num_rates * job->num_lanes;
+	lw->record_size = live_record_size(tables->num_buckets);
+	lw->size = sizeof(struct live_file_header) + (num_records * lw->record_size);
+
+	int fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create %s\n", tmp_name);
+		exit(-2);
+	}
+
+	if (ftruncate(fd, lw->size) < 0) {
+		fprintf(stderr, "Failed to write %s\n", tmp_name);
+		exit(-2);
+	}
+
+	void *map = mmap(NULL, lw->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", tmp_name);
+		exit(-2);
+	}
+
+	struct live_file_header *hdr = map;
+	strcpy(hdr->magic, LIVE_FILE_MAGIC);
+	hdr->version = LIVE_FILE_VERSION;
+	hdr->header_size = sizeof(struct live_file_header);
+	hdr->seq = 0;
+	hdr->buckets_per_order = tables->buckets_per_order;
+	hdr->num_buckets = tables->num_buckets;
+	hdr->num_records = num_records;
+	hdr->num_blocks = job->num_blocks;
+	hdr->total_sims = job->total_sims;
+	hdr->show_block_size = show_block_size;
+	hdr->seed = job->seed;
+	hdr->config_digest = job->config_digest;
+	hdr->writer_pid = (int32_t)getpid();
+
+	unsigned char *p = (unsigned char *)map + hdr->header_size;
+	for (uint32_t k = 0; k < num_records; k++) {
+		struct live_file_record *rec = (struct live_file_record *)p;
+		rec->tps = job->rates[k].tps;
+		rec->block_size = job->rates[k].block_size;
+		p += lw->record_size;
+	}
+
+	lw->hdr = hdr;
+	live_publish(lw, job, false);
+
+	if (rename(tmp_name, name)) {
+		fprintf(stderr, "Failed to create %s\n", name);
+		exit(-2);
+	}
+
+	free(tmp_name);
+}
+
+/*
+ * live_close()
+ *	Publish a job's final results and unmap its live results file.
+ */
+static void live_close(struct live_writer *lw, const struct sim_job *job)
+{
+	live_publish(lw, job, true);
+	munmap(lw->hdr, lw->size);
+	lw->hdr = NULL;
+}
+
+/*
+ * block_stats_drain()
+ *	Write out everything that's waiting in a block statistics ring.  Returns the number
+ *	of records written.
+ */
+static uint64_t block_stats_drain(struct block_stats_writer *bw, struct block_ring *br)
+{
+	uint64_t tail = br->tail;
+	uint64_t head = __atomic_load_n(&br->head, __ATOMIC_ACQUIRE);
+	uint64_t n = head - tail;
+	if (!n) {
+		return 0;
+	}
+
+	/*
+	 * The waiting records are in at most two runs, one either side of the ring's wrap.
+	 */
+	uint64_t first = tail & (BLOCK_RING_ENTRIES - 1);
+	uint64_t k = BLOCK_RING_ENTRIES - first;
+	if (k > n) {
+		k = n;
+	}
+
+	if ((fwrite(&br->records[first], sizeof(struct block_record), k, bw->f) != k) ||
+	    (fwrite(&br->records[0], sizeof(struct block_record), n - k, bw->f) != (n - k))) {
+		bw->failed = true;
+	}
+
+	__atomic_store_n(&br->tail, head, __ATOMIC_RELEASE);
+	bw->records += n;
+	return n;
+}
+
+/*
+ * block_stats_run()
+ *	Thread entry point for the block statistics writer.  We keep draining the rings
+ *	until the workers have finished and there's nothing left in any of them.
+ */
+static void *block_stats_run(void *arg)
+{
+	struct block_stats_writer *bw = (struct block_stats_writer *)arg;
+
+	while (1) {
+		bool finished = __atomic_load_n(&bw->finished, __ATOMIC_ACQUIRE);
+
+		uint64_t n = 0;
+		for (int i = 0; i < bw->num_rings; i++) {
+			n += block_stats_drain(bw, bw->rings[i]);
+		}
+
+		/*
+		 * Once we've seen "finished" set, a pass that found nothing means we're done.
+		 */
+		if (!n) {
+			if (finished) {
+				break;
+			}
+
+			struct timespec ts = {0, 1000000};
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * block_stats_start()
+ *	Create the block statistics file "name" and start a writer for "num_rings" rings.
+ */
+static void block_stats_start(struct block_stats_writer *bw, const char *name, const struct sim_job *job, struct block_ring **rings, int num_rings)
+{
+	memset(bw, 0, sizeof(struct block_stats_writer));
+	bw->rings = rings;
+	bw->num_rings = num_rings;
+
+	bw->f = fopen(name, "wb");
+	if (!bw->f) {
+		fprintf(stderr, "Failed to create %s\n", name);
+		exit(-2);
+	}
+
+	setvbuf(bw->f, NULL, _IOFBF, BLOCK_STATS_BUFFER_SIZE);
+
+	struct block_stats_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, BLOCK_STATS_FILE_MAGIC);
+	hdr.version = BLOCK_STATS_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.record_size = sizeof(struct block_record);
+	hdr.num_rates = job->num_rates;
+	hdr.num_blocks = job->num_blocks;
+	hdr.num_sims = job->num_sims;
+	if (fwrite(&hdr, sizeof(hdr), 1, bw->f) != 1) {
+		bw->failed = true;
+	}
+
+	for (int r = 0; r < job->num_rates; r++) {
+		if (fwrite(&job->rates[r].tps, sizeof(double), 1, bw->f) != 1) {
+			bw->failed = true;
+		}
+	}
+
+	if (pthread_create(&bw->thread, NULL, block_stats_run, bw) != 0) {
+		fprintf(stderr, "Failed to create block statistics thread\n");
+		exit(-2);
+	}
+}
+
+/*
+ * block_stats_stop()
+ *	Wait for a block statistics writer to write out everything and close the file.
+ */
+static void block_stats_stop(struct block_stats_writer *bw, const char *name)
+{
+	__atomic_store_n(&bw->finished, true, __ATOMIC_RELEASE);
+	pthread_join(bw->thread, NULL);
+
+	if (fclose(bw->f)) {
+		bw->failed = true;
+	}
+
+	if (bw->failed) {
+		fprintf(stderr, "Failed to write %s\n", name);
+		exit(-2);
+	}
+}
+
+/*
+ * size_table_build()
+ *	Read a histogram of transaction sizes from text file "in_name" and write it out as an
+ *	alias table to "out_name".  Each line of the histogram holds a size in bytes and a
+ *	count (or any other non-negative weight).  Blank lines and lines starting with '#'
+ *	are ignored.
+ */
+static void size_table_build(const char *in_name, const char *out_name)
+{
+	FILE *in = fopen(in_name, "r");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s\n", in_name);
+		exit(-2);
+	}
+
+	uint32_t n = 0;
+	uint32_t capacity = 0;
+	uint32_t *sizes = NULL;
+	double *weights = NULL;
+	double total = 0.0;
+	double total_bytes = 0.0;
+
+	char line[256];
+	int line_num = 0;
+	while (fgets(line, sizeof(line), in)) {
+		line_num++;
+
+		char *p = line + strspn(line, " \t");
+		if ((*p == '#') || (*p == '\n') || (*p == '\0')) {
+			continue;
+		}
+
+		long long int size;
+		double weight;
+		char extra;
+		if ((sscanf(p, "%lld %lf %c", &size, &weight, &extra) != 2) ||
+		    (size < 1) || (size > BLOCK_SIZE) || !(weight >= 0.0) || isinf(weight)) {
+			fprintf(stderr, "%s:%d: expected a size of 1 to %d bytes and a count\n", in_name, line_num, BLOCK_SIZE);
+			exit(-1);
+		}
+
+		if (weight == 0.0) {
+			continue;
+		}
+
+		if (n == capacity) {
+			capacity = capacity ? (capacity * 2) : 1024;
+			sizes = realloc(sizes, capacity * sizeof(uint32_t));
+			weights = realloc(weights, capacity * sizeof(double));
+			if (!sizes || !weights) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(-1);
+			}
+		}
+
+		sizes[n] = (uint32_t)size;
+		weights[n] = weight;
+		total += weight;
+		total_bytes += weight * (double)size;
+		n++;
+	}
+
+	fclose(in);
+
+	if (!n) {
+		fprintf(stderr, "%s: no transaction sizes found\n", in_name);
+		exit(-1);
+	}
+
+	struct size_alias_entry *entries = malloc(n * sizeof(struct size_alias_entry));
+	double *prob = malloc(n * sizeof(double));
+	uint32_t *small = malloc(n * sizeof(uint32_t));
+	uint32_t *large = malloc(n * sizeof(uint32_t));
+	if (!entries || !prob || !small || !large) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	/*
+	 * Vose's alias method.  Scale each probability so the average is 1, then repeatedly
+	 * fill up an entry that's below 1 with part of one that's above.
+	 */
+	uint32_t num_small = 0;
+	uint32_t num_large = 0;
+	uint32_t min_size = UINT32_MAX;
+	uint32_t max_size = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		prob[i] = (weights[i] * n) / total;
+		if (prob[i] < 1.0) {
+			small[num_small++] = i;
+		} else {
+			large[num_large++] = i;
+		}
+
+		if (min_size > sizes[i]) {
+			min_size = sizes[i];
+		}
+
+		if (max_size < sizes[i]) {
+			max_size = sizes[i];
+		}
+	}
+
+	while (num_small && num_large) {
+		uint32_t s = small[--num_small];
+		uint32_t l = large[num_large - 1];
+		entries[s].threshold = (uint32_t)(prob[s] * 4294967296.0);
+		entries[s].size = sizes[s];
+		entries[s].alias_size = sizes[l];
+
+		prob[l] -= 1.0 - prob[s];
+		if (prob[l] < 1.0) {
+			num_large--;
+			small[num_small++] = l;
+		}
+	}
+
+	/*
+	 * Whatever is left over is 1 to within rounding error, so it never uses its alias.
+	 */
+	while (num_large) {
+		uint32_t l = large[--num_large];
+		entries[l].threshold = UINT32_MAX;
+		entries[l].size = sizes[l];
+		entries[l].alias_size = sizes[l];
+	}
+
+	while (num_small) {
+		uint32_t s = small[--num_small];
+		entries[s].threshold = UINT32_MAX;
+		entries[s].size = sizes[s];
+		entries[s].alias_size = sizes[s];
+	}
+
+	struct size_table_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, SIZE_TABLE_FILE_MAGIC);
+	hdr.version = SIZE_TABLE_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.num_entries = n;
+	hdr.min_size = min_size;
+	hdr.max_size = max_size;
+	hdr.mean_size = total_bytes / total;
+
+	FILE *out = fopen(out_name, "wb");
+	if (!out) {
+		fprintf(stderr, "Failed to create %s\n", out_name);
+		exit(-2);
+	}
+
+	if ((fwrite(&hdr, sizeof(hdr), 1, out) != 1) ||
+	    (fwrite(entries, sizeof(struct size_alias_entry), n, out) != n) ||
+	    fclose(out)) {
+		fprintf(stderr, "Failed to write %s\n", out_name);
+		exit(-2);
+	}
+
+	fprintf(stderr, "Size table: %u sizes, %u to %u bytes, mean %.1f bytes\n", n, min_size, max_size, hdr.mean_size);
+
+	free(large);
+	free(small);
+	free(prob);
+	free(entries);
+	free(weights);
+	free(sizes);
+}
+
+/*
+ * size_table_open()
+ *	Map the transaction size table in file "name".  The mapping is read-only so the
+ *	pages are shared by every thread (and every process) that uses the same file.
+ */
+static void size_table_open(struct size_table *st, const char *name)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		exit(-2);
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Failed to read %s\n", name);
+		exit(-2);
+	}
+
+	if ((size_t)sb.st_size < sizeof(struct size_table_file_header)) {
+		fprintf(stderr, "%s is not a transaction size table\n", name);
+		exit(-1);
+	}
+
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		exit(-2);
+	}
+
+	const struct size_table_file_header *hdr = map;
+	if (memcmp(hdr->magic, SIZE_TABLE_FILE_MAGIC, sizeof(hdr->magic)) ||
+	    (hdr->version != SIZE_TABLE_FILE_VERSION) ||
+	    (hdr->header_size != sizeof(struct size_table_file_header)) ||
+	    !hdr->num_entries ||
+	    ((size_t)sb.st_size != sizeof(struct size_table_file_header) + ((size_t)hdr->num_entries * sizeof(struct size_alias_entry))) ||
+	    !hdr->min_size || (hdr->min_size > hdr->max_size) || (hdr->max_size > BLOCK_SIZE) ||
+	    !(hdr->mean_size >= hdr->min_size) || !(hdr->mean_size <= hdr->max_size)) {
+		fprintf(stderr, "%s is not a valid transaction size table\n", name);
+		exit(-1);
+	}
+
+	/*
+	 * The simulation trusts every size that it draws, so check them all now.  An entry
+	 * holds its alias's size rather than its index, so both have to lie within the
+	 * header's range.
+	 */
+	const struct size_alias_entry *entries = (const struct size_alias_entry *)((const char *)map + hdr->header_size);
+	for (uint32_t i = 0; i < hdr->num_entries; i++) {
+		const struct size_alias_entry *e = &entries[i];
+		if ((e->size < hdr->min_size) || (e->size > hdr->max_size) ||
+		    (e->alias_size < hdr->min_size) || (e->alias_size > hdr->max_size)) {
+			fprintf(stderr, "%s: entry %u has a size outside %u to %u bytes\n", name, i, hdr->min_size, hdr->max_size);
+			exit(-1);
+		}
+	}
+
+	st->entries = entries;
+	st->num_entries = hdr->num_entries;
+	st->max_size = hdr->max_size;
+	st->mean_size = hdr->mean_size;
+	st->map = map;
+	st->map_size = sb.st_size;
+
+	madvise(map, sb.st_size, MADV_WILLNEED);
+}
+
+/*
+ * size_table_close()
+ *	Unmap a transaction size table.
+ */
+static void size_table_close(struct size_table *st)
+{
+	munmap(st->map, st->map_size);
+	st->map = NULL;
+	st->entries = NULL;
+}
+
+/*
+ * digest_mix()
+ *	Mix "v" into digest "digest" and return the result.
+ */
+static uint64_t digest_mix(uint64_t digest, uint64_t v)
+{
+	uint64_t x = digest ^ v;
+	return splitmix64(&x);
+}
+
+/*
+ * size_table_digest()
+ *	Return a digest of the entries in a transaction size table.
+ */
+static uint64_t size_table_digest(const struct size_table *st)
+{
+	uint64_t digest = digest_mix(0, st->num_entries);
+	for (uint32_t i = 0; i < st->num_entries; i++) {
+		const struct size_alias_entry *e = &st->entries[i];
+		digest = digest_mix(digest, ((uint64_t)e->threshold << 32) | e->size);
+		digest = digest_mix(digest, e->alias_size);
+	}
+
+	return digest;
+}
+
+/*
+ * rate_profile_load()
+ *	Load an arrival rate profile from text file "name".  Each line gives the length of a
+ *	segment of the cycle in seconds and the relative arrival rate during it.  Only the
+ *	ratios of the rates matter.
+ */
+static void rate_profile_load(struct rate_profile *rp, const char *name)
+{
+	FILE *in = fopen(name, "r");
+	if (!in) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		exit(-2);
+	}
+
+	int n = 0;
+	int capacity = 0;
+	struct rate_segment *segs = NULL;
+	double *rates = NULL;
+	double period = 0.0;
+	double total = 0.0;
+
+	char line[256];
+	int line_num = 0;
+	while (fgets(line, sizeof(line), in)) {
+		line_num++;
+
+		char *p = line + strspn(line, " \t");
+		if ((*p == '#') || (*p == '\n') || (*p == '\0')) {
+			continue;
+		}
+
+		double duration;
+		double rate;
+		char extra;
+		if ((sscanf(p, "%lf %lf %c", &duration, &rate, &extra) != 2) ||
+		    !(duration > 0.0) || isinf(duration) || !(rate >= 0.0) || isinf(rate)) {
+			fprintf(stderr, "%s:%d: expected a duration in seconds and a relative rate\n", name, line_num);
+			exit(-1);
+		}
+
+		if (n == capacity) {
+			capacity = capacity ? (capacity * 2) : 64;
+			segs = realloc(segs, capacity * sizeof(struct rate_segment));
+			rates = realloc(rates, capacity * sizeof(double));
+			if (!segs || !rates) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(-1);
+			}
+		}
+
+		segs[n].start = period;
+		rates[n] = rate;
+		period += duration;
+		total += duration * rate;
+		n++;
+	}
+
+	fclose(in);
+
+	if (!(total > 0.0)) {
+		fprintf(stderr, "%s: no non-zero arrival rates found\n", name);
+		exit(-1);
+	}
+
+	/*
+	 * Scale the rates to average 1 and lay the segments out in operational time.  The
+	 * last segment ends at exactly one period so that rounding doesn't leave a gap.
+	 */
+	double scale = period / total;
+	double op = 0.0;
+	for (int i = 0; i < n; i++) {
+		double end = (i == (n - 1)) ? period : segs[i + 1].start;
+		double rate = rates[i] * scale;
+		segs[i].op_start = op;
+		op += (end - segs[i].start) * rate;
+		segs[i].op_end = (i == (n - 1)) ? period : op;
+		segs[i].inv_rate = (rate > 0.0) ? (1.0 / rate) : 0.0;
+	}
+
+	free(rates);
+
+	rp->segs = segs;
+	rp->num_segs = n;
+	rp->period = period;
+}
+
+/*
+ * rate_profile_digest()
+ *	Return a digest of an arrival rate profile's period and segments, so that checkpoints
+ *	can tell whether they were made with the same profile.  It's never 0, which stands
+ *	for no profile at all.
+ */
+static uint64_t rate_profile_digest(const struct rate_profile *rp)
+{
+	uint64_t x = (uint64_t)rp->num_segs;
+	uint64_t digest = splitmix64(&x);
+	for (int i = -1; i < rp->num_segs; i++) {
+		double v[4] = {rp->period, 0.0, 0.0, 0.0};
+		if (i >= 0) {
+			v[0] = rp->segs[i].start;
+			v[1] = rp->segs[i].op_start;
+			v[2] = rp->segs[i].op_end;
+			v[3] = rp->segs[i].inv_rate;
+		}
+
+		for (int j = 0; j < 4; j++) {
+			uint64_t bits;
+			memcpy(&bits, &v[j], sizeof(bits));
+			x = digest ^ bits;
+			digest = splitmix64(&x);
+		}
+	}
+
+	return digest ? digest : 1;
+}
+
+/*
+ * sim_config_digest()
+ *	Return a digest of the parts of a configuration that change what its results mean,
+ *	other than the rate, block size and number of blocks that each set of results is
+ *	labelled with: the queue discipline, size table, rate profile, hash rate model and
+ *	use of common random numbers.  Results with different digests mustn't be added
+ *	together.
+ */
+static uint64_t sim_config_digest(const struct sim_config *cfg)
+{
+	uint64_t digest = digest_mix(0, (uint64_t)cfg->discipline);
+	digest = digest_mix(digest, cfg->crn);
+	digest = digest_mix(digest, cfg->hash_model);
+	if (cfg->hash_model) {
+		uint64_t bits;
+		memcpy(&bits, &cfg->hash_growth, sizeof(bits));
+		digest = digest_mix(digest, bits);
+	}
+
+	digest = digest_mix(digest, cfg->sizes ? size_table_digest(cfg->sizes) : 0);
+	digest = digest_mix(digest, cfg->profile ? rate_profile_digest(cfg->profile) : 0);
+
+	/*
+	 * The GPU draws its random numbers differently, so a seed doesn't name the same
+	 * simulations there as it does on the CPU.
+	 */
+	if (cfg->gpu) {
+		digest = digest_mix(digest, GPU_DIGEST_KEY);
+	}
+
+	return digest;
+}
+
+/*
+ * rate_profile_destroy()
+ *	Release an arrival rate profile.
+ */
+static void rate_profile_destroy(struct rate_profile *rp)
+{
+	free(rp->segs);
+	rp->segs = NULL;
+	rp->num_segs = 0;
+}
+
+/*
+ * Two-sided 95% critical values of Student's t distribution for 1 to 30 degrees of
+ * freedom.  Beyond that we use the normal distribution's value.
+ */
+static const double t_critical_95[30] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+/*
+ * ci_monitor_add()
+ *	Add the percentiles of one batch, "p", to a convergence monitor and work out if
+ *	they've all converged to within a relative confidence interval of "target".  The
+ *	interval is the full width of the 95% confidence interval of the mean of the batch
+ *	percentiles, divided by that mean.
+ */
+static void ci_monitor_add(struct ci_monitor *ci, const double *p, int num_percentiles, double target)
+{
+	ci->num_batches++;
+	double n = (double)ci->num_batches;
+	for (int i = 0; i < num_percentiles; i++) {
+		double delta = p[i] - ci->mean[i];
+		ci->mean[i] += delta / n;
+		ci->m2[i] += delta * (p[i] - ci->mean[i]);
+	}
+
+	if (ci->num_batches < CI_MIN_BATCHES) {
+		return;
+	}
+
+	int df = ci->num_batches - 1;
+	double t = (df <= 30) ? t_critical_95[df - 1] : 1.960;
+	for (int i = 0; i < num_percentiles; i++) {
+		double width = 2.0 * t * sqrt(ci->m2[i] / (n * (n - 1.0)));
+		if (!(width <= target * ci->mean[i])) {
+			return;
+		}
+	}
+
+	__atomic_store_n(&ci->converged, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * task_deque_init()
+ *	Initialize an empty task deque with room for at least "capacity" tasks.
+ */
+static void task_deque_init(struct task_deque *d, int capacity)
+{
+	int64_t n = 1;
+	while (n < capacity) {
+		n <<= 1;
+	}
+
+	d->tasks = malloc(n * sizeof(struct sim_task));
+	if (!d->tasks) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	d->top = 0;
+	d->bottom = 0;
+	d->mask = n - 1;
+}
+
+/*
+ * task_deque_destroy()
+ *	Release a task deque's buffer.
+ */
+static void task_deque_destroy(struct task_deque *d)
+{
+	free(d->tasks);
+	d->tasks = NULL;
+}
+
+/*
+ * task_deque_push()
+ *	Add a task to the bottom of the deque that we own.  Returns false if there's no room
+ *	for it.
+ */
+static bool task_deque_push(struct task_deque *d, const struct sim_task *task)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if ((b - t) > d->mask) {
+		return false;
+	}
+
+	d->tasks[b & d->mask] = *task;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/*
+ * task_deque_take()
+ *	Take the task at the bottom of the deque that we own.  Returns false if it's empty.
+ *	When there's only one task left we race any thieves for it on "top".
+ */
+static bool task_deque_take(struct task_deque *d, struct sim_task *task)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	*task = d->tasks[b & d->mask];
+	if (t < b) {
+		return true;
+	}
+
+	bool won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return won;
+}
+
+/*
+ * task_deque_steal()
+ *	Try to steal the task at the top of another worker's deque.
+ *
+ * The owner can only reuse the slot that we read once "top" has moved past it, in which
+ * case our compare-and-swap fails and we throw away what we read.
+ */
+static enum steal_result task_deque_steal(struct task_deque *d, struct sim_task *task)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return STEAL_EMPTY;
+	}
+
+	struct sim_task x = d->tasks[t & d->mask];
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return STEAL_RETRY;
+	}
+
+	*task = x;
+	return STEAL_SUCCESS;
+}
+
+/*
+ * sim_tasks_share()
+ *	Work out the tasks that worker "i" starts with: the runs of work items that aren't
+ *	already done in its share of each rate.  They're pushed onto "d", if it's not NULL,
+ *	last first so that the worker takes them in order and other workers steal from the
+ *	last rate.  Returns the number of tasks and adds their items to "*items".
+ */
+static int sim_tasks_share(const struct sim_job *job, int i, struct task_deque *d, long long int *items)
+{
+	int count = 0;
+	for (int r = job->num_rates - 1; r >= 0; r--) {
+		int base = r * job->items_per_rate;
+		int first = (int)(((long long int)job->items_per_rate * i) / job->num_workers);
+		int k = (int)(((long long int)job->items_per_rate * (i + 1)) / job->num_workers);
+		while (k > first) {
+			while ((k > first) && job->item_done[base + k - 1]) {
+				k--;
+			}
+
+			int end = k;
+			while ((k > first) && !job->item_done[base + k - 1]) {
+				k--;
+			}
+
+			if (end > k) {
+				if (d) {
+					struct sim_task task = {r, base + k, end - k};
+					task_deque_push(d, &task);
+				}
+
+				*items += end - k;
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+ * sim_tasks_deal()
+ *	Share out a job's work items between its workers' deques.
+ */
+static void sim_tasks_deal(struct sim_job *job)
+{
+	long long int items = 0;
+	for (int i = 0; i < job->num_workers; i++) {
+		struct sim_worker *w = &job->workers[i];
+		long long int n = 0;
+		task_deque_init(&w->deque, sim_tasks_share(job, i, NULL, &n) + TASK_DEQUE_SPARE);
+		sim_tasks_share(job, i, &w->deque, &items);
+	}
+
+	job->unclaimed_items = items;
+}
+
+/*
+ * sim_task_steal()
+ *	Try to steal a task from each of the other workers in turn, starting at a random one.
+ *	Returns false if none of them had one.
+ */
+static bool sim_task_steal(struct sim_worker *w, struct sim_task *task)
+{
+	struct sim_job *job = w->job;
+	int n = job->num_workers;
+	if (n < 2) {
+		return false;
+	}
+
+	int first = (int)((splitmix64(&w->steal_state) >> 32) % (uint64_t)n);
+	for (int k = 0; k < n; k++) {
+		struct sim_worker *victim = &job->workers[(first + k) % n];
+		if (victim == w) {
+			continue;
+		}
+
+		enum steal_result res;
+		while ((res = task_deque_steal(&victim->deque, task)) == STEAL_RETRY) {
+		}
+
+		if (res == STEAL_SUCCESS) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * sim_chunk_items()
+ *	Work out how many work items at rate "r" a worker should take at once.  Until we know
+ *	what a simulation costs we take one, and convergence monitoring always takes one as
+ *	each is a batch.
+ */
+static int sim_chunk_items(const struct sim_worker *w, int r)
+{
+	const struct sim_job *job = w->job;
+	double ns = w->sim_ns[r];
+	if ((job->target_ci > 0.0) || !(ns > 0.0)) {
+		return 1;
+	}
+
+	double n = SIM_CHUNK_TARGET_NS / (ns * (double)job->item_sims);
+	if (n < 1.0) {
+		return 1;
+	}
+
+	return (n < (double)job->items_per_rate) ? (int)n : job->items_per_rate;
+}
+
+/*
+ * sim_task_next()
+ *	Find the next chunk of work for a worker: the task at the bottom of its own deque or
+ *	else one stolen from another worker, cut down to the chunk size for its rate.  Returns
+ *	false once every work item has been taken.
+ *
+ * A task that's too big is split in half, and the second half pushed back for us or a
+ * thief to take later, until what's left is small enough.  That leaves the biggest
+ * pieces at the top of the deque for thieves.
+ */
+static bool sim_task_next(struct sim_worker *w, struct sim_task *task)
+{
+	struct sim_job *job = w->job;
+	while (1) {
+		if (!task_deque_take(&w->deque, task) && !sim_task_steal(w, task)) {
+			/*
+			 * Items that other workers are still splitting up haven't been claimed yet,
+			 * so we might be able to steal some of them in a moment.
+			 */
+			if (!__atomic_load_n(&job->unclaimed_items, __ATOMIC_ACQUIRE)) {
+				return false;
+			}
+
+			sched_yield();
+			continue;
+		}
+
+		/*
+		 * There's no point running any more simulations at a rate that's converged.
+		 */
+		if (__atomic_load_n(&job->rates[task->rate * job->num_lanes].ci.converged, __ATOMIC_RELAXED)) {
+			__atomic_sub_fetch(&job->unclaimed_items, task->num_items, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		int chunk = sim_chunk_items(w, task->rate);
+		while (task->num_items > chunk) {
+			struct sim_task rest;
+			rest.rate = task->rate;
+			rest.num_items = task->num_items / 2;
+			rest.first_item = task->first_item + task->num_items - rest.num_items;
+			if (!task_deque_push(&w->deque, &rest)) {
+				break;
+			}
+
+			task->num_items -= rest.num_items;
+		}
+
+		__atomic_sub_fetch(&job->unclaimed_items, task->num_items, __ATOMIC_RELEASE);
+		return true;
+	}
+}
+
+/*
+ * sim_worker_keep()
+ *	Add the results in a worker's lanes to the results that it's keeping for rate "r".
+ *	Nobody else looks at them until the worker has finished, so this needs no lock.
+ *	Each rate's results are only allocated once the worker first runs a task at it.
+ */
+static void sim_worker_keep(struct sim_worker *w, int r, int num_sims)
+{
+	struct sim_context *ctx = &w->ctx;
+	struct sim_job *job = w->job;
+	for (int l = 0; l < ctx->num_lanes; l++) {
+		struct sim_rate *res = &w->results[(r * job->num_lanes) + l];
+		if (!res->hist.buckets) {
+			if (job->sketch_accuracy > 0.0) {
+				ddsketch_init(&res->sketch, job->sketch_accuracy);
+				histogram_init(&res->hist, ctx->lanes[l].hist.tables, &res->sketch);
+			} else {
+				histogram_init(&res->hist, ctx->lanes[l].hist.tables, NULL);
+			}
+		}
+
+		histogram_merge(&res->hist, &ctx->lanes[l].hist);
+		res->num_sims += num_sims;
+	}
+}
+
+/*
+ * sim_worker_reduce()
+ *	Add the results that a worker has kept into its job's results, and release them.
+ *	This is only called once the worker has finished.
+ */
+static void sim_worker_reduce(struct sim_worker *w)
+{
+	struct sim_job *job = w->job;
+	for (int i = 0; i < job->num_rates * job->num_lanes; i++) {
+		struct sim_rate *res = &w->results[i];
+		if (!res->hist.buckets) {
+			continue;
+		}
+
+		histogram_merge(&job->rates[i].hist, &res->hist);
+		job->rates[i].num_sims += res->num_sims;
+		if (res->hist.sketch) {
+			ddsketch_destroy(res->hist.sketch);
+		}
+
+		histogram_destroy(&res->hist);
+	}
+
+	free(w->results);
+	w->results = NULL;
+}
+
+/*
+ * sim_worker_run()
+ *	Thread entry point that runs work until there's none left.
+ */
+static void *sim_worker_run(void *arg)
+{
+	struct sim_worker *w = (struct sim_worker *)arg;
+	struct sim_context *ctx = &w->ctx;
+	struct sim_job *job = w->job;
+
+	PROFILE_THREAD_START();
+
+	struct sim_task task;
+	while (sim_task_next(w, &task)) {
+		int r = task.rate;
+		struct sim_rate *rate = &job->rates[r * job->num_lanes];
+		int first_sim = (task.first_item % job->items_per_rate) * job->item_sims;
+		int end_sim = first_sim + (task.num_items * job->item_sims);
+		if (end_sim > job->num_sims) {
+			end_sim = job->num_sims;
+		}
+
+		for (int l = 0; l < ctx->num_lanes; l++) {
+			histogram_clear(&ctx->lanes[l].hist);
+		}
+
+		uint64_t start_ns = now_ns();
+		for (int j = first_sim; j < end_sim; j++) {
+			ctx->rate_index = r;
+			ctx->sim_index = j;
+			sim_simulate(ctx, job->seed, ((uint64_t)r * job->num_sims) + j, (uint32_t)j, rate->tps * job->tps_scale, job->num_blocks);
+		}
+
+		/*
+		 * Update our estimate of what a simulation costs at this rate, so that we know how
+		 * many work items to take next time.
+		 */
+		int num_sims = end_sim - first_sim;
+		double ns = (double)(now_ns() - start_ns) / (double)num_sims;
+		if (w->sim_ns[r] > 0.0) {
+			w->sim_ns[r] += SIM_COST_WEIGHT * (ns - w->sim_ns[r]);
+		} else {
+			w->sim_ns[r] = ns;
+		}
+
+		if (!job->merge_items) {
+			sim_worker_keep(w, r, num_sims);
+		} else {
+			/*
+			 * If we're watching for convergence then this task is one batch.  Work out its
+			 * percentiles before we take the lock.
+			 */
+			double p[CI_MAX_PERCENTILES];
+			for (int i = 0; i < job->num_ci_percentiles; i++) {
+				p[i] = histogram_percentile(&ctx->lanes[0].hist, job->ci_percentiles[i]);
+			}
+
+			pthread_mutex_lock(&job->lock);
+			for (int l = 0; l < ctx->num_lanes; l++) {
+				histogram_merge(&rate[l].hist, &ctx->lanes[l].hist);
+				rate[l].num_sims += num_sims;
+				if (job->unsaved) {
+					histogram_merge(&job->unsaved[(r * job->num_lanes) + l].hist, &ctx->lanes[l].hist);
+				}
+			}
+
+			memset(&job->item_done[task.first_item], 1, task.num_items);
+
+			if ((job->target_ci > 0.0) && !rate->ci.converged) {
+				ci_monitor_add(&rate->ci, p, job->num_ci_percentiles, job->target_ci);
+				if (rate->ci.converged && !job->quiet) {
+					fprintf(stderr, "TPS: %f converged after %lld simulations\n", rate->tps, rate->num_sims);
+				}
+			}
+
+			if (job->live && (now_ns() >= job->live->next_ns)) {
+				live_publish(job->live, job, false);
+			}
+
+			pthread_mutex_unlock(&job->lock);
+		}
+
+		long long int done = __atomic_add_fetch(&job->sims_done, num_sims, __ATOMIC_RELAXED);
+		if (!job->quiet && ((done / job->divisor) != ((done - num_sims) / job->divisor))) {
+			fprintf(stderr, "Sims: %lld of %lld completed\n", done, job->total_sims);
+		}
+	}
+
+	PROFILE_THREAD_REPORT(w->index);
+
+	return NULL;
+}
+
+/*
+ * sim_run()
+ *	Simulate mining at each of a configuration's transaction rates.  Returns the results
+ *	for each rate, which the caller must free, and fills in "stats".
+ */
+static struct sim_rate *sim_run(const struct sim_config *cfg, struct sim_stats *stats)
+{
+	int num_rates = cfg->num_rates;
+	int num_blocks = cfg->num_blocks;
+	int num_sims = cfg->num_sims;
+	int num_threads = cfg->num_threads;
+	const struct bucket_tables *tables = bucket_tables_find(cfg->buckets_per_order);
+
+	struct sim_job job;
+	memset(&job, 0, sizeof(job));
+	pthread_mutex_init(&job.lock, NULL);
+
+	/*
+	 * Each rate has a set of results for each block size.
+	 */
+	int num_lanes = cfg->num_block_sizes;
+	job.rates = calloc(num_rates * num_lanes, sizeof(struct sim_rate));
+	struct sim_worker *workers = calloc(num_threads, sizeof(struct sim_worker));
+	if (!job.rates || !workers) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	for (int r = 0; r < num_rates * num_lanes; r++) {
+		job.rates[r].tps = cfg->tps[r / num_lanes];
+		job.rates[r].block_size = cfg->block_sizes[r % num_lanes];
+		if (cfg->sketch_accuracy > 0.0) {
+			ddsketch_init(&job.rates[r].sketch, cfg->sketch_accuracy);
+			histogram_init(&job.rates[r].hist, tables, &job.rates[r].sketch);
+		} else {
+			histogram_init(&job.rates[r].hist, tables, NULL);
+		}
+	}
+
+	job.num_rates = num_rates;
+	job.num_lanes = num_lanes;
+	job.num_blocks = num_blocks;
+	job.num_sims = num_sims;
+	job.seed = cfg->seed;
+	job.seed_given = cfg->seed_given;
+	job.discipline = cfg->discipline;
+	job.config_digest = sim_config_digest(cfg);
+	job.quiet = cfg->quiet;
+	job.checkpoint_name = cfg->checkpoint_name;
+	job.checkpoint_interval = cfg->checkpoint_interval;
+	pthread_cond_init(&job.wake, NULL);
+	job.target_ci = cfg->target_ci;
+	job.num_ci_percentiles = (cfg->target_ci > 0.0) ? cfg->num_ci_percentiles : 0;
+	job.ci_percentiles = cfg->ci_percentiles;
+	job.hash_model = cfg->hash_model;
+	job.hash_growth = cfg->hash_growth;
+	job.crn = cfg->crn;
+	job.profile_digest = cfg->profile ? rate_profile_digest(cfg->profile) : 0;
+
+	/*
+	 * A TPS of 3.5 means transactions arrive at the network's capacity.  With variable
+	 * sizes we keep that meaning by scaling the arrival rate by the mean size.
+	 */
+	job.tps_scale = cfg->sizes ? ((double)TRANSACTION_SIZE / cfg->sizes->mean_size) : 1.0;
+
+	job.total_sims = (long long int)num_sims * num_rates;
+	job.divisor = job.total_sims / 100;
+	if (job.divisor == 0) {
+		job.divisor = 1;
+	}
+
+	/*
+	 * Split the simulation runs at each rate into work items.  Every run is independent
+	 * so the way they're shared out doesn't change the results.
+	 */
+	job.item_sims = num_sims / (num_threads * ITEMS_PER_THREAD);
+
+	/*
+	 * When we're watching for convergence each work item is a batch, and we need lots of
+	 * them to get a good estimate of the variance.
+	 */
+	if (cfg->target_ci > 0.0) {
+		job.item_sims = num_sims / CI_MAX_BATCHES;
+	}
+
+	if (job.item_sims == 0) {
+		job.item_sims = 1;
+	}
+
+	job.items_per_rate = (num_sims + job.item_sims - 1) / job.item_sims;
+
+	job.item_done = calloc(num_rates * job.items_per_rate, 1);
+	if (!job.item_done) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	/*
+	 * If we're resuming then pick up the results so far, and the seed and work items
+	 * they came from, from the checkpoint.
+	 */
+	if (cfg->resume) {
+		long long int completed = checkpoint_read(&job);
+		fprintf(stderr, "Resuming from %s with %lld of %lld simulations completed, seed 0x%016" PRIx64 "\n",
+			job.checkpoint_name, completed, job.total_sims, job.seed);
+		job.sims_done = completed;
+	}
+
+	/*
+	 * The checkpoint thread starts out with nothing saved, so whatever we've resumed with
+	 * is unsaved to begin with.
+	 */
+	if (job.checkpoint_name) {
+		job.unsaved = calloc(num_rates * num_lanes, sizeof(struct sim_rate));
+		if (!job.unsaved) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+
+		for (int r = 0; r < num_rates * num_lanes; r++) {
+			histogram_init(&job.unsaved[r].hist, tables, NULL);
+			histogram_merge(&job.unsaved[r].hist, &job.rates[r].hist);
+		}
+	}
+
+	/*
+	 * Checkpoints, convergence monitoring and live results all need to know as soon as
+	 * each work item is done.  Otherwise each worker keeps its own results for every rate
+	 * that it works on, and they're added up once the workers have all been joined.
+	 */
+	job.merge_items = job.checkpoint_name || (job.target_ci > 0.0) || cfg->live_name;
+	job.sketch_accuracy = cfg->sketch_accuracy;
+	if (!job.merge_items) {
+		for (int i = 0; i < num_threads; i++) {
+			struct sim_worker *w = &workers[i];
+			w->results = calloc(num_rates * num_lanes, sizeof(struct sim_rate));
+			if (!w->results) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(-1);
+			}
+		}
+	}
+
+	/*
+	 * Share the work items out before any worker starts, so that if one can't be started
+	 * the others can still steal its share.
+	 */
+	job.workers = workers;
+	job.num_workers = num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		struct sim_worker *w = &workers[i];
+		w->job = &job;
+		w->index = i;
+		w->steal_state = job.seed ^ ((uint64_t)i * 0x9e3779b97f4a7c15ULL);
+		w->sim_ns = calloc(num_rates, sizeof(double));
+		if (!w->sim_ns) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+	}
+
+	sim_tasks_deal(&job);
+
+	struct live_writer live;
+	if (cfg->live_name) {
+		live_open(&live, cfg->live_name, &job, cfg->show_block_size);
+		job.live = &live;
+	}
+
+	pthread_t checkpoint_thread;
+	bool checkpointing = false;
+	if (job.checkpoint_name) {
+		if (pthread_create(&checkpoint_thread, NULL, checkpoint_run, &job) != 0) {
+			fprintf(stderr, "Failed to create checkpoint thread\n");
+			exit(-2);
+		}
+
+		checkpointing = true;
+	}
+
+	/*
+	 * If we're streaming block statistics then each worker gets a ring to put them in.
+	 */
+	struct block_ring **rings = NULL;
+	struct block_stats_writer block_stats;
+	if (cfg->block_stats_name) {
+		rings = calloc(num_threads, sizeof(struct block_ring *));
+		if (!rings) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+
+		for (int i = 0; i < num_threads; i++) {
+			void *p;
+			if (posix_memalign(&p, 64, sizeof(struct block_ring))) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(-1);
+			}
+
+			rings[i] = p;
+			rings[i]->head = 0;
+			rings[i]->cached_tail = 0;
+			rings[i]->tail = 0;
+		}
+
+		block_stats_start(&block_stats, cfg->block_stats_name, &job, rings, num_threads);
+	}
+
+	int started = 0;
+	for (int i = 0; i < num_threads; i++) {
+		struct sim_worker *w = &workers[i];
+		sim_context_init(&w->ctx, cfg, tables);
+		w->ctx.timing = cfg->timing;
+		w->ctx.profile = cfg->profile;
+		w->ctx.crn = cfg->crn;
+		w->ctx.crn_key[0] = (uint32_t)job.seed;
+		w->ctx.crn_key[1] = (uint32_t)(job.seed >> 32);
+		sim_arrivals_reset(&w->ctx);
+		w->ctx.schedule.enabled = cfg->hash_model;
+		w->ctx.schedule.growth = cfg->hash_model ? (log1p(cfg->hash_growth) / RETARGET_TIMESPAN) : 0.0;
+		w->ctx.block_ring = rings ? rings[i] : NULL;
+
+		if (pthread_create(&w->thread, NULL, sim_worker_run, w) != 0) {
+			fprintf(stderr, "Failed to create simulation thread\n");
+			sim_context_destroy(&w->ctx);
+			break;
+		}
+
+		started++;
+	}
+
+	/*
+	 * Wait for all of the workers to finish.
+	 */
+	memset(stats, 0, sizeof(struct sim_stats));
+	for (int i = 0; i < started; i++) {
+		struct sim_worker *w = &workers[i];
+		pthread_join(w->thread, NULL);
+		sim_stats_merge(stats, sim_context_stats(&w->ctx));
+		sim_context_destroy(&w->ctx);
+		if (w->results) {
+			sim_worker_reduce(w);
+		}
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		struct sim_worker *w = &workers[i];
+		task_deque_destroy(&w->deque);
+		free(w->sim_ns);
+		free(w->results);
+	}
+
+	stats->threads = started;
+
+	free(workers);
+
+	if (rings) {
+		block_stats_stop(&block_stats, cfg->block_stats_name);
+		for (int i = 0; i < num_threads; i++) {
+			free(rings[i]);
+		}
+
+		free(rings);
+	}
+
+	/*
+	 * Stop the checkpoint thread and write a final checkpoint with everything in it.
+	 */
+	if (checkpointing) {
+		pthread_mutex_lock(&job.lock);
+		job.finished = true;
+		pthread_cond_signal(&job.wake);
+		pthread_mutex_unlock(&job.lock);
+		pthread_join(checkpoint_thread, NULL);
+
+		if ((started != 0) && !checkpoint_write(&job, job.rates, job.item_done)) {
+			exit(-2);
+		}
+
+		for (int r = 0; r < num_rates * num_lanes; r++) {
+			histogram_destroy(&job.unsaved[r].hist);
+		}
+
+		free(job.unsaved);
+	}
+
+	if (job.live) {
+		live_close(job.live, &job);
+	}
+
+	pthread_cond_destroy(&job.wake);
+	pthread_mutex_destroy(&job.lock);
+	free(job.item_done);
+
+	if (started == 0) {
+		free(job.rates);
+		exit(-2);
+	}
+
+	/*
+	 * The seed is only settled now, as resuming from a checkpoint takes its seed.
+	 */
+	for (int r = 0; r < num_rates * num_lanes; r++) {
+		job.rates[r].seed = job.seed;
+		job.rates[r].config_digest = job.config_digest;
+	}
+
+	return job.rates;
+}
+
+/*
+ * output_rate()
+ *	Generate the output results for one rate in format "format".  If "tables" isn't
+ *	NULL then the results are converted to that resolution first.  Binary results are
+ *	labelled with the "num_seeds" master seeds in "seeds" of the runs they came from.
+ */
+static void output_rate(enum output_format format, const struct bucket_tables *tables, const struct sim_rate *rate, int num_blocks, long long int num_sims,
+			const uint64_t *seeds, uint32_t num_seeds, bool show_block_size)
+{
+	long long int block_size = show_block_size ? rate->block_size : 0;
+
+	const struct histogram *h = &rate->hist;
+	struct histogram *converted = NULL;
+	if (tables && (tables != h->tables)) {
+		converted = calloc(1, sizeof(struct histogram));
+		if (!converted) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+
+		histogram_convert(converted, tables, h);
+		h = converted;
+	}
+
+	switch (format) {
+	case OUTPUT_TEXT:
+		if (block_size) {
+			printf("initial TPS: %f, block size: %lld, num blocks: %d, num simulations: %lld\n-\n",
+			       rate->tps, block_size, num_blocks, num_sims);
+		} else {
+			printf("initial TPS: %f, num blocks: %d, num simulations: %lld\n-\n", rate->tps, num_blocks, num_sims);
+		}
+
+		output_results(h);
+		break;
+
+	case OUTPUT_CSV:
+		output_results_csv(h, rate->tps, block_size);
+		break;
+
+	case OUTPUT_BINARY:
+		if (!output_results_binary(stdout, h, rate->tps, rate->block_size, num_blocks, num_sims, rate->config_digest, seeds, num_seeds)) {
+			fprintf(stderr, "Failed to write results\n");
+			exit(-2);
+		}
+		break;
+
+	case OUTPUT_SUMMARY:
+		output_results_summary(h, rate->tps, block_size, num_blocks, num_sims);
+		break;
+	}
+
+	if (converted) {
+		histogram_destroy(converted);
+		free(converted);
+	}
+}
+
+#ifdef BTB_GPU
+/*
+ * gpu_sim_run()
+ *	Simulate mining at each of a configuration's transaction rates on the GPU, giving the
+ *	same results as sim_run() would in distribution.  Returns the results for each
+ *	rate, which the caller must free.
+ */
+static struct sim_rate *gpu_sim_run(const struct sim_config *cfg)
+{
+	const struct bucket_tables *tables = bucket_tables_find(cfg->buckets_per_order);
+	struct sim_rate *rates = calloc(cfg->num_rates, sizeof(struct sim_rate));
+	if (!rates) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	uint64_t config_digest = sim_config_digest(cfg);
+	long long int total_sims = (long long int)cfg->num_sims * cfg->num_rates;
+	long long int done = 0;
+	for (int r = 0; r < cfg->num_rates; r++) {
+		struct sim_rate *rate = &rates[r];
+		rate->tps = cfg->tps[r];
+		rate->block_size = cfg->block_sizes[0];
+		rate->seed = cfg->seed;
+		rate->config_digest = config_digest;
+		histogram_init(&rate->hist, tables, NULL);
+
+		/*
+		 * Simulations are numbered as they are on the CPU, so each rate gets its own.
+		 */
+		for (int first = 0; first < cfg->num_sims; first += GPU_BATCH_SIMS) {
+			int n = cfg->num_sims - first;
+			if (n > GPU_BATCH_SIMS) {
+				n = GPU_BATCH_SIMS;
+			}
+
+			gpu_simulate(cfg->seed, ((uint64_t)r * cfg->num_sims) + first, n, rate->tps, cfg->num_blocks, rate->block_size,
+				     &rate->hist);
+			rate->num_sims += n;
+			done += n;
+			if (!cfg->quiet) {
+				fprintf(stderr, "Sims: %lld of %lld completed\n", done, total_sims);
+			}
+		}
+	}
+
+	return rates;
+}
+#endif
+
+/*
+ * sim()
+ *	Simulate mining at each of a configuration's transaction rates and output the results.
+ */
+static void sim(const struct sim_config *cfg)
+{
+	int num_rates = cfg->num_rates;
+	int num_blocks = cfg->num_blocks;
+
+	struct sim_stats stats;
+#ifdef BTB_GPU
+	struct sim_rate *rates = cfg->gpu ? gpu_sim_run(cfg) : sim_run(cfg, &stats);
+#else
+	struct sim_rate *rates = sim_run(cfg, &stats);
+#endif
+
+	if (!cfg->gpu) {
+		fprintf(stderr, "Peak pending memory: %.1f MB across %d threads (deepest backlog %u transactions)\n",
+			(double)stats.pending_bytes / (1024.0 * 1024.0), stats.threads, stats.peak_pending);
+	}
+
+	/*
+	 * Produce output data, labelled with the rate that it belongs to.
+	 */
+	if (cfg->output_format == OUTPUT_CSV) {
+		output_csv_header(cfg->show_block_size);
+	} else if (cfg->output_format == OUTPUT_SUMMARY) {
+		output_summary_header(cfg->sketch_accuracy > 0.0, cfg->show_block_size);
+	}
+
+	int num_results = num_rates * cfg->num_block_sizes;
+	for (int r = 0; r < num_results; r++) {
+		output_rate(cfg->output_format, bucket_tables_find(cfg->output_buckets_per_order), &rates[r], num_blocks, rates[r].num_sims,
+			    &rates[r].seed, 1, cfg->show_block_size);
+		if (rates[r].hist.sketch) {
+			ddsketch_destroy(rates[r].hist.sketch);
+		}
+
+		histogram_destroy(&rates[r].hist);
+	}
+
+	free(rates);
+}
+
+/*
+ * Results for one rate gathered from a set of binary results files.
+ */
+struct merged_rate {
+	struct sim_rate rate;			/* Rate and its merged results */
+	int num_blocks;				/* Number of blocks per simulation */
+	long long int num_sims;			/* Total number of simulations */
+	uint64_t *seeds;			/* Master seeds of the runs merged so far */
+	uint32_t num_seeds;			/* Number of them */
+	uint32_t seeds_capacity;		/* Number that "seeds" has room for */
+};
+
+/*
+ * merge()
+ *	Add together the results in a set of binary results files and output them.  Records
+ *	for the same rate are merged, and the rates are output in the order that they're
+ *	first seen.  Each rate's results are converted to resolution "tables" if it's not
+ *	NULL, or otherwise to the resolution of the first record for that rate.
+ *
+ * Only independent runs of the same simulation can be added together, so we refuse
+ * records for a rate whose configuration digest differs from the others, or that repeat
+ * a master seed that's already been merged at that rate.
+ */
+static void merge(enum output_format format, const struct bucket_tables *tables, int num_files, char **names)
+{
+	struct merged_rate *merged = NULL;
+	int num_merged = 0;
+	int capacity = 0;
+
+	uint64_t *seeds = NULL;
+	uint32_t seeds_capacity = 0;
+
+	struct histogram *h = calloc(1, sizeof(struct histogram));
+	struct histogram *converted = calloc(1, sizeof(struct histogram));
+	if (!h || !converted) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	for (int i = 0; i < num_files; i++) {
+		FILE *f = fopen(names[i], "rb");
+		if (!f) {
+			fprintf(stderr, "Failed to open %s\n", names[i]);
+			exit(-2);
+		}
+
+		int records = 0;
+		while (1) {
+			int ch = getc(f);
+			if (ch == EOF) {
+				break;
+			}
+
+			ungetc(ch, f);
+
+			struct histogram_file_header hdr;
+			if (!input_results_binary(f, h, &hdr, &seeds, &seeds_capacity)) {
+				fprintf(stderr, "%s: record %d is not a valid histogram\n", names[i], records);
+				exit(-1);
+			}
+
+			records++;
+
+			int m;
+			for (m = 0; m < num_merged; m++) {
+				if ((merged[m].rate.tps == hdr.tps) && (merged[m].rate.block_size == hdr.block_size)) {
+					break;
+				}
+			}
+
+			if (m == num_merged) {
+				if (num_merged == capacity) {
+					capacity = capacity ? (capacity * 2) : 16;
+					merged = realloc(merged, capacity * sizeof(struct merged_rate));
+					if (!merged) {
+						fprintf(stderr, "Out of memory!\n");
+						exit(-1);
+					}
+				}
+
+				merged[m].rate.tps = hdr.tps;
+				merged[m].rate.block_size = hdr.block_size;
+				merged[m].rate.config_digest = hdr.config_digest;
+				histogram_init(&merged[m].rate.hist, tables ? tables : h->tables, NULL);
+				merged[m].num_blocks = hdr.num_blocks;
+				merged[m].num_sims = 0;
+				merged[m].seeds = NULL;
+				merged[m].num_seeds = 0;
+				merged[m].seeds_capacity = 0;
+				num_merged++;
+			}
+
+			struct merged_rate *mr = &merged[m];
+			if (mr->num_blocks != hdr.num_blocks) {
+				fprintf(stderr, "%s: TPS %f was simulated with %d blocks, not %d\n",
+					names[i], hdr.tps, hdr.num_blocks, mr->num_blocks);
+				exit(-1);
+			}
+
+			if (hdr.config_digest != mr->rate.config_digest) {
+				fprintf(stderr, "%s: TPS %f was simulated with a different configuration (queue, sizes, rate profile, "
+					"hash rate growth or common random numbers)\n", names[i], hdr.tps);
+				exit(-1);
+			}
+
+			for (uint32_t s = 0; s < hdr.num_seeds; s++) {
+				for (uint32_t k = 0; k < mr->num_seeds; k++) {
+					if (mr->seeds[k] == seeds[s]) {
+						fprintf(stderr, "%s: TPS %f has results from seed 0x%016" PRIx64 ", which have already been merged\n",
+							names[i], hdr.tps, seeds[s]);
+						exit(-1);
+					}
+				}
+
+				if (mr->num_seeds == mr->seeds_capacity) {
+					mr->seeds_capacity = mr->seeds_capacity ? (mr->seeds_capacity * 2) : 16;
+					mr->seeds = realloc(mr->seeds, mr->seeds_capacity * sizeof(uint64_t));
+					if (!mr->seeds) {
+						fprintf(stderr, "Out of memory!\n");
+						exit(-1);
+					}
+				}
+
+				mr->seeds[mr->num_seeds++] = seeds[s];
+			}
+
+			if (h->tables == merged[m].rate.hist.tables) {
+				histogram_merge(&merged[m].rate.hist, h);
+			} else {
+				histogram_convert(converted, merged[m].rate.hist.tables, h);
+				histogram_merge(&merged[m].rate.hist, converted);
+			}
+
+			merged[m].num_sims += hdr.num_sims;
+		}
+
+		if (ferror(f)) {
+			fprintf(stderr, "Failed to read %s\n", names[i]);
+			exit(-2);
+		}
+
+		fclose(f);
+	}
+
+	/*
+	 * Label the results with their block sizes unless they're all the default.
+	 */
+	bool show_block_size = false;
+	for (int m = 0; m < num_merged; m++) {
+		if (merged[m].rate.block_size != BLOCK_SIZE) {
+			show_block_size = true;
+		}
+	}
+
+	if (format == OUTPUT_CSV) {
+		output_csv_header(show_block_size);
+	} else if (format == OUTPUT_SUMMARY) {
+		output_summary_header(false, show_block_size);
+	}
+
+	for (int m = 0; m < num_merged; m++) {
+		output_rate(format, NULL, &merged[m].rate, merged[m].num_blocks, merged[m].num_sims, merged[m].seeds, merged[m].num_seeds,
+			    show_block_size);
+		histogram_destroy(&merged[m].rate.hist);
+		free(merged[m].seeds);
+	}
+
+	free(merged);
+	free(seeds);
+	histogram_destroy(converted);
+	free(converted);
+	histogram_destroy(h);
+	free(h);
+}
+
+/*
+ * watch_writer_running()
+ *	Return true if the job writing a live results file is still running.
+ */
+static bool watch_writer_running(const struct live_file_header *live)
+{
+	return !kill((pid_t)live->writer_pid, 0) || (errno != ESRCH);
+}
+
+/*
+ * watch_snapshot()
+ *	Take a consistent copy of a live results file, retrying whenever the job publishes
+ *	while we're copying.  File "name" is only used to report a job that died part way
+ *	through publishing.
+ */
+static void watch_snapshot(void *copy, const void *map, size_t size, const char *name)
+{
+	const struct live_file_header *live = map;
+	while (1) {
+		uint64_t seq = __atomic_load_n(&live->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			if (!watch_writer_running(live)) {
+				fprintf(stderr, "%s: job %d stopped while publishing its results\n", name, (int)live->writer_pid);
+				exit(-1);
+			}
+
+			sched_yield();
+			continue;
+		}
+
+		memcpy(copy, map, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&live->seq, __ATOMIC_RELAXED) == seq) {
+			return;
+		}
+	}
+}
+
+/*
+ * watch()
+ *	Output the results in a running job's live results file every "interval" seconds,
+ *	whenever they've changed, until the job's finished.  We only ever read the file, so
+ *	watching doesn't slow the job down.  If the job dies before it finishes then we
+ *	output its last results and exit with an error.
+ */
+static void watch(enum output_format format, const char *name, int interval)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		exit(-2);
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Failed to read %s\n", name);
+		exit(-2);
+	}
+
+	if ((size_t)sb.st_size < sizeof(struct live_file_header)) {
+		fprintf(stderr, "%s is not a live results file\n", name);
+		exit(-1);
+	}
+
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", name);
+		exit(-2);
+	}
+
+	/*
+	 * The job never changes anything in the header but "seq", "sims_done" and "finished",
+	 * so we can check the rest without a snapshot.
+	 */
+	const struct live_file_header *live = map;
+	const struct bucket_tables *tables = bucket_tables_find(live->buckets_per_order);
+	size_t record_size = live_record_size(live->num_buckets);
+	if (memcmp(live->magic, LIVE_FILE_MAGIC, sizeof(live->magic)) ||
+	    (live->version != LIVE_FILE_VERSION) ||
+	    (live->header_size != sizeof(struct live_file_header)) ||
+	    !tables || (live->num_buckets != (uint32_t)tables->num_buckets) || !live->num_records || (live->writer_pid <= 0) ||
+	    ((size_t)sb.st_size != sizeof(struct live_file_header) + ((size_t)live->num_records * record_size))) {
+		fprintf(stderr, "%s is not a valid live results file\n", name);
+		exit(-1);
+	}
+
+	unsigned char *copy = malloc(sb.st_size);
+	struct sim_rate *rate = malloc(sizeof(struct sim_rate));
+	if (!copy || !rate) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	histogram_init(&rate->hist, tables, NULL);
+
+	const struct live_file_header *hdr = (const struct live_file_header *)copy;
+	uint64_t last_seq = 0;
+	while (1) {
+		/*
+		 * Look for the job before taking the snapshot, so that if it's gone then the
+		 * snapshot has everything that it published.
+		 */
+		bool running = watch_writer_running(live);
+		watch_snapshot(copy, map, sb.st_size, name);
+		if (hdr->seq != last_seq) {
+			last_seq = hdr->seq;
+			fprintf(stderr, "Sims: %lld of %lld completed%s\n",
+				(long long int)hdr->sims_done, (long long int)hdr->total_sims, hdr->finished ? ", finished" : "");
+
+			bool show_block_size = hdr->show_block_size;
+			if (format == OUTPUT_CSV) {
+				output_csv_header(show_block_size);
+			} else if (format == OUTPUT_SUMMARY) {
+				output_summary_header(false, show_block_size);
+			}
+
+			const unsigned char *p = copy + hdr->header_size;
+			for (uint32_t k = 0; k < hdr->num_records; k++) {
+				const struct live_file_record *rec = (const struct live_file_record *)p;
+				const int64_t *buckets = (const int64_t *)(p + sizeof(struct live_file_record));
+				rate->tps = rec->tps;
+				rate->block_size = rec->block_size;
+				rate->num_sims = rec->num_sims;
+				histogram_clear(&rate->hist);
+				if ((rec->smallest_bucket >= 0) && (rec->largest_bucket < tables->num_buckets)) {
+					for (int b = rec->smallest_bucket; b <= rec->largest_bucket; b++) {
+						rate->hist.buckets[b] = (long int)buckets[b];
+					}
+
+					rate->hist.smallest_bucket = rec->smallest_bucket;
+					rate->hist.largest_bucket = rec->largest_bucket;
+				}
+
+				rate->hist.num_results = rec->num_results;
+				rate->hist.mean = rec->mean;
+				rate->hist.m2 = rec->m2;
+				rate->config_digest = hdr->config_digest;
+				output_rate(format, NULL, rate, hdr->num_blocks, rate->num_sims, &hdr->seed, 1, show_block_size);
+				p += record_size;
+			}
+
+			fflush(stdout);
+		}
+
+		if (hdr->finished) {
+			break;
+		}
+
+		if (!running) {
+			fprintf(stderr, "%s: job %d stopped without finishing\n", name, (int)hdr->writer_pid);
+			exit(-1);
+		}
+
+		sleep(interval);
+	}
+
+	histogram_destroy(&rate->hist);
+	free(rate);
+	free(copy);
+	munmap(map, sb.st_size);
+}
+
+/*
+ * Coefficient of the two-sample Kolmogorov-Smirnov test's critical value, and the mean
+ * of the test's statistic when both samples come from the same distribution.  The
+ * coefficient is sqrt(-ln(alpha / 2) / 2) for a significance level alpha of 0.1%.
+ * That's stricter than the usual 1% because the limit is scaled by an estimate of how
+ * many independent samples each simulation is worth, and that estimate is itself a
+ * little noisy.
+ */
+#define KS_CRITICAL 1.949
+#define KS_MEAN 0.8687
+
+/*
+ * Fewest batches, counting both sets of results, from which compare() will estimate
+ * how much independent runs at a rate differ.
+ */
+#define KS_MIN_BATCHES 8
+
+/*
+ * compare_load()
+ *	Read every record in a binary results file.  Returns the number of them and sets
+ *	"*out" to a newly allocated array of them.
+ */
+static int compare_load(const char *name, struct merged_rate **out)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		exit(-2);
+	}
+
+	struct merged_rate *records = NULL;
+	int num_records = 0;
+	int capacity = 0;
+	while (1) {
+		int ch = getc(f);
+		if (ch == EOF) {
+			break;
+		}
+
+		ungetc(ch, f);
+
+		if (num_records == capacity) {
+			capacity = capacity ? (capacity * 2) : 16;
+			records = realloc(records, capacity * sizeof(struct merged_rate));
+			if (!records) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(-1);
+			}
+		}
+
+		struct merged_rate *m = &records[num_records];
+		memset(m, 0, sizeof(struct merged_rate));
+
+		struct histogram_file_header hdr;
+		if (!input_results_binary(f, &m->rate.hist, &hdr, NULL, NULL)) {
+			fprintf(stderr, "%s: record %d is not a valid histogram\n", name, num_records);
+			exit(-1);
+		}
+
+		m->rate.tps = hdr.tps;
+		m->rate.block_size = hdr.block_size;
+		m->num_blocks = hdr.num_blocks;
+		m->num_sims = hdr.num_sims;
+		num_records++;
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "Failed to read %s\n", name);
+		exit(-2);
+	}
+
+	fclose(f);
+	*out = records;
+	return num_records;
+}
+
+/*
+ * compare_pool()
+ *	Add together the records in "records" for the same rate and block size as "key",
+ *	at the resolution of "pool".  Returns the number of records and the number of
+ *	simulations in them.
+ */
+static int compare_pool(struct histogram *pool, const struct merged_rate *records, int num_records, const struct merged_rate *key,
+			long long int *num_sims, int *num_blocks, struct histogram *converted)
+{
+	int n = 0;
+	*num_sims = 0;
+	for (int i = 0; i < num_records; i++) {
+		const struct merged_rate *m = &records[i];
+		if ((m->rate.tps != key->rate.tps) || (m->rate.block_size != key->rate.block_size)) {
+			continue;
+		}
+
+		const struct histogram *h = &m->rate.hist;
+		if (h->tables != pool->tables) {
+			histogram_convert(converted, pool->tables, h);
+			h = converted;
+		}
+
+		histogram_merge(pool, h);
+		*num_sims += m->num_sims;
+		*num_blocks = m->num_blocks;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * compare_spread()
+ *	Work out how far each batch of results for the same rate and block size as "key" is
+ *	from the rest of the batches, "pool" less that batch, as a Kolmogorov-Smirnov
+ *	distance scaled to one sample for each simulation on either side.  Adds the scaled
+ *	distances to "*total", and the number of them to "*count".
+ */
+static void compare_spread(const struct histogram *pool, long long int pool_sims, const struct merged_rate *records, int num_records,
+			   const struct merged_rate *key, double *total, int *count, struct histogram *converted, struct histogram *rest)
+{
+	histogram_destroy(rest);
+	histogram_init(rest, pool->tables, NULL);
+	for (int i = 0; i < num_records; i++) {
+		const struct merged_rate *m = &records[i];
+		if ((m->rate.tps != key->rate.tps) || (m->rate.block_size != key->rate.block_size) ||
+		    (m->num_sims < 1) || (m->num_sims >= pool_sims)) {
+			continue;
+		}
+
+		const struct histogram *h = &m->rate.hist;
+		if (h->tables != pool->tables) {
+			histogram_convert(converted, pool->tables, h);
+			h = converted;
+		}
+
+		histogram_clear(rest);
+		for (int b = pool->smallest_bucket; b <= pool->largest_bucket; b++) {
+			rest->buckets[b] = pool->buckets[b] - h->buckets[b];
+		}
+
+		rest->smallest_bucket = pool->smallest_bucket;
+		rest->largest_bucket = pool->largest_bucket;
+		rest->num_results = pool->num_results - h->num_results;
+		if (!rest->num_results || !h->num_results) {
+			continue;
+		}
+
+		double n = (double)m->num_sims;
+		double others = (double)(pool_sims - m->num_sims);
+		*total += histogram_ks_distance(h, rest) * sqrt((n * others) / (n + others));
+		(*count)++;
+	}
+}
+
+/*
+ * compare()
+ *	Check that the results in binary results file "actual" match those in "expected",
+ *	rate by rate.  Each file can hold several batches of results for a rate, from runs
+ *	with different seeds, which are added together.  Returns the number of rates that
+ *	don't match.
+ *
+ * Normally the bucket counts have to be exactly the same, as they will be for runs with
+ * the same seeds unless the simulation has changed.  With "ks" set they only need to
+ * pass a two-sample Kolmogorov-Smirnov test instead, which is for checking changes that
+ * are meant to give different random numbers, such as a new generator.
+ *
+ * Confirmation times within a simulation are far from independent, so we can't count
+ * each of them as a sample.  Instead we see how far apart the batches are from each
+ * other, and from that how many independent samples each simulation is worth, which
+ * is never taken to be less than one.
+ */
+static int compare(const char *expected_name, const char *actual_name, bool ks)
+{
+	struct merged_rate *expected;
+	struct merged_rate *actual;
+	int num_expected = compare_load(expected_name, &expected);
+	int num_actual = compare_load(actual_name, &actual);
+
+	struct histogram *x = calloc(1, sizeof(struct histogram));
+	struct histogram *y = calloc(1, sizeof(struct histogram));
+	struct histogram *converted = calloc(1, sizeof(struct histogram));
+	struct histogram *rest = calloc(1, sizeof(struct histogram));
+	if (!x || !y || !converted || !rest) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	int failures = 0;
+	for (int e = 0; e < num_expected; e++) {
+		const struct merged_rate *key = &expected[e];
+
+		/*
+		 * Only look at each rate and block size the first time that we see it.
+		 */
+		int k;
+		for (k = 0; k < e; k++) {
+			if ((expected[k].rate.tps == key->rate.tps) && (expected[k].rate.block_size == key->rate.block_size)) {
+				break;
+			}
+		}
+
+		if (k < e) {
+			continue;
+		}
+
+		printf("TPS %f, block size %lld, %d blocks: ", key->rate.tps, key->rate.block_size, key->num_blocks);
+
+		long long int n_sims, m_sims;
+		int x_blocks = key->num_blocks;
+		int y_blocks = 0;
+		histogram_destroy(x);
+		histogram_init(x, key->rate.hist.tables, NULL);
+		histogram_destroy(y);
+		histogram_init(y, key->rate.hist.tables, NULL);
+		int x_batches = compare_pool(x, expected, num_expected, key, &n_sims, &x_blocks, converted);
+		int y_batches = compare_pool(y, actual, num_actual, key, &m_sims, &y_blocks, converted);
+		if (!y_batches) {
+			printf("FAIL (missing)\n");
+			failures++;
+			continue;
+		}
+
+		if ((y_blocks != x_blocks) || !m_sims || !y->num_results) {
+			printf("FAIL (simulated with %d blocks, %lld simulations)\n", y_blocks, m_sims);
+			failures++;
+			continue;
+		}
+
+		double d = histogram_ks_distance(x, y);
+		if (!ks) {
+			bool same = (n_sims == m_sims) && (x->num_results == y->num_results) &&
+				    (x->smallest_bucket == y->smallest_bucket) && (x->largest_bucket == y->largest_bucket);
+			for (int b = x->smallest_bucket; same && (b <= x->largest_bucket); b++) {
+				same = (x->buckets[b] == y->buckets[b]);
+			}
+
+			if (same) {
+				printf("ok (identical)\n");
+			} else {
+				printf("FAIL (differs, %lld and %lld simulations, KS distance %.6f)\n", n_sims, m_sims, d);
+				failures++;
+			}
+
+			continue;
+		}
+
+		double total = 0.0;
+		int count = 0;
+		compare_spread(x, n_sims, expected, num_expected, key, &total, &count, converted, rest);
+		compare_spread(y, m_sims, actual, num_actual, key, &total, &count, converted, rest);
+
+		double scale = 1.0;
+		if ((count >= KS_MIN_BATCHES) && ((total / count) < KS_MEAN)) {
+			scale = (total / count) / KS_MEAN;
+		}
+
+		double n = (double)n_sims;
+		double m = (double)m_sims;
+		double limit = KS_CRITICAL * scale * sqrt((n + m) / (n * m));
+		bool ok = (d <= limit);
+		printf("KS distance %.6f, limit %.6f from %d and %d batches, %s\n", d, limit, x_batches, y_batches, ok ? "ok" : "FAIL");
+		if (!ok) {
+			failures++;
+		}
+	}
+
+	for (int e = 0; e < num_expected; e++) {
+		histogram_destroy(&expected[e].rate.hist);
+	}
+
+	for (int a = 0; a < num_actual; a++) {
+		histogram_destroy(&actual[a].rate.hist);
+	}
+
+	histogram_destroy(rest);
+	free(rest);
+	histogram_destroy(converted);
+	free(converted);
+	histogram_destroy(y);
+	free(y);
+	histogram_destroy(x);
+	free(x);
+	free(actual);
+	free(expected);
+	return failures;
+}
 
 /*
- * Transaction record.
+ * Benchmark scenarios.  These are fixed so that runs from different builds can be
+ * compared with each other.
  */
-struct transaction {
-	struct transaction *next;		/* Next transaction in the pending list */
-	struct transaction *prev;		/* Previous transaction in the pending list */
-	int size;				/* Size of the transaction in bytes */
-	double fee;				/* Fee associated with the transaction */
-	double time;				/* Time at which this transaction was generated */
+struct bench_scenario {
+	double tps;				/* Transaction arrival rate */
+	int num_blocks;				/* Number of blocks per simulation */
+	int num_sims;				/* Number of simulations */
+};
+
+static const struct bench_scenario bench_scenarios[] = {
+	{1.0, 144, 400},
+	{2.0, 1008, 40},
+	{3.0, 1008, 40},
+	{3.5, 1008, 20},
+	{5.0, 1008, 20},
+	{5.0, 4032, 5}
 };
 
-long int buckets[NUM_BUCKETS];
-int smallest_bucket = NUM_BUCKETS;
-int largest_bucket = 0;
-long long int num_results = 0LL;
+#define NUM_BENCH_SCENARIOS (int)(sizeof(bench_scenarios) / sizeof(struct bench_scenario))
+
+/*
+ * Seed used by the benchmarks unless one is given with "--seed".
+ */
+#define BENCH_SEED 0x6274622d62656e63ULL
+
+/*
+ * peak_rss_reset()
+ *	Start measuring the peak resident set size again from the current one, where the
+ *	kernel lets us.
+ */
+static void peak_rss_reset(void)
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f) {
+		fputs("5", f);
+		fclose(f);
+	}
+}
+
+/*
+ * peak_rss_kb()
+ *	Return the peak resident set size in KB since peak_rss_reset(), or since we started
+ *	if the kernel wouldn't reset it.
+ */
+static long int peak_rss_kb(void)
+{
+	long int kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f) {
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+				break;
+			}
+		}
+
+		fclose(f);
+	}
+
+	if (kb < 0) {
+		struct rusage ru;
+		kb = getrusage(RUSAGE_SELF, &ru) ? 0 : ru.ru_maxrss;
+	}
+
+	return kb;
+}
+
+/*
+ * bench()
+ *	Run each of the benchmark scenarios and report how fast the simulation ran, and how
+ *	much memory it needed.  With CSV output every row also carries the time, random
+ *	number generator and thread count, so that rows from many runs can be kept in one
+ *	file and tracked over time.  Each scenario is run without and then with block
+ *	statistics, and the second row gives the time that they added as "overhead".
+ */
+static void bench(const struct sim_config *base, bool use_seed)
+{
+	bool csv = (base->output_format == OUTPUT_CSV);
+	long long int timestamp = (long long int)time(NULL);
+	if (csv) {
+		printf("timestamp,rng,threads,tps,num_blocks,num_sims,block_stats,wall_s,blocks_per_s,tx_per_s,gen_ns_per_tx,blk_ns_per_tx,"
+		       "peak_pending,pool_hits,pool_misses,peak_rss_kb,overhead_pct\n");
+	} else {
+		printf("threads: %d, rng: %s\n-\n", base->num_threads, RNG_NAME);
+		printf("%6s %7s %6s %5s %9s %12s %12s %10s %10s %10s %10s %10s %10s %9s\n",
+		       "tps", "blocks", "sims", "stats", "wall_s", "blocks/s", "tx/s", "gen_ns/tx", "blk_ns/tx", "peak_pend", "pool_hits",
+		       "pool_miss", "peak_rss_k", "overhead%");
+	}
+
+	/*
+	 * Each scenario runs a second time streaming block statistics, to a scratch file
+	 * that's thrown away, so that we can see what "--block-stats" costs.
+	 */
+	char stats_name[] = "/tmp/btb-bench-XXXXXX";
+	int stats_fd = mkstemp(stats_name);
+	if (stats_fd < 0) {
+		fprintf(stderr, "Failed to create %s\n", stats_name);
+		exit(-2);
+	}
+
+	close(stats_fd);
+
+	double base_wall = 0.0;
+	for (int run = 0; run < NUM_BENCH_SCENARIOS * 2; run++) {
+		const struct bench_scenario *bs = &bench_scenarios[run / 2];
+		bool block_stats = run & 1;
+
+		struct sim_config cfg = *base;
+		double tps = bs->tps;
+		cfg.tps = &tps;
+		cfg.num_rates = 1;
+		cfg.num_blocks = bs->num_blocks;
+		cfg.num_sims = bs->num_sims;
+		cfg.seed = use_seed ? base->seed : BENCH_SEED;
+		cfg.quiet = true;
+		cfg.timing = true;
+		cfg.block_stats_name = block_stats ? stats_name : NULL;
+
+		struct sim_stats stats;
+		peak_rss_reset();
+		uint64_t start_ns = now_ns();
+		struct sim_rate *rates = sim_run(&cfg, &stats);
+		double wall = (double)(now_ns() - start_ns) / 1e9;
+		long int rss_kb = peak_rss_kb();
+		for (int l = 0; l < cfg.num_block_sizes; l++) {
+			if (rates[l].hist.sketch) {
+				ddsketch_destroy(rates[l].hist.sketch);
+			}
+
+			histogram_destroy(&rates[l].hist);
+		}
+
+		free(rates);
+
+		double gen_ns = stats.transactions_generated ? (double)stats.generate_ns / (double)stats.transactions_generated : 0.0;
+		double blk_ns = stats.transactions_confirmed ? (double)stats.confirm_ns / (double)stats.transactions_confirmed : 0.0;
+		if (!block_stats) {
+			base_wall = wall;
+		}
+
+		double overhead = block_stats ? (100.0 * (wall - base_wall) / base_wall) : 0.0;
+		if (csv) {
+			printf("%lld,%s,%d,%.2f,%d,%d,%d,%.3f,%.0f,%.0f,%.2f,%.2f,%u,%lld,%lld,%ld,%.1f\n",
+			       timestamp, RNG_NAME, base->num_threads, bs->tps, bs->num_blocks, bs->num_sims, block_stats, wall,
+			       (double)stats.blocks / wall, (double)stats.transactions_confirmed / wall,
+			       gen_ns, blk_ns, stats.peak_pending, stats.pool_hits, stats.pool_misses, rss_kb, overhead);
+		} else {
+			printf("%6.2f %7d %6d %5s %9.3f %12.0f %12.0f %10.2f %10.2f %10u %10lld %10lld %10ld %9.1f\n",
+			       bs->tps, bs->num_blocks, bs->num_sims, block_stats ? "on" : "off", wall,
+			       (double)stats.blocks / wall, (double)stats.transactions_confirmed / wall,
+			       gen_ns, blk_ns, stats.peak_pending, stats.pool_hits, stats.pool_misses, rss_kb, overhead);
+		}
+
+		fflush(stdout);
+	}
+
+	unlink(stats_name);
+}
+
+/*
+ * parse_tps_range()
+ *	Parse a "start:stop:step" range of transaction rates.  Returns the number of rates,
+ *	or 0 if the range isn't valid or would have more than MAX_RATES of them, and sets
+ *	"*tps" to a newly allocated list of them.
+ */
+static int parse_tps_range(const char *arg, double **tps)
+{
+	double start, stop, step;
+	char extra;
+	if (sscanf(arg, "%lf:%lf:%lf%c", &start, &stop, &step, &extra) != 3) {
+		return 0;
+	}
+
+	if (!isfinite(start) || !isfinite(stop) || !isfinite(step) || (step <= 0.0) || (stop < start)) {
+		return 0;
+	}
+
+	/*
+	 * Allow a little slack so that rounding doesn't lose the last rate.  Check the count
+	 * while it's still a double, as a tiny step would overflow an int.
+	 */
+	double steps = floor(((stop - start) / step) + 1e-9);
+	if (!(steps < MAX_RATES)) {
+		return 0;
+	}
+
+	int n = (int)steps + 1;
+	*tps = malloc(n * sizeof(double));
+	if (!*tps) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	for (int i = 0; i < n; i++) {
+		(*tps)[i] = start + (step * i);
+	}
+
+	return n;
+}
 
 /*
- * Details of the pending transactions.
+ * parse_resolution()
+ *	Parse the name of a histogram resolution.  Returns its number of buckets per power of
+ *	10, or 0 if the name isn't valid.
  */
-struct transaction *pending_head = NULL;
-struct transaction *pending_tail = NULL;
-int pending_transactions = 0;
-double next_transaction_secs = 0.0;
+static int parse_resolution(const char *arg)
+{
+	if (!strcmp(arg, "fine")) {
+		return FINE_BUCKETS_PER_ORDER;
+	}
+
+	if (!strcmp(arg, "coarse")) {
+		return COARSE_BUCKETS_PER_ORDER;
+	}
+
+	return 0;
+}
 
 /*
- * Fast caching allocator.
+ * parse_percentiles()
+ *	Parse a comma separated list of percentiles, such as "50,95,99", into fractions in
+ *	"p".  Returns the number of percentiles, or 0 if the list isn't valid.
  */
-struct transaction *cache_head = NULL;
+static int parse_percentiles(const char *arg, double *p)
+{
+	int n = 0;
+	const char *s = arg;
+	while (1) {
+		char *end;
+		double v = strtod(s, &end);
+		if ((end == s) || !(v > 0.0) || !(v < 100.0) || (n == CI_MAX_PERCENTILES)) {
+			return 0;
+		}
+
+		p[n++] = v / 100.0;
+		if (*end == '\0') {
+			return n;
+		}
 
-/*
- * sim_pp()
- *	Simulate one time period of a Poisson process.
- */
-static double sim_pp(double rate)
-{
-	/*
-	 * rand() isn't an ideal function here but if we go out of our way to fold in
-	 * some entropy we're ok.
-	 */
-	double r = (double)rand() / (((double)RAND_MAX) + 1.0);
+		if (*end != ',') {
+			return 0;
+		}
 
-	return (double)(-log(1.0 - r) / rate);
+		s = end + 1;
+	}
 }
 
 /*
- * sim_transactions()
- *	Simulate the number of transactions arriving in "block_duration" seconds.
+ * parse_block_sizes()
+ *	Parse a comma separated list of block sizes in bytes, such as "1M,2M,4M,8M", into
+ *	"sizes".  A size can have a suffix of K or M for multiples of 1024 or 1024 * 1024.
+ *	Returns the number of sizes, or 0 if the list isn't valid.
  */
-int sim_transactions(double block_end_secs, double tps)
+static int parse_block_sizes(const char *arg, long long int *sizes)
 {
-	int transactions = 0;
-
+	int n = 0;
+	const char *s = arg;
 	while (1) {
-		/*
-		 * Given a start time and a block duration see if the next transaction actually fits into
-		 * that window.  If it doesn't then there are no new transactions.
-		 */
-		if (block_end_secs < next_transaction_secs) {
-			return transactions;
+		char *end;
+		errno = 0;
+		long long int v = strtoll(s, &end, 10);
+		if ((end == s) || (errno == ERANGE) || (n == MAX_LANES)) {
+			return 0;
+		}
+
+		long long int multiplier = 1;
+		if ((*end == 'k') || (*end == 'K')) {
+			multiplier = 1024;
+			end++;
+		} else if ((*end == 'm') || (*end == 'M')) {
+			multiplier = 1024 * 1024;
+			end++;
 		}
 
 		/*
-		 * Create the details of our new transaction and record them in our pending transaction list.
+		 * Check the range before applying the suffix, so that a huge value can't
+		 * overflow into one that looks valid.
 		 */
-		struct transaction *t = cache_head;
-		if (t) {
-			cache_head = t->next;
-		} else {
-			t = malloc(sizeof(struct transaction));
-			if (!t) {
-				fprintf(stderr, "Out of memory!\n");
-				exit(-1);
-			}
+		if ((v < 0) || (v > (MAX_BLOCK_SIZE / multiplier))) {
+			return 0;
 		}
 
-		t->size = (1024 * 1024) / 2100;
-		t->fee = 0.00001;
-		t->time = next_transaction_secs;
+		v *= multiplier;
+		if (v < TRANSACTION_SIZE) {
+			return 0;
+		}
 
-		if (!pending_head) {
-			pending_head = t;
-		} else {
-			pending_tail->next = t;
+		sizes[n++] = v;
+		if (*end == '\0') {
+			return n;
 		}
 
-		t->next = NULL;
-		t->prev = pending_tail;
-		pending_tail = t;
+		if (*end != ',') {
+			return 0;
+		}
 
-		transactions++;
+		s = end + 1;
+	}
+}
 
-		/*
-		 * Work out when the next transaction arrival is.
-		 */
-		double transaction_arrival = sim_pp(tps);
-		next_transaction_secs += transaction_arrival;
+/*
+ * tables_init()
+ *	Build the bucket tables, or exit if there isn't enough memory for them.
+ */
+static void tables_init(void)
+{
+	if (!bucket_tables_init()) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
 	}
 }
 
 /*
- * create_block()
- *	Walk the list of pending transactions and simulate a block.
+ * output_finish()
+ *	Make sure that everything written to stdout got to its destination, which may be the
+ *	"--output" file.  Exits if it didn't.
  */
-static int create_block(double block_found_time)
+static void output_finish(void)
 {
-	struct transaction *t = pending_head;
-	if (!t) {
-		return 0;
+	if (fflush(stdout) || ferror(stdout) || fclose(stdout)) {
+		fprintf(stderr, "Failed to write results\n");
+		exit(-2);
 	}
+}
+
+/*
+ * usage()
+ *	Report how to run the app.
+ */
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <starting-rate> <num-blocks> <num-sims>\n"
+	       "       %s [options] --tps-range <start:stop:step> <num-blocks> <num-sims>\n"
+	       "options:\n"
+	       "  --threads <num-threads>       number of simulation threads (default 1)\n"
+	       "  --seed <seed>                 master seed, for reproducible runs\n"
+	       "  --crn                         common random numbers: simulation n sees the same\n"
+	       "                                blocks and arrival noise at every rate and in every\n"
+	       "                                run with the same seed\n"
+	       "  --output-format <format>      text (default), csv, binary or summary\n"
+	       "  --queue <discipline>          fifo (default), fee or lazy (fifo with arrival\n"
+	       "                                times only worked out when blocks take them)\n"
+	       "  --sizes <table-file>          draw transaction sizes from a size table\n"
+	       "  --block-size <size>[,<size>]  block size limit in bytes, with an optional K or M\n"
+	       "                                suffix (default 1M).  Several sizes are simulated\n"
+	       "                                side by side from the same arrivals and blocks;\n"
+	       "                                TPS rates are still relative to 1M blocks\n"
+	       "  --rate-profile <file>         vary the arrival rate over a repeating cycle of\n"
+	       "                                \"<seconds> <relative-rate>\" lines, keeping the\n"
+	       "                                given TPS as the mean\n"
+	       "  --checkpoint <file>           periodically save progress to a checkpoint file\n"
+	       "  --checkpoint-interval <secs>  time between checkpoints (default %d)\n"
+	       "  --resume                      carry on from the checkpoint file\n"
+	       "  --bench                       run the benchmark scenarios instead, reporting\n"
+	       "                                speed, peak memory and the cost of --block-stats\n"
+	       "                                as text or csv\n"
+	       "  --output <file>               write the results to a file\n"
+	       "  --block-stats <file>          stream per-block statistics to a file\n"
+	       "  --live <file>                 keep the results so far in a file that \"watch\"\n"
+	       "                                can read while the simulation runs\n"
+	       "  --sketch <accuracy>           also estimate percentiles with a DDSketch\n"
+	       "  --resolution <resolution>     histogram resolution, fine (default, 1000 buckets\n"
+	       "                                per power of 10) or coarse (100 buckets)\n"
+	       "  --output-resolution <res>     convert the results to this resolution for output\n"
+	       "  --target-ci <width>           stop each rate once its percentiles converge, with\n"
+	       "                                <num-sims> as the limit (e.g. 0.01 for 1%%)\n"
+	       "  --ci-percentiles <list>       percentiles to watch (default 50,95,99)\n"
+	       "  --hash-growth <percent>       grow the hash rate by this much every two weeks,\n"
+	       "                                retargeting the difficulty every 2016 blocks\n"
+	       "  --gpu                         run the simulations on a GPU (btb-gpu only, with\n"
+	       "                                a FIFO queue and fixed size transactions)\n"
+	       "       %s [--output-format <format>] [--output <file>] merge <results-file>...\n"
+	       "  add together binary results files from separate runs (each needs its own seed)\n"
+	       "       %s [--ks] compare <expected-results-file> <results-file>\n"
+	       "  check that binary results, rate by rate, are the same as expected ones (or\n"
+	       "  with --ks, pass a Kolmogorov-Smirnov test against them); exits with 1 if\n"
+	       "  any don't match\n"
+	       "       %s [--output-format <format>] [--output <file>] watch <live-file> [<secs>]\n"
+	       "  show a running simulation's live results every few seconds (default %d), in\n"
+	       "  summary format unless told otherwise, until it finishes\n"
+	       "       %s --build-size-table <histogram-file> <table-file>\n"
+	       "  build a size table from a text histogram of \"<size> <count>\" lines\n",
+	       name, name, CHECKPOINT_INTERVAL, name, name, name, WATCH_INTERVAL, name);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"seed", required_argument, NULL, 's'},
+		{"tps-range", required_argument, NULL, 'r'},
+		{"output-format", required_argument, NULL, 'o'},
+		{"bench", no_argument, NULL, 'b'},
+		{"queue", required_argument, NULL, 'q'},
+		{"sizes", required_argument, NULL, 'z'},
+		{"build-size-table", required_argument, NULL, 'Z'},
+		{"checkpoint", required_argument, NULL, 'c'},
+		{"checkpoint-interval", required_argument, NULL, 'i'},
+		{"resume", no_argument, NULL, 'R'},
+		{"output", required_argument, NULL, 'O'},
+		{"block-stats", required_argument, NULL, 'B'},
+		{"sketch", required_argument, NULL, 'k'},
+		{"target-ci", required_argument, NULL, 'T'},
+		{"resolution", required_argument, NULL, 'x'},
+		{"output-resolution", required_argument, NULL, 'X'},
+		{"ci-percentiles", required_argument, NULL, 'P'},
+		{"hash-growth", required_argument, NULL, 'g'},
+		{"rate-profile", required_argument, NULL, 'p'},
+		{"crn", no_argument, NULL, 'C'},
+		{"block-size", required_argument, NULL, 'S'},
+		{"block-sizes", required_argument, NULL, 'S'},
+		{"live", required_argument, NULL, 'L'},
+		{"ks", no_argument, NULL, 'K'},
+		{"gpu", no_argument, NULL, 'G'},
+		{NULL, 0, NULL, 0}
+	};
+
+	struct sim_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
 
 	/*
-	 * This isn't actually correct but it's a good approximation :-)
+	 * Number of simulation threads.  They share out the simulation runs between them.
 	 */
-	int blocks = 0;
-	int block_space = 1024 * 1024;
-	while (block_space >= t->size) {
-		block_space -= t->size;
-		blocks++;
+	cfg.num_threads = 1;
 
-		/*
-		 * Work out how old this block is.
-		 */
-		double age = block_found_time - t->time;
-		double log_age = log10(age);
-		double log_age_bucket = (double)NUM_BUCKETS_PER_ORDER * log_age;
-		long int b = (long int)ceil(log_age_bucket);
-		b += (NEGATIVE_ORDERS * NUM_BUCKETS_PER_ORDER);
-		if (b < 0) {
-			b = 0;
-		}
-		buckets[b]++;
+	/*
+	 * Transaction rates to simulate.  Normally there's just the one given on the command
+	 * line but "--tps-range" sweeps across many.
+	 */
+	cfg.tps = NULL;
+	cfg.num_rates = 0;
 
-		if (largest_bucket < b) {
-			largest_bucket = b;
-		}
+	/*
+	 * Master seed for the run.  Every simulation derives its own seed from this so giving
+	 * the same seed reproduces a run exactly.
+	 */
+	bool use_seed = false;
+	cfg.seed = 0;
+	cfg.seed_given = false;
 
-		if (smallest_bucket > b) {
-			smallest_bucket = b;
-		}
+	cfg.output_format = OUTPUT_TEXT;
+	bool output_format_given = false;
+	const char *output_name = NULL;
+
+	/*
+	 * Transactions are normally confirmed oldest first, but "--queue fee" confirms the
+	 * ones paying the highest fee rate first.
+	 */
+	cfg.discipline = QUEUE_FIFO;
 
-		num_results++;
+	/*
+	 * Every transaction is TRANSACTION_SIZE bytes unless we're given a table of sizes.
+	 */
+	const char *sizes_name = NULL;
+	const char *histogram_name = NULL;
+	struct size_table sizes;
+	cfg.sizes = NULL;
 
-		struct transaction *next = t->next;
+	/*
+	 * Blocks are normally limited to BLOCK_SIZE bytes.  "--block-size" changes that, and
+	 * with a list of sizes simulates each of them against the same arrivals and blocks.
+	 */
+	cfg.num_block_sizes = 1;
+	cfg.block_sizes[0] = BLOCK_SIZE;
+	cfg.show_block_size = false;
 
-		/*
-		 * Insert our old block on the re-use cache.
-		 */
-		t->next = cache_head;
-		cache_head = t;
+	/*
+	 * Transactions arrive at a constant rate unless we're given a profile of how it
+	 * varies over a day, a week or whatever.
+	 */
+	const char *profile_name = NULL;
+	struct rate_profile profile;
+	cfg.profile = NULL;
+
+	/*
+	 * Long runs can save their progress to a checkpoint file every so often, and then be
+	 * resumed from it if they're stopped.
+	 */
+	cfg.checkpoint_name = NULL;
+	cfg.checkpoint_interval = CHECKPOINT_INTERVAL;
+	cfg.resume = false;
 
-		pending_head = next;
+	/*
+	 * We can also stream out statistics about every block that's mined, and keep the
+	 * results so far in a file for "watch" to look at.
+	 */
+	cfg.block_stats_name = NULL;
+	cfg.live_name = NULL;
 
-		if (next) {
-			next->prev = NULL;
-		} else {
-			pending_tail = NULL;
+	/*
+	 * Percentiles normally come from the histogram, but a quantile sketch with a given
+	 * relative accuracy (say 0.01) can be run alongside it.
+	 */
+	cfg.sketch_accuracy = 0.0;
+
+	/*
+	 * Histograms normally have the fine resolution used in the original articles.  The
+	 * coarse one is faster, and either can be converted to the other for output.
+	 */
+	cfg.buckets_per_order = FINE_BUCKETS_PER_ORDER;
+	cfg.output_buckets_per_order = 0;
+
+	/*
+	 * We normally run exactly "num-sims" simulations at each rate, but "--target-ci"
+	 * stops early once the percentiles we're watching have settled down.
+	 */
+	cfg.target_ci = 0.0;
+	cfg.num_ci_percentiles = 3;
+	cfg.ci_percentiles[0] = 0.50;
+	cfg.ci_percentiles[1] = 0.95;
+	cfg.ci_percentiles[2] = 0.99;
+
+	/*
+	 * Blocks are normally found at a constant rate, but "--hash-growth" makes the hash
+	 * rate grow exponentially and retargets the difficulty to keep up.
+	 */
+	cfg.hash_model = false;
+	cfg.hash_growth = 0.0;
+
+	/*
+	 * Every simulation normally draws its own random numbers.  "--crn" makes simulation n
+	 * draw the same ones whatever the rate, so that comparisons between scenarios aren't
+	 * swamped by independent noise.
+	 */
+	cfg.crn = false;
+
+	/*
+	 * btb-gpu can run plain FIFO simulations on a GPU instead of the simulation threads.
+	 */
+	cfg.gpu = false;
+
+	bool run_bench = false;
+
+	/*
+	 * "compare" normally wants exactly the same results, but "--ks" lets them pass a
+	 * statistical test instead.
+	 */
+	bool compare_ks = false;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "t:s:r:o:bq:z:Z:c:i:RO:B:k:T:P:x:X:g:p:CS:L:K", long_options, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			cfg.num_threads = atoi(optarg);
+			if (cfg.num_threads < 1) {
+				fprintf(stderr, "Number of threads must be at least 1\n");
+				exit(-1);
+			}
+			break;
+
+		case 's': {
+			/*
+			 * strtoull() quietly negates a leading '-', so refuse one along with
+			 * anything that isn't entirely a number that fits in 64 bits.
+			 */
+			char *end;
+			errno = 0;
+			cfg.seed = strtoull(optarg, &end, 0);
+			if ((end == optarg) || (*end != '\0') || (errno == ERANGE) || strchr(optarg, '-')) {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				exit(-1);
+			}
+
+			use_seed = true;
+			cfg.seed_given = true;
 			break;
 		}
 
-		t = next;
-	}
+		case 'r':
+			free(cfg.tps);
+			cfg.num_rates = parse_tps_range(optarg, &cfg.tps);
+			if (!cfg.num_rates) {
+				fprintf(stderr, "Invalid TPS range: %s (start:stop:step, with at most %d rates)\n",
+					optarg, MAX_RATES);
+				exit(-1);
+			}
+			break;
 
-	return blocks;
-}
+		case 'o':
+			if (!strcmp(optarg, "text")) {
+				cfg.output_format = OUTPUT_TEXT;
+			} else if (!strcmp(optarg, "csv")) {
+				cfg.output_format = OUTPUT_CSV;
+			} else if (!strcmp(optarg, "binary")) {
+				cfg.output_format = OUTPUT_BINARY;
+			} else if (!strcmp(optarg, "summary")) {
+				cfg.output_format = OUTPUT_SUMMARY;
+			} else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				exit(-1);
+			}
 
-/*
- * mine()
- *	Simulate a set of blocks being mined.
- */
-static void mine(double tps, int num_blocks, FILE *f, double *cumulative_time, int *transactions_handled)
-{
-	int cumulative_transactions = 0;
-	int cumulative_transactions_handled = 0;
-	for (int i = 0; i < num_blocks; i++) {
-		/*
-		 * Randomize!
-		 */
-		unsigned int seed;
-		if (fread(&seed, sizeof(seed), 1, f) != 1) {
-			fclose(f);
-			exit(-2);
+			output_format_given = true;
+			break;
+
+		case 'b':
+			run_bench = true;
+			break;
+
+		case 'q':
+			if (!strcmp(optarg, "fifo")) {
+				cfg.discipline = QUEUE_FIFO;
+			} else if (!strcmp(optarg, "fee")) {
+				cfg.discipline = QUEUE_FEE;
+			} else if (!strcmp(optarg, "lazy")) {
+				cfg.discipline = QUEUE_LAZY;
+			} else {
+				fprintf(stderr, "Unknown queue discipline: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'z':
+			sizes_name = optarg;
+			break;
+
+		case 'p':
+			profile_name = optarg;
+			break;
+
+		case 'C':
+			cfg.crn = true;
+			break;
+
+		case 'S':
+			cfg.num_block_sizes = parse_block_sizes(optarg, cfg.block_sizes);
+			if (!cfg.num_block_sizes) {
+				fprintf(stderr, "Invalid block sizes: %s (each must be %d to %lld bytes, and at most %d of them)\n",
+					optarg, TRANSACTION_SIZE, MAX_BLOCK_SIZE, MAX_LANES);
+				exit(-1);
+			}
+
+			cfg.show_block_size = true;
+			break;
+
+		case 'Z':
+			histogram_name = optarg;
+			break;
+
+		case 'c':
+			cfg.checkpoint_name = optarg;
+			break;
+
+		case 'i':
+			cfg.checkpoint_interval = atoi(optarg);
+			if (cfg.checkpoint_interval < 1) {
+				fprintf(stderr, "Checkpoint interval must be at least 1 second\n");
+				exit(-1);
+			}
+			break;
+
+		case 'R':
+			cfg.resume = true;
+			break;
+
+		case 'O':
+			output_name = optarg;
+			break;
+
+		case 'B':
+			cfg.block_stats_name = optarg;
+			break;
+
+		case 'L':
+			cfg.live_name = optarg;
+			break;
+
+		case 'K':
+			compare_ks = true;
+			break;
+
+		case 'G':
+			cfg.gpu = true;
+			break;
+
+		case 'x':
+		case 'X': {
+			int n = parse_resolution(optarg);
+			if (!n) {
+				fprintf(stderr, "Unknown resolution: %s\n", optarg);
+				exit(-1);
+			}
+
+			if (c == 'x') {
+				cfg.buckets_per_order = n;
+			} else {
+				cfg.output_buckets_per_order = n;
+			}
+			break;
 		}
 
-		srand(seed);
+		case 'T':
+			cfg.target_ci = atof(optarg);
+			if (!(cfg.target_ci > 0.0)) {
+				fprintf(stderr, "Target confidence interval must be more than 0\n");
+				exit(-1);
+			}
+			break;
 
-		/*
-		 * Find the next block.
-		 */
-		double block_duration = sim_pp(1.0 / 600.0);
+		case 'P':
+			cfg.num_ci_percentiles = parse_percentiles(optarg, cfg.ci_percentiles);
+			if (!cfg.num_ci_percentiles) {
+				fprintf(stderr, "Invalid percentiles: %s\n", optarg);
+				exit(-1);
+			}
+			break;
 
-		/*
-		 * What is the time at which this block is found?
-		 */
-		*cumulative_time += block_duration;
+		case 'g':
+			cfg.hash_model = true;
+			cfg.hash_growth = atof(optarg) / 100.0;
+			/*
+			 * The block schedule only models a hash rate that holds steady or grows.  A
+			 * falling one would eventually need more time than there is to find a block.
+			 */
+			if (!(cfg.hash_growth >= 0.0)) {
+				fprintf(stderr, "Hash rate growth can't be negative\n");
+				exit(-1);
+			}
+			break;
 
-		/*
-		 * Find the transactions that will arrive in that new block.
-		 */
-		int t = sim_transactions(*cumulative_time, tps);
-		cumulative_transactions += t;
+		case 'k':
+			cfg.sketch_accuracy = atof(optarg);
+			if (!(cfg.sketch_accuracy > 0.0) || !(cfg.sketch_accuracy < 0.5)) {
+				fprintf(stderr, "Sketch accuracy must be between 0 and 0.5\n");
+				exit(-1);
+			}
+			break;
 
-		int transactions_handled = create_block(*cumulative_time);
-		cumulative_transactions_handled += transactions_handled;
-		cumulative_transactions -= transactions_handled;
+		default:
+			usage(argv[0]);
+		}
 	}
 
-	*transactions_handled = cumulative_transactions_handled;
-}
+	/*
+	 * Results go to stdout unless we've been given a file for them.
+	 */
+	if (output_name && !freopen(output_name, "w", stdout)) {
+		fprintf(stderr, "Failed to create %s\n", output_name);
+		exit(-2);
+	}
 
-/*
- * output_results()
- *	Generate the output results.
- */
-static void output_results(void)
-{
-	double num_res = (double)num_results;
+	/*
+	 * Merging results files from separate runs?
+	 */
+	if ((optind < argc) && !strcmp(argv[optind], "merge")) {
+		if ((argc - optind) < 2) {
+			usage(argv[0]);
+		}
 
-	double cumulative_ratio = 0.0;
-	for (int i = smallest_bucket; i <= largest_bucket; i++) {
-		double r = (double)buckets[i] / num_res;
-		double bucket_start = pow(10.0, (double)(i - (NEGATIVE_ORDERS * NUM_BUCKETS_PER_ORDER)) / (double)NUM_BUCKETS_PER_ORDER); 
-		double bucket_end = pow(10.0, (double)(i + 1 - (NEGATIVE_ORDERS * NUM_BUCKETS_PER_ORDER)) / (double)NUM_BUCKETS_PER_ORDER); 
-		cumulative_ratio += r;
-		printf("%d | %.6f | %.6f | %.6f | %.6f\n",
-		       i, bucket_start, r, r / (bucket_end - bucket_start), cumulative_ratio);
+		tables_init();
+		merge(cfg.output_format, bucket_tables_find(cfg.output_buckets_per_order), argc - optind - 1, &argv[optind + 1]);
+		output_finish();
+		return 0;
 	}
-}
 
-/*
- * sim()
- *	Simulate mining.
- */
-void sim(double tps, int num_blocks, int num_sims)
-{
 	/*
-	 * We want some real randomness in our results.  Go and open a can of it!
+	 * Checking a set of results against the ones that we expected?
 	 */
-	FILE *f = fopen("/dev/urandom", "rb");
-	if (!f) {
-		fprintf(stderr, "Failed to open /dev/urandom\n");
-		return;
+	if ((optind < argc) && !strcmp(argv[optind], "compare")) {
+		if ((argc - optind) != 3) {
+			usage(argv[0]);
+		}
+
+		tables_init();
+		int differ = compare(argv[optind + 1], argv[optind + 2], compare_ks);
+		output_finish();
+		return differ ? 1 : 0;
+	}
+
+	/*
+	 * Watching a running simulation's live results?
+	 */
+	if ((optind < argc) && !strcmp(argv[optind], "watch")) {
+		int n = argc - optind;
+		int interval = (n == 3) ? atoi(argv[optind + 2]) : WATCH_INTERVAL;
+		if ((n < 2) || (n > 3) || (interval < 1)) {
+			usage(argv[0]);
+		}
+
+		tables_init();
+		watch(output_format_given ? cfg.output_format : OUTPUT_SUMMARY, argv[optind + 1], interval);
+		output_finish();
+		return 0;
+	}
+
+	if (histogram_name) {
+		if ((argc - optind) != 1) {
+			usage(argv[0]);
+		}
+
+		size_table_build(histogram_name, argv[optind]);
+		output_finish();
+		return 0;
 	}
 
-	int divisor = num_sims / 100;
-	if (divisor == 0) {
-		divisor = 1;
+	if (sizes_name) {
+		if (cfg.discipline == QUEUE_LAZY) {
+			fprintf(stderr, "--queue lazy needs fixed size transactions, so can't be used with --sizes\n");
+			exit(-1);
+		}
+
+		size_table_open(&sizes, sizes_name);
+		cfg.sizes = &sizes;
+	}
+
+	for (int l = 0; l < cfg.num_block_sizes; l++) {
+		if (cfg.sizes && (cfg.block_sizes[l] < (long long int)cfg.sizes->max_size)) {
+			fprintf(stderr, "Block size %lld is smaller than the largest transaction in %s\n", cfg.block_sizes[l], sizes_name);
+			exit(-1);
+		}
 	}
 
 	/*
-	 * Simulate many runs.
+	 * Several block sizes share their arrivals but not their results, which the
+	 * checkpoints, block statistics and convergence monitoring only keep one set of.  The
+	 * lazy backlog would make up different arrival times for each of them.
 	 */
-	for (int j = 0; j < num_sims; j++) {
-		double cumulative_time = 0.0;
-		int transactions_handled;
-		mine(tps, num_blocks, f, &cumulative_time, &transactions_handled);
+	if (cfg.num_block_sizes > 1) {
+		if (cfg.checkpoint_name || cfg.block_stats_name || (cfg.target_ci > 0.0) || (cfg.discipline == QUEUE_LAZY)) {
+			fprintf(stderr, "Several block sizes can't be used with --checkpoint, --block-stats, --target-ci or --queue lazy\n");
+			exit(-1);
+		}
+	}
 
-		if ((j % divisor) == 0) {
-			fprintf(stderr, "Sim: %d completed\n", j);
+	if (profile_name) {
+		if (cfg.discipline == QUEUE_LAZY) {
+			fprintf(stderr, "--queue lazy needs a constant arrival rate, so can't be used with --rate-profile\n");
+			exit(-1);
 		}
 
-		/*
-		 * Clean up the last simulation.
-		 */
-		struct transaction *t = pending_head;
-		while (t) {
-			struct transaction *next = t->next;
-			free(t);
-			t = next;
+		if (cfg.crn) {
+			fprintf(stderr, "--crn restarts arrivals at every block, so can't be used with --rate-profile\n");
+			exit(-1);
 		}
 
-		pending_head = NULL;
-		pending_tail = NULL;
-		pending_transactions = 0;
-		next_transaction_secs = 0.0;
+		rate_profile_load(&profile, profile_name);
+		cfg.profile = &profile;
 	}
 
-	fclose(f);
+	if (cfg.resume && !cfg.checkpoint_name) {
+		fprintf(stderr, "--resume needs a --checkpoint file\n");
+		exit(-1);
+	}
 
 	/*
-	 * Produce output data.
+	 * The blocks streamed between the last checkpoint and the interruption get simulated
+	 * again when we resume, so the stream can't just be carried on.
 	 */
-	output_results();
-}
+	if (cfg.resume && cfg.block_stats_name) {
+		fprintf(stderr, "Block statistics aren't checkpointed so --block-stats can't be used with --resume\n");
+		exit(-1);
+	}
 
-int main(int argc, char **argv)
-{
-	if (argc != 4) {
-		printf("usage: %s <starting-rate> <num-blocks> <num-sims>\n", argv[0]);
+	if (cfg.resume && (cfg.target_ci > 0.0)) {
+		fprintf(stderr, "Convergence isn't checkpointed so --target-ci can't be used with --resume\n");
+		exit(-1);
+	}
+
+	if (cfg.resume && (cfg.sketch_accuracy > 0.0)) {
+		fprintf(stderr, "Quantile sketches aren't checkpointed so --sketch can't be used with --resume\n");
 		exit(-1);
 	}
 
+	if (cfg.gpu) {
+#ifndef BTB_GPU
+		fprintf(stderr, "--gpu needs btb-gpu, which \"make gpu\" builds where the CUDA toolkit is installed\n");
+		exit(-1);
+#endif
+		if ((cfg.discipline != QUEUE_FIFO) || cfg.sizes || cfg.profile || cfg.hash_model || cfg.crn || (cfg.num_block_sizes > 1) ||
+		    cfg.checkpoint_name || cfg.block_stats_name || cfg.live_name || (cfg.sketch_accuracy > 0.0) || (cfg.target_ci > 0.0) ||
+		    run_bench) {
+			fprintf(stderr, "--gpu only runs FIFO simulations of fixed size transactions at one block size, so can't be used "
+				"with --queue fee or lazy, --sizes, --rate-profile, --hash-growth, --crn, several block sizes, --checkpoint, "
+				"--block-stats, --live, --sketch, --target-ci or --bench\n");
+			exit(-1);
+		}
+	}
+
+	if (run_bench) {
+		if ((argc != optind) || cfg.checkpoint_name || cfg.block_stats_name || (cfg.sketch_accuracy > 0.0) || (cfg.target_ci > 0.0)) {
+			usage(argv[0]);
+		}
+
+		tables_init();
+		bench(&cfg, use_seed);
+		output_finish();
+		return 0;
+	}
+
+	if ((argc - optind) != (cfg.num_rates ? 2 : 3)) {
+		usage(argv[0]);
+	}
+
 	/*
 	 * The TPS rate is expressed in the range 0 to 3.5.  3.5 represents a nominal arrival
 	 * of 100% of the network's capacity, distributed with a Poisson distribution.  Doing
 	 * this means that we don't actually worry about the size of the transactions or the
 	 * number of them, just their relative capacity.
 	 */
-	double tps = atof(argv[1]);
+	if (!cfg.num_rates) {
+		cfg.tps = malloc(sizeof(double));
+		if (!cfg.tps) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(-1);
+		}
+
+		cfg.tps[0] = atof(argv[optind++]);
+		cfg.num_rates = 1;
+	}
 
 	/*
 	 * Number of blocks that we wish to model per simulation run.  If, say, this is 1008
 	 * then this corresponds to a nominal week of mining as we're not modelling the
 	 * network capacity expanding or contracting.
 	 */
-	int nb = atoi(argv[2]);
+	cfg.num_blocks = atoi(argv[optind]);
 
 	/*
 	 * Number of simulation runs.  Larger is better here.  100k simulations should give
 	 * pretty consistent results; 1M is better :-)
 	 */
-	int ns = atoi(argv[3]);
+	cfg.num_sims = atoi(argv[optind + 1]);
 
-	printf("initial TPS: %f, num blocks: %d, num simulations: %d\n-\n", tps, nb, ns);
+	/*
+	 * If we weren't given a seed then we want some real randomness in our results.  Go and
+	 * get a small can of it!  This is the only entropy we need for the whole run.  When
+	 * we're resuming the seed comes from the checkpoint instead.
+	 */
+	if (!use_seed && !cfg.resume) {
+		if (getrandom(&cfg.seed, sizeof(cfg.seed), 0) != sizeof(cfg.seed)) {
+			fprintf(stderr, "Failed to read random seed\n");
+			exit(-2);
+		}
+	}
 
-	sim(tps, nb, ns);
-}
+	if (!cfg.resume) {
+		fprintf(stderr, "Seed: 0x%016" PRIx64 "\n", cfg.seed);
+	}
+
+	tables_init();
+
+	sim(&cfg);
+	free(cfg.tps);
+
+	if (cfg.sizes) {
+		size_table_close(&sizes);
+	}
+
+	if (cfg.profile) {
+		rate_profile_destroy(&profile);
+	}
 
+	output_finish();
+	return 0;
+}
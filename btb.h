@@ -0,0 +1,150 @@
+/*
+ * btb.h
+ *	Interface to libbtb, the transaction processing simulation behind btb, for programs
+ *	that want to run simulations in-process.
+ *
+ * Copyright (C) 2015 David Hudson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BTB_H
+#define BTB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Order in which pending transactions are taken into blocks.
+ */
+enum btb_queue {
+	BTB_QUEUE_FIFO,				/* Oldest transaction first */
+	BTB_QUEUE_FEE,				/* Highest fee rate first */
+	BTB_QUEUE_LAZY				/* Oldest first, with arrival times made on demand */
+};
+
+/*
+ * Configuration of a simulation context.  btb_config_init() fills in the defaults, which
+ * are the same as the command line's.
+ */
+struct btb_config {
+	int num_blocks;				/* Number of blocks per simulation */
+	enum btb_queue queue;			/* Order in which transactions are confirmed */
+	long long int block_size;		/* Block size limit in bytes */
+	int buckets_per_order;			/* Histogram resolution, 1000 (fine) or 100 (coarse) */
+	bool hash_model;			/* Model hash rate growth and retargeting? */
+	double hash_growth;			/* Hash rate growth per retarget timespan (0.1 is 10%, never negative) */
+	bool crn;				/* Use common random numbers across rates? */
+	uint64_t seed;				/* Master seed */
+};
+
+/*
+ * Summary of the results collected by a context.
+ */
+struct btb_results {
+	long long int num_sims;			/* Number of simulations run */
+	long long int num_results;		/* Number of transaction confirmation times recorded */
+	double mean;				/* Mean confirmation time, in seconds */
+	double stddev;				/* Standard deviation of the confirmation times */
+};
+
+/*
+ * Simulation context.  Each one runs simulations on the thread that calls it, so
+ * separate threads need separate contexts, whose results can be merged afterwards.
+ */
+struct btb_context;
+
+/*
+ * btb_config_init()
+ *	Fill in a configuration with the defaults: 1008 blocks of 1 MB, a FIFO queue, the
+ *	fine histogram resolution, a constant hash rate and a seed of 0.
+ */
+void btb_config_init(struct btb_config *cfg);
+
+/*
+ * btb_init()
+ *	Create a simulation context.  Returns NULL if the configuration isn't valid or
+ *	there isn't enough memory.
+ */
+struct btb_context *btb_init(const struct btb_config *cfg);
+
+/*
+ * btb_run()
+ *	Run "num_sims" more simulations at "tps" (relative to 1 MB blocks, so 3.5 is the
+ *	network's capacity), adding their results to the context's.  Each simulation draws
+ *	its random numbers from the seed and its number since the last reset, so the same
+ *	calls after the same reset always give the same results.  Returns false if the
+ *	arguments aren't valid, if they'd take the context past INT_MAX simulations since
+ *	the last reset, or if a simulation runs out of memory or pending transaction
+ *	space, in which case none of the run's results are kept and the context is left as
+ *	it was before the call.  The library never exits the process or writes to stderr.
+ */
+bool btb_run(struct btb_context *ctx, double tps, int num_sims);
+
+/*
+ * btb_merge()
+ *	Add the results of context "src" to those of "dest".  Returns false if they don't
+ *	have the same histogram resolution.
+ */
+bool btb_merge(struct btb_context *dest, const struct btb_context *src);
+
+/*
+ * btb_reset()
+ *	Throw away a context's results and start numbering its simulations again, this time
+ *	from master seed "seed".  Everything that the context has allocated is kept for the
+ *	next run.
+ */
+void btb_reset(struct btb_context *ctx, uint64_t seed);
+
+/*
+ * btb_results()
+ *	Summarize a context's results.
+ */
+void btb_results(const struct btb_context *ctx, struct btb_results *res);
+
+/*
+ * btb_percentile()
+ *	Estimate quantile "q" (0 to 1) of a context's confirmation times, in seconds.
+ *	Returns NaN if there aren't any.
+ */
+double btb_percentile(const struct btb_context *ctx, double q);
+
+/*
+ * btb_buckets()
+ *	Return a context's histogram bucket counts and set "*num_buckets" to the number of
+ *	them.  If "edges" isn't NULL then it's set to the bucket edges, of which there are
+ *	"*num_buckets" + 1; bucket i counts the confirmation times from edge i up to edge
+ *	i + 1.  Both stay valid until the context is destroyed.
+ */
+const long int *btb_buckets(const struct btb_context *ctx, const double **edges, int *num_buckets);
+
+/*
+ * btb_destroy()
+ *	Release everything held by a context.
+ */
+void btb_destroy(struct btb_context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTB_H */
@@ -0,0 +1,414 @@
+/*
+ * gpu.cu
+ *	GPU backend for btb-gpu: runs batches of FIFO simulations with one simulation per
+ *	GPU thread, and merges their results into the host's histograms.
+ *
+ * Copyright (C) 2015 David Hudson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <cuda_runtime.h>
+
+#include "gpu.h"
+
+/*
+ * Threads in each thread block, at most.  Fewer are used when a thread block's shared
+ * histograms could otherwise overflow (see gpu_simulate()).
+ */
+#define GPU_THREADS_PER_BLOCK 256
+
+/*
+ * Shared memory that a thread block can use for its histograms without asking for more.
+ */
+#define GPU_SHARED_BYTES (48 * 1024)
+
+/*
+ * Random streams.  Each is one word of the Philox counter, alongside the block or
+ * transaction number.
+ */
+#define GPU_STREAM_BLOCK 0			/* Block intervals */
+#define GPU_STREAM_ARRIVAL 1			/* Transaction interarrival times */
+
+/*
+ * Everything that a kernel launch needs to run a batch of simulations.
+ */
+struct gpu_batch {
+	uint64_t seed;				/* Master seed */
+	uint64_t first_sim;			/* Number of the batch's first simulation */
+	int num_sims;				/* Number of simulations in the batch */
+	double tps;				/* Transaction arrival rate */
+	int num_blocks;				/* Number of blocks per simulation */
+	unsigned long long int fit;		/* Number of transactions that fit in a block */
+	int num_buckets;			/* Number of histogram buckets */
+	int num_hists;				/* Number of histograms in each thread block */
+	const double *limit;			/* Largest age in each bucket (device) */
+	const uint16_t *lookup;			/* First possible bucket for each age key (device) */
+	int64_t lookup_base;			/* Age key of lookup[0] */
+	int64_t lookup_size;			/* Number of entries in lookup[] */
+	unsigned long long int *counts;		/* Bucket counts for the whole batch (device) */
+	long long int *num_results;		/* Number of results from each simulation (device) */
+	double *mean;				/* Mean of each simulation's results (device) */
+	double *m2;				/* M2 of each simulation's results (device) */
+};
+
+/*
+ * Device copy of a set of bucket tables.
+ */
+struct gpu_tables {
+	const struct bucket_tables *tables;	/* Host tables that these are a copy of */
+	double *limit;				/* Largest age in each bucket */
+	uint16_t *lookup;			/* First possible bucket for each age key */
+};
+
+/*
+ * Device copies of the bucket tables, made the first time each resolution is used.
+ */
+static struct gpu_tables gpu_fine_tables;
+static struct gpu_tables gpu_coarse_tables;
+
+/*
+ * gpu_check()
+ *	Report a failed CUDA call and exit.
+ */
+static void gpu_check(cudaError_t err, const char *what)
+{
+	if (err != cudaSuccess) {
+		fprintf(stderr, "GPU: %s failed: %s\n", what, cudaGetErrorString(err));
+		exit(-2);
+	}
+}
+
+/*
+ * gpu_splitmix64()
+ *	Step a splitmix64 generator, as splitmix64() does on the host.
+ */
+__device__ static uint64_t gpu_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * gpu_sim_seed()
+ *	Derive the seed for simulation "sim" from a master seed, just as the CPU does.
+ */
+__device__ static uint64_t gpu_sim_seed(uint64_t master, uint64_t sim)
+{
+	uint64_t x = sim;
+	uint64_t h = gpu_splitmix64(&x);
+	x = master ^ h;
+	return gpu_splitmix64(&x);
+}
+
+/*
+ * gpu_exp()
+ *	Return the exponential variate (with mean 1) numbered "i" in random stream "stream"
+ *	of the simulation with Philox key "key".
+ *
+ * A counter-based generator means that each variate can be made again whenever it's
+ * needed, which is what lets gpu_mine_sim() do without a pending queue.
+ */
+__device__ static double gpu_exp(const uint32_t key[2], uint32_t stream, uint64_t i)
+{
+	uint32_t c0 = (uint32_t)i;
+	uint32_t c1 = (uint32_t)(i >> 32);
+	uint32_t c2 = stream;
+	uint32_t c3 = 0;
+	uint32_t k0 = key[0];
+	uint32_t k1 = key[1];
+
+	for (int r = 0; r < PHILOX_ROUNDS; r++) {
+		if (r) {
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+
+		uint32_t lo0 = PHILOX_M0 * c0;
+		uint32_t hi0 = __umulhi(PHILOX_M0, c0);
+		uint32_t lo1 = PHILOX_M1 * c2;
+		uint32_t hi1 = __umulhi(PHILOX_M1, c2);
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+	}
+
+	uint64_t bits = ((uint64_t)c1 << 32) | c0;
+	return -log1p(-((double)(bits >> 11) * 0x1.0p-53));
+}
+
+/*
+ * gpu_bucket_index()
+ *	Work out which histogram bucket an age belongs in, exactly as bucket_index() does.
+ */
+__device__ static int gpu_bucket_index(const struct gpu_batch *b, double age)
+{
+	int64_t k = (__double_as_longlong(age) >> BUCKET_LOOKUP_SHIFT) - b->lookup_base;
+	if (k < 0) {
+		return 0;
+	}
+
+	if (k >= b->lookup_size) {
+		return b->num_buckets - 1;
+	}
+
+	int i = __ldg(&b->lookup[k]);
+	while (age > __ldg(&b->limit[i])) {
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * gpu_mine_sim()
+ *	Run simulation "sim" of a batch, recording the age of each transaction confirmed in
+ *	histogram "hist" and returning the count, mean and M2 of those ages.
+ *
+ * Every transaction is the same size and they're confirmed oldest first, so all that a
+ * block needs to know is how many have arrived and how many have been confirmed.  We
+ * walk two cursors along the same stream of arrivals: one finds the arrivals up to each
+ * block, and the other makes the same arrival times again, in the same order and with
+ * the same arithmetic, as the transactions are confirmed.  Each simulation then needs
+ * a few registers however big its backlog gets, rather than a queue in device memory.
+ */
+__device__ static void gpu_mine_sim(const struct gpu_batch *b, uint64_t sim, unsigned int *hist, long long int *num_results,
+				    double *mean, double *m2)
+{
+	uint64_t seed = gpu_sim_seed(b->seed, sim);
+	uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+
+	double block_time = 0.0;
+	unsigned long long int arrived = 0;
+	double next_arrival = 0.0;
+	unsigned long long int confirmed = 0;
+	double next_confirm = 0.0;
+
+	long long int n = 0;
+	double mn = 0.0;
+	double sq = 0.0;
+
+	for (int i = 0; i < b->num_blocks; i++) {
+		block_time += gpu_exp(key, GPU_STREAM_BLOCK, (uint64_t)i) * TARGET_BLOCK_INTERVAL;
+
+		/*
+		 * As on the CPU, the first transaction arrives at the start of time and any that
+		 * arrive at the moment the block is found make it into the block.
+		 */
+		while (next_arrival <= block_time) {
+			next_arrival += gpu_exp(key, GPU_STREAM_ARRIVAL, arrived) / b->tps;
+			arrived++;
+		}
+
+		unsigned long long int take = arrived - confirmed;
+		if (take > b->fit) {
+			take = b->fit;
+		}
+
+		for (unsigned long long int k = 0; k < take; k++) {
+			double age = block_time - next_confirm;
+			atomicAdd(&hist[gpu_bucket_index(b, age)], 1U);
+
+			n++;
+			double delta = age - mn;
+			mn += delta / (double)n;
+			sq += delta * (age - mn);
+
+			next_confirm += gpu_exp(key, GPU_STREAM_ARRIVAL, confirmed) / b->tps;
+			confirmed++;
+		}
+	}
+
+	*num_results = n;
+	*mean = mn;
+	*m2 = sq;
+}
+
+/*
+ * gpu_mine()
+ *	Kernel that runs a batch of simulations, one per thread.
+ *
+ * Each thread block keeps "num_hists" histograms in shared memory.  At the coarse
+ * resolution there's one for each warp, so the warps never contend for them, while
+ * a fine histogram takes most of the shared memory and the whole thread block shares
+ * one.  Once all of the block's simulations are done it adds its histograms into the
+ * batch's counts.
+ */
+__global__ static void gpu_mine(struct gpu_batch b)
+{
+	extern __shared__ unsigned int hists[];
+
+	for (int i = threadIdx.x; i < b.num_hists * b.num_buckets; i += blockDim.x) {
+		hists[i] = 0;
+	}
+
+	__syncthreads();
+
+	int s = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (s < b.num_sims) {
+		unsigned int *hist = &hists[((threadIdx.x / warpSize) % b.num_hists) * b.num_buckets];
+		gpu_mine_sim(&b, b.first_sim + s, hist, &b.num_results[s], &b.mean[s], &b.m2[s]);
+	}
+
+	__syncthreads();
+
+	for (int i = threadIdx.x; i < b.num_buckets; i += blockDim.x) {
+		unsigned long long int total = 0;
+		for (int h = 0; h < b.num_hists; h++) {
+			total += hists[(h * b.num_buckets) + i];
+		}
+
+		if (total) {
+			atomicAdd(&b.counts[i], total);
+		}
+	}
+}
+
+/*
+ * gpu_tables_find()
+ *	Return the device copy of bucket tables "t", making it if need be.
+ */
+static const struct gpu_tables *gpu_tables_find(const struct bucket_tables *t)
+{
+	struct gpu_tables *gt = (t->buckets_per_order == FINE_BUCKETS_PER_ORDER) ? &gpu_fine_tables : &gpu_coarse_tables;
+	if (gt->tables) {
+		return gt;
+	}
+
+	gpu_check(cudaMalloc((void **)&gt->limit, t->num_buckets * sizeof(double)), "cudaMalloc");
+	gpu_check(cudaMalloc((void **)&gt->lookup, t->lookup_size * sizeof(uint16_t)), "cudaMalloc");
+	gpu_check(cudaMemcpy(gt->limit, t->limit, t->num_buckets * sizeof(double), cudaMemcpyHostToDevice), "cudaMemcpy");
+	gpu_check(cudaMemcpy(gt->lookup, t->lookup, t->lookup_size * sizeof(uint16_t), cudaMemcpyHostToDevice), "cudaMemcpy");
+	gt->tables = t;
+	return gt;
+}
+
+/*
+ * gpu_simulate()
+ *	Run a batch of simulations on the GPU and add their results to histogram "h".
+ */
+void gpu_simulate(uint64_t seed, uint64_t first_sim, int num_sims, double tps, int num_blocks, long long int block_size,
+		  struct histogram *h)
+{
+	const struct bucket_tables *t = h->tables;
+	const struct gpu_tables *gt = gpu_tables_find(t);
+
+	struct gpu_batch b;
+	b.seed = seed;
+	b.first_sim = first_sim;
+	b.num_sims = num_sims;
+	b.tps = tps;
+	b.num_blocks = num_blocks;
+	b.fit = (unsigned long long int)(block_size / TRANSACTION_SIZE);
+	b.num_buckets = t->num_buckets;
+	b.limit = gt->limit;
+	b.lookup = gt->lookup;
+	b.lookup_base = t->lookup_base;
+	b.lookup_size = t->lookup_size;
+
+	/*
+	 * A simulation can't confirm more than "fit" transactions a block, so that bounds
+	 * what the threads sharing a histogram can add to any of its 32-bit counts.  Use as
+	 * many threads as we can without letting that overflow.
+	 */
+	int max_hists = GPU_SHARED_BYTES / (t->num_buckets * (int)sizeof(unsigned int));
+	unsigned long long int sim_results = (unsigned long long int)num_blocks * b.fit;
+	int threads = GPU_THREADS_PER_BLOCK;
+	while (1) {
+		b.num_hists = threads / 32;
+		if (b.num_hists > max_hists) {
+			b.num_hists = max_hists;
+		}
+
+		if ((((unsigned long long int)threads / b.num_hists) * sim_results) <= UINT32_MAX) {
+			break;
+		}
+
+		if (threads == 32) {
+			fprintf(stderr, "GPU: %d blocks of %lld bytes can confirm too many transactions for the GPU's histograms\n",
+				num_blocks, block_size);
+			exit(-1);
+		}
+
+		threads /= 2;
+	}
+
+	unsigned long long int *counts = (unsigned long long int *)malloc(t->num_buckets * sizeof(unsigned long long int));
+	long long int *num_results = (long long int *)malloc(num_sims * sizeof(long long int));
+	double *mean = (double *)malloc(num_sims * sizeof(double));
+	double *m2 = (double *)malloc(num_sims * sizeof(double));
+	if (!counts || !num_results || !mean || !m2) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(-1);
+	}
+
+	gpu_check(cudaMalloc((void **)&b.counts, t->num_buckets * sizeof(unsigned long long int)), "cudaMalloc");
+	gpu_check(cudaMalloc((void **)&b.num_results, num_sims * sizeof(long long int)), "cudaMalloc");
+	gpu_check(cudaMalloc((void **)&b.mean, num_sims * sizeof(double)), "cudaMalloc");
+	gpu_check(cudaMalloc((void **)&b.m2, num_sims * sizeof(double)), "cudaMalloc");
+	gpu_check(cudaMemset(b.counts, 0, t->num_buckets * sizeof(unsigned long long int)), "cudaMemset");
+
+	int blocks = (num_sims + threads - 1) / threads;
+	size_t shared = (size_t)b.num_hists * t->num_buckets * sizeof(unsigned int);
+	gpu_mine<<<blocks, threads, shared>>>(b);
+	gpu_check(cudaGetLastError(), "Kernel launch");
+	gpu_check(cudaDeviceSynchronize(), "Kernel");
+
+	gpu_check(cudaMemcpy(counts, b.counts, t->num_buckets * sizeof(unsigned long long int), cudaMemcpyDeviceToHost), "cudaMemcpy");
+	gpu_check(cudaMemcpy(num_results, b.num_results, num_sims * sizeof(long long int), cudaMemcpyDeviceToHost), "cudaMemcpy");
+	gpu_check(cudaMemcpy(mean, b.mean, num_sims * sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+	gpu_check(cudaMemcpy(m2, b.m2, num_sims * sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+
+	cudaFree(b.counts);
+	cudaFree(b.num_results);
+	cudaFree(b.mean);
+	cudaFree(b.m2);
+
+	/*
+	 * Combine the simulations' moments in order, with the same pairwise update that
+	 * histogram_merge() uses, so that a batch always gives the same mean and M2.
+	 */
+	long long int total = 0;
+	double batch_mean = 0.0;
+	double batch_m2 = 0.0;
+	for (int s = 0; s < num_sims; s++) {
+		if (!num_results[s]) {
+			continue;
+		}
+
+		double n = (double)(total + num_results[s]);
+		double delta = mean[s] - batch_mean;
+		batch_mean += delta * ((double)num_results[s] / n);
+		batch_m2 += m2[s] + (delta * delta * (((double)total * (double)num_results[s]) / n));
+		total += num_results[s];
+	}
+
+	histogram_add_counts(h, (const uint64_t *)counts, total, batch_mean, batch_m2);
+
+	free(counts);
+	free(num_results);
+	free(mean);
+	free(m2);
+}
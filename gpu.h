@@ -0,0 +1,59 @@
+/*
+ * gpu.h
+ *	GPU backend for btb-gpu ("make gpu"), which runs batches of FIFO simulations with
+ *	one simulation per GPU thread.
+ *
+ * Copyright (C) 2015 David Hudson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef GPU_H
+#define GPU_H
+
+/*
+ * gpu.cu is C++, so it needs sim.h's declarations with C linkage too.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sim.h"
+
+/*
+ * Number of simulations that we hand to the GPU at a time.  Each batch is one kernel
+ * launch, so this also sets how often we can report progress.
+ */
+#define GPU_BATCH_SIMS 16384
+
+/*
+ * gpu_simulate()
+ *	Run simulations "first_sim" to "first_sim + num_sims - 1" of master seed "seed" on
+ *	the GPU, each of "num_blocks" blocks of "block_size" bytes with transactions
+ *	arriving at "tps", and add their results to histogram "h".  Every transaction is
+ *	TRANSACTION_SIZE bytes and they're confirmed oldest first, as with "--queue fifo".
+ *	Reports any GPU error and exits.
+ */
+void gpu_simulate(uint64_t seed, uint64_t first_sim, int num_sims, double tps, int num_blocks, long long int block_size,
+		  struct histogram *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_H */
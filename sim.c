@@ -0,0 +1,2736 @@
+/*
+ * sim.c
+ *	Simulation core shared by btb and libbtb, and libbtb's interface to it (btb.h).
+ *
+ * Copyright (C) 2015 David Hudson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <setjmp.h>
+#include <limits.h>
+
+#ifdef BTB_PROFILE
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+/*
+ * Only libbtb's interface is visible outside a shared library; everything in "sim.h"
+ * is just for btb.
+ */
+#pragma GCC visibility push(default)
+#include "btb.h"
+#pragma GCC visibility pop
+
+#include "sim.h"
+
+/*
+ * Key that we mix into a simulation's seed to get the seed for its block schedule, so
+ * that block times don't share a random stream with transaction arrivals.
+ */
+#define BLOCK_SCHEDULE_SEED_KEY 0x6a09e667f3bcc908ULL
+
+/*
+ * Streams of common random numbers.  Each is one word of the Philox counter, alongside
+ * the simulation and block numbers.
+ */
+#define CRN_STREAM_BLOCK 0			/* Block interval and arrival seed for a block */
+#define CRN_STREAM_SCHEDULE 1			/* Seed for a simulation's block schedule */
+
+/*
+ * Mean fee paid by a transaction.  When we're ordering transactions by fee we draw each
+ * fee from an exponential distribution with this mean.
+ */
+#define MEAN_FEE 0.00001
+
+/*
+ * Initial capacity of a fee-ordered mempool.
+ */
+#define FEE_HEAP_INITIAL_CAPACITY 4096
+
+/*
+ * Initial number of segments in a lazy backlog.
+ */
+#define LAZY_BACKLOG_INITIAL_CAPACITY 256
+
+/*
+ * Number of arrival times that we materialize from a lazy backlog segment at a time.
+ */
+#define LAZY_BATCH 256
+
+/*
+ * Mean arrival count above which we draw Poisson variates by transformed rejection
+ * rather than by multiplying uniforms together.
+ */
+#define POISSON_PTRS_MIN_MEAN 10.0
+
+/*
+ * Phases of a simulation that a profiling build ("make PROFILE=1") times.  Some of them
+ * nest: recording ages in the histogram is part of confirming a block, and RNG refills
+ * and allocations happen within whichever phase needs them.
+ */
+enum profile_phase {
+	PROFILE_BLOCK_INTERVAL,			/* Drawing block intervals with sim_pp() */
+	PROFILE_GENERATE,			/* sim_transactions() */
+	PROFILE_CONFIRM,			/* create_block() */
+	PROFILE_HISTOGRAM,			/* Recording ages in the histogram */
+	PROFILE_RNG,				/* Refilling the batch of exponential variates */
+	PROFILE_ALLOC,				/* Allocating storage for pending transactions */
+	NUM_PROFILE_PHASES
+};
+
+#ifdef BTB_PROFILE
+/*
+ * Hardware events that we count in each phase if the kernel lets us read the counters
+ * from user space.  The first must be PERF_COUNT_HW_CPU_CYCLES.
+ */
+#define NUM_PROFILE_COUNTERS 3
+
+static const uint64_t profile_events[NUM_PROFILE_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const char *profile_phase_names[NUM_PROFILE_PHASES] = {
+	"block interval",
+	"transactions",
+	"create block",
+	"histogram",
+	"rng refill",
+	"allocation"
+};
+
+/*
+ * Timestamp and counter values at the start of a phase.
+ */
+struct profile_mark {
+	uint64_t tsc;				/* Time stamp counter */
+	uint64_t counter[NUM_PROFILE_COUNTERS];	/* Hardware event counts */
+};
+
+/*
+ * Totals for one phase.
+ */
+struct profile_totals {
+	long long int calls;			/* Number of times the phase ran */
+	uint64_t ticks;				/* Time stamp counter ticks spent in it */
+	uint64_t counter[NUM_PROFILE_COUNTERS];	/* Hardware events counted in it */
+};
+
+/*
+ * Profile of one simulation thread.
+ */
+struct profile_thread {
+	struct profile_totals phase[NUM_PROFILE_PHASES];
+	bool counters;				/* True if we can read the hardware counters */
+	int fd[NUM_PROFILE_COUNTERS];		/* perf_event file descriptors */
+	struct perf_event_mmap_page *page[NUM_PROFILE_COUNTERS];
+						/* Mapped control pages of the events */
+	uint64_t start_tsc;			/* Time stamp counter when the thread started */
+	uint64_t start_ns;			/* Monotonic time when the thread started */
+};
+
+static __thread struct profile_thread profile;
+
+/*
+ * Serializes the profile reports of different threads.
+ */
+static pthread_mutex_t profile_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * profile_ns()
+ *	Return the current monotonic time in nanoseconds.
+ */
+static uint64_t profile_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * profile_tsc()
+ *	Read the time stamp counter, or the monotonic clock on machines that don't have one.
+ */
+static inline uint64_t profile_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return profile_ns();
+#endif
+}
+
+/*
+ * profile_counter()
+ *	Read hardware counter "i" without a system call, using the kernel's seqlock
+ *	protocol on the event's control page.
+ */
+static inline uint64_t profile_counter(int i)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	volatile struct perf_event_mmap_page *pc = profile.page[i];
+	uint32_t seq;
+	uint64_t count;
+	do {
+		seq = pc->lock;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		count = pc->offset;
+		uint32_t idx = pc->index;
+		if (idx) {
+			int shift = 64 - pc->pmc_width;
+			count += (uint64_t)(((int64_t)(__rdpmc((int)idx - 1) << shift)) >> shift);
+		}
+
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	} while (pc->lock != seq);
+
+	return count;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * profile_mark()
+ *	Record the start of a phase in "m".
+ */
+static inline void profile_mark(struct profile_mark *m)
+{
+	if (profile.counters) {
+		for (int i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+			m->counter[i] = profile_counter(i);
+		}
+	}
+
+	m->tsc = profile_tsc();
+}
+
+/*
+ * profile_add()
+ *	Add the time and events since "m" to phase "p".
+ */
+static inline void profile_add(enum profile_phase p, const struct profile_mark *m)
+{
+	uint64_t tsc = profile_tsc();
+	struct profile_totals *t = &profile.phase[p];
+	t->calls++;
+	t->ticks += tsc - m->tsc;
+
+	if (profile.counters) {
+		for (int i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+			t->counter[i] += profile_counter(i) - m->counter[i];
+		}
+	}
+}
+
+/*
+ * profile_close_counters()
+ *	Close any hardware counters that we've opened for this thread.
+ */
+static void profile_close_counters(void)
+{
+	for (int i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+		if (profile.page[i]) {
+			munmap((void *)profile.page[i], (size_t)sysconf(_SC_PAGESIZE));
+			profile.page[i] = NULL;
+		}
+
+		if (profile.fd[i] >= 0) {
+			close(profile.fd[i]);
+			profile.fd[i] = -1;
+		}
+	}
+
+	profile.counters = false;
+}
+
+/*
+ * profile_thread_start()
+ *	Start profiling the calling thread.  We only use the hardware counters if we can open
+ *	all of them and read them directly; setting BTB_PROFILE_COUNTERS=0 in the environment
+ *	turns them off.
+ */
+void profile_thread_start(void)
+{
+	memset(&profile, 0, sizeof(profile));
+	for (int i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+		profile.fd[i] = -1;
+	}
+
+	const char *env = getenv("BTB_PROFILE_COUNTERS");
+	bool want_counters = !env || strcmp(env, "0");
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (want_counters) {
+		profile.counters = true;
+		for (int i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = profile_events[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+
+			profile.fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if (profile.fd[i] < 0) {
+				profile.counters = false;
+				break;
+			}
+
+			void *page = mmap(NULL, (size_t)sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, profile.fd[i], 0);
+			if (page == MAP_FAILED) {
+				profile.counters = false;
+				break;
+			}
+
+			profile.page[i] = (struct perf_event_mmap_page *)page;
+			if (!profile.page[i]->cap_user_rdpmc) {
+				profile.counters = false;
+				break;
+			}
+		}
+
+		if (!profile.counters) {
+			profile_close_counters();
+		}
+	}
+#else
+	(void)want_counters;
+#endif
+
+	profile.start_ns = profile_ns();
+	profile.start_tsc = profile_tsc();
+}
+
+/*
+ * profile_thread_report()
+ *	Report the profile of the calling thread, which is worker "worker", on stderr.
+ */
+void profile_thread_report(int worker)
+{
+	uint64_t elapsed_ticks = profile_tsc() - profile.start_tsc;
+	uint64_t elapsed_ns = profile_ns() - profile.start_ns;
+	double ticks_per_ns = elapsed_ns ? (double)elapsed_ticks / (double)elapsed_ns : 1.0;
+
+	pthread_mutex_lock(&profile_report_lock);
+	fprintf(stderr, "Profile of worker %d: %.3f s, %.3f ticks/ns%s\n",
+		worker, (double)elapsed_ns / 1e9, ticks_per_ns,
+		profile.counters ? "" : " (hardware counters unavailable)");
+	fprintf(stderr, "  %-16s %14s %12s %7s %10s", "phase", "calls", "ms", "%time", "ns/call");
+	if (profile.counters) {
+		fprintf(stderr, " %10s %14s %14s", "cycles/call", "cache-misses", "branch-misses");
+	}
+
+	fprintf(stderr, "\n");
+
+	for (int p = 0; p < NUM_PROFILE_PHASES; p++) {
+		const struct profile_totals *t = &profile.phase[p];
+		if (!t->calls) {
+			continue;
+		}
+
+		double ns = (double)t->ticks / ticks_per_ns;
+		fprintf(stderr, "  %-16s %14lld %12.3f %7.2f %10.1f",
+			profile_phase_names[p], t->calls, ns / 1e6,
+			elapsed_ns ? (100.0 * ns) / (double)elapsed_ns : 0.0, ns / (double)t->calls);
+		if (profile.counters) {
+			fprintf(stderr, " %10.1f %14" PRIu64 " %14" PRIu64,
+				(double)t->counter[0] / (double)t->calls, t->counter[1], t->counter[2]);
+		}
+
+		fprintf(stderr, "\n");
+	}
+
+	pthread_mutex_unlock(&profile_report_lock);
+
+	profile_close_counters();
+}
+
+/*
+ * Mark the start and end of a profiled phase.  "m" names the mark for the phase.
+ */
+#define PROFILE_BEGIN(m) struct profile_mark m; profile_mark(&m)
+#define PROFILE_END(p, m) profile_add(p, &m)
+#else
+#define PROFILE_BEGIN(m) do { } while (0)
+#define PROFILE_END(p, m) do { } while (0)
+#endif
+
+/*
+ * Bucket boundary tables for each resolution.  These are built once by
+ * bucket_tables_init() and are then only ever read, so all of the simulation threads
+ * share them.
+ */
+static struct bucket_tables fine_buckets;
+static struct bucket_tables coarse_buckets;
+static bool bucket_tables_built;
+static pthread_once_t bucket_tables_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Where sim_fail() returns to on this thread, or NULL if it should exit instead.  The
+ * library's entry points set this so that an error deep inside a simulation comes back
+ * to the caller as a failed call.
+ */
+static __thread jmp_buf *sim_fail_jump;
+
+/*
+ * sim_fail()
+ *	Give up on the current simulation because of error "msg".
+ */
+static void __attribute__((noreturn)) sim_fail(const char *msg)
+{
+	if (sim_fail_jump) {
+		longjmp(*sim_fail_jump, 1);
+	}
+
+	fprintf(stderr, "%s\n", msg);
+	exit(-1);
+}
+
+/*
+ * age_key()
+ *	Return the bucket lookup key for an age.
+ */
+static inline int64_t age_key(double age)
+{
+	int64_t bits;
+	memcpy(&bits, &age, sizeof(bits));
+	return bits >> BUCKET_LOOKUP_SHIFT;
+}
+
+/*
+ * bucket_tables_build()
+ *	Build the bucket boundary tables for "buckets_per_order" buckets per power of 10.
+ *	Returns false if we run out of memory.
+ */
+static bool bucket_tables_build(struct bucket_tables *t, int buckets_per_order)
+{
+	int num_buckets = buckets_per_order * (POSITIVE_ORDERS + NEGATIVE_ORDERS);
+	t->buckets_per_order = buckets_per_order;
+	t->num_buckets = num_buckets;
+	t->edge = malloc((num_buckets + 1) * sizeof(double));
+	t->limit = malloc(num_buckets * sizeof(double));
+	if (!t->edge || !t->limit) {
+		free(t->edge);
+		free(t->limit);
+		return false;
+	}
+
+	for (int i = 0; i <= num_buckets; i++) {
+		t->edge[i] = pow(10.0, (double)(i - (NEGATIVE_ORDERS * buckets_per_order)) / (double)buckets_per_order);
+	}
+
+	for (int b = 0; b < num_buckets - 1; b++) {
+		t->limit[b] = t->edge[b];
+	}
+
+	t->limit[num_buckets - 1] = INFINITY;
+
+	t->lookup_base = age_key(t->limit[0]);
+	t->lookup_size = age_key(t->limit[num_buckets - 2]) - t->lookup_base + 1;
+	t->lookup = malloc(t->lookup_size * sizeof(uint16_t));
+	if (!t->lookup) {
+		free(t->edge);
+		free(t->limit);
+		return false;
+	}
+
+	int b = 0;
+	for (int64_t k = 0; k < t->lookup_size; k++) {
+		/*
+		 * Find the smallest age that has this key and then the first bucket that can hold it.
+		 */
+		int64_t bits = (t->lookup_base + k) << BUCKET_LOOKUP_SHIFT;
+		double age;
+		memcpy(&age, &bits, sizeof(age));
+		while (age > t->limit[b]) {
+			b++;
+		}
+
+		t->lookup[k] = (uint16_t)b;
+	}
+
+	return true;
+}
+
+/*
+ * bucket_tables_build_all()
+ *	Build the bucket boundary tables for both resolutions.
+ */
+static void bucket_tables_build_all(void)
+{
+	bucket_tables_built = bucket_tables_build(&fine_buckets, FINE_BUCKETS_PER_ORDER) &&
+			      bucket_tables_build(&coarse_buckets, COARSE_BUCKETS_PER_ORDER);
+}
+
+/*
+ * bucket_tables_init()
+ *	Make sure that the bucket boundary tables have been built, whichever thread gets to
+ *	them first.  Returns false if there wasn't enough memory to build them.
+ */
+bool bucket_tables_init(void)
+{
+	pthread_once(&bucket_tables_once, bucket_tables_build_all);
+	return bucket_tables_built;
+}
+
+/*
+ * bucket_tables_find()
+ *	Return the bucket tables with "buckets_per_order" buckets per power of 10, or NULL if
+ *	there's no such resolution.
+ */
+const struct bucket_tables *bucket_tables_find(int buckets_per_order)
+{
+	if (buckets_per_order == FINE_BUCKETS_PER_ORDER) {
+		return &fine_buckets;
+	}
+
+	if (buckets_per_order == COARSE_BUCKETS_PER_ORDER) {
+		return &coarse_buckets;
+	}
+
+	return NULL;
+}
+
+/*
+ * bucket_index()
+ *	Work out which histogram bucket, of the "num_buckets" described by "t", an age
+ *	belongs in.  "num_buckets" must be t->num_buckets; it's passed separately so that
+ *	callers that know the resolution can make it a constant.
+ *
+ * This gives the same result as clamping ceil(N * log10(age)) + (NEGATIVE_ORDERS * N) to
+ * the histogram without calling log10() or ceil().  The table lookup lands within a
+ * couple of buckets of the answer, and we then step forward through t->limit[] to find
+ * it exactly.
+ *
+ * The two approaches only disagree for ages within a few ulps of a bucket boundary.
+ * There the rounding of log10() and of the multiply can push the old calculation either
+ * way, while we always put an age that is exactly equal to t->limit[b] (as computed by
+ * pow()) in bucket b.  Ages at or below the first limit go in bucket 0, as before, and
+ * ages beyond the top of the histogram now go in the last bucket rather than overrunning
+ * it.
+ */
+static inline int bucket_index(const struct bucket_tables *t, int num_buckets, double age)
+{
+	int64_t k = age_key(age) - t->lookup_base;
+	if (k < 0) {
+		return 0;
+	}
+
+	if (k >= t->lookup_size) {
+		return num_buckets - 1;
+	}
+
+	int b = t->lookup[k];
+	while (age > t->limit[b]) {
+		b++;
+	}
+
+	return b;
+}
+
+/*
+ * ddsketch_init()
+ *	Initialize an empty quantile sketch with relative accuracy "alpha".
+ */
+void ddsketch_init(struct ddsketch *s, double alpha)
+{
+	s->alpha = alpha;
+	s->gamma = (1.0 + alpha) / (1.0 - alpha);
+	s->inv_log_gamma = 1.0 / log(s->gamma);
+	s->offset = -(int)ceil(log(SKETCH_MIN_AGE) * s->inv_log_gamma);
+	s->num_bins = (int)ceil(log(SKETCH_MAX_AGE) * s->inv_log_gamma) + s->offset + 1;
+	s->count = 0;
+	s->bins = calloc(s->num_bins, sizeof(long long int));
+	if (!s->bins) {
+		sim_fail("Out of memory!");
+	}
+}
+
+/*
+ * ddsketch_destroy()
+ *	Release a quantile sketch's bins.
+ */
+void ddsketch_destroy(struct ddsketch *s)
+{
+	free(s->bins);
+	s->bins = NULL;
+}
+
+/*
+ * ddsketch_clear()
+ *	Empty a quantile sketch.
+ */
+static void ddsketch_clear(struct ddsketch *s)
+{
+	memset(s->bins, 0, s->num_bins * sizeof(long long int));
+	s->count = 0;
+}
+
+/*
+ * ddsketch_add()
+ *	Record an age in a quantile sketch.
+ */
+static inline void ddsketch_add(struct ddsketch *s, double age)
+{
+	int k = (int)ceil(log(age) * s->inv_log_gamma) + s->offset;
+	if (!(k >= 0)) {
+		k = 0;
+	} else if (k >= s->num_bins) {
+		k = s->num_bins - 1;
+	}
+
+	s->bins[k]++;
+	s->count++;
+}
+
+/*
+ * ddsketch_merge()
+ *	Add the ages recorded in sketch "src" into sketch "dest".  They must have been
+ *	created with the same accuracy.
+ */
+static void ddsketch_merge(struct ddsketch *dest, const struct ddsketch *src)
+{
+	for (int k = 0; k < dest->num_bins; k++) {
+		dest->bins[k] += src->bins[k];
+	}
+
+	dest->count += src->count;
+}
+
+/*
+ * ddsketch_quantile()
+ *	Return the estimate of quantile "q" (0 to 1) from a sketch.
+ */
+double ddsketch_quantile(const struct ddsketch *s, double q)
+{
+	if (!s->count) {
+		return NAN;
+	}
+
+	long long int rank = (long long int)(q * (double)(s->count - 1));
+	long long int cumulative = 0;
+	int k;
+	for (k = 0; k < s->num_bins - 1; k++) {
+		cumulative += s->bins[k];
+		if (cumulative > rank) {
+			break;
+		}
+	}
+
+	/*
+	 * The value within the bin with the smallest relative error either way.
+	 */
+	return 2.0 * pow(s->gamma, k - s->offset) / (s->gamma + 1.0);
+}
+
+/*
+ * histogram_moments_merge()
+ *	Combine the count, mean and M2 of one set of results ("na", "*mean", "*m2") with
+ *	those of another ("nb", "mb", "m2b"), using Chan et al.'s pairwise update.
+ */
+static inline void histogram_moments_merge(long long int na, double *mean, double *m2, long long int nb, double mb, double m2b)
+{
+	if (!nb) {
+		return;
+	}
+
+	double n = (double)(na + nb);
+	double delta = mb - *mean;
+	*mean += delta * ((double)nb / n);
+	*m2 += m2b + (delta * delta * (((double)na * (double)nb) / n));
+}
+
+/*
+ * histogram_add_ages_at()
+ *	Record the ages of "n" transactions, generated at the times in "time", that are
+ *	being confirmed in a block found at "block_time", in a histogram that uses bucket
+ *	tables "t" with "num_buckets" buckets.
+ *
+ * This is always inlined into histogram_add_ages_fine() and histogram_add_ages_coarse(),
+ * which pass the tables and their size as constants, so each resolution gets its own
+ * copy of the loop.
+ */
+static inline __attribute__((always_inline)) void histogram_add_ages_at(struct histogram *h, const struct bucket_tables *t, int num_buckets,
+									const double *time, unsigned int n, double block_time)
+{
+	if (!n) {
+		return;
+	}
+
+	int smallest = h->smallest_bucket;
+	int largest = h->largest_bucket;
+	double sum = 0.0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		double age = block_time - time[i];
+		int b = bucket_index(t, num_buckets, age);
+		h->buckets[b]++;
+		sum += age;
+
+		if (largest < b) {
+			largest = b;
+		}
+
+		if (smallest > b) {
+			smallest = b;
+		}
+	}
+
+	/*
+	 * Work out the M2 of this run of ages about its own mean, then fold that into the
+	 * totals so far.  That's as accurate as a Welford update for every age but needs no
+	 * division in the loop.
+	 */
+	double mean = sum / (double)n;
+	double m2 = 0.0;
+	for (unsigned int i = 0; i < n; i++) {
+		double d = (block_time - time[i]) - mean;
+		m2 += d * d;
+	}
+
+	histogram_moments_merge(h->num_results, &h->mean, &h->m2, n, mean, m2);
+
+	if (h->sketch) {
+		for (unsigned int i = 0; i < n; i++) {
+			ddsketch_add(h->sketch, block_time - time[i]);
+		}
+	}
+
+	h->smallest_bucket = smallest;
+	h->largest_bucket = largest;
+	h->num_results += n;
+}
+
+/*
+ * histogram_add_ages_fine()
+ *	Record ages in a fine resolution histogram.
+ */
+static void histogram_add_ages_fine(struct histogram *h, const double *time, unsigned int n, double block_time)
+{
+	histogram_add_ages_at(h, &fine_buckets, NUM_FINE_BUCKETS, time, n, block_time);
+}
+
+/*
+ * histogram_add_ages_coarse()
+ *	Record ages in a coarse resolution histogram.
+ */
+static void histogram_add_ages_coarse(struct histogram *h, const double *time, unsigned int n, double block_time)
+{
+	histogram_add_ages_at(h, &coarse_buckets, NUM_COARSE_BUCKETS, time, n, block_time);
+}
+
+/*
+ * histogram_add_ages()
+ *	Record the ages of "n" transactions, generated at the times in "time", that are
+ *	being confirmed in a block found at "block_time".
+ */
+static inline void histogram_add_ages(struct histogram *h, const double *time, unsigned int n, double block_time)
+{
+	PROFILE_BEGIN(mark);
+	if (h->tables == &coarse_buckets) {
+		histogram_add_ages_coarse(h, time, n, block_time);
+	} else {
+		histogram_add_ages_fine(h, time, n, block_time);
+	}
+
+	PROFILE_END(PROFILE_HISTOGRAM, mark);
+}
+
+/*
+ * histogram_add()
+ *	Record the age of one transaction.
+ */
+static inline void histogram_add(struct histogram *h, double age)
+{
+	PROFILE_BEGIN(mark);
+	int b = bucket_index(h->tables, h->tables->num_buckets, age);
+	h->buckets[b]++;
+
+	if (h->largest_bucket < b) {
+		h->largest_bucket = b;
+	}
+
+	if (h->smallest_bucket > b) {
+		h->smallest_bucket = b;
+	}
+
+	/*
+	 * Welford's update.
+	 */
+	h->num_results++;
+	double delta = age - h->mean;
+	h->mean += delta / (double)h->num_results;
+	h->m2 += delta * (age - h->mean);
+
+	if (h->sketch) {
+		ddsketch_add(h->sketch, age);
+	}
+
+	PROFILE_END(PROFILE_HISTOGRAM, mark);
+}
+
+/*
+ * histogram_init()
+ *	Initialize an empty histogram with the bucket layout in "tables", allocating its
+ *	buckets.  If "sketch" isn't NULL then it's cleared and fed with every result too.
+ */
+void histogram_init(struct histogram *h, const struct bucket_tables *tables, struct ddsketch *sketch)
+{
+	h->tables = tables;
+	h->buckets = calloc(tables->num_buckets, sizeof(long int));
+	if (!h->buckets) {
+		sim_fail("Out of memory!");
+	}
+
+	h->smallest_bucket = tables->num_buckets;
+	h->largest_bucket = 0;
+	h->num_results = 0LL;
+	h->mean = 0.0;
+	h->m2 = 0.0;
+	h->sketch = sketch;
+	if (sketch) {
+		ddsketch_clear(sketch);
+	}
+}
+
+/*
+ * histogram_destroy()
+ *	Release a histogram's buckets.  This is safe on a zeroed histogram, or one that's
+ *	already been destroyed, so that a histogram can be destroyed and initialized again
+ *	with a different layout.  The sketch, if any, belongs to the caller.
+ */
+void histogram_destroy(struct histogram *h)
+{
+	free(h->buckets);
+	h->buckets = NULL;
+}
+
+/*
+ * histogram_clear()
+ *	Throw away a histogram's results.  Only the buckets that have been used need to be
+ *	cleared, so this is cheap for a histogram that's seen a few simulations.
+ */
+void histogram_clear(struct histogram *h)
+{
+	if (h->smallest_bucket <= h->largest_bucket) {
+		memset(&h->buckets[h->smallest_bucket], 0, (h->largest_bucket - h->smallest_bucket + 1) * sizeof(long int));
+	}
+
+	h->smallest_bucket = h->tables->num_buckets;
+	h->largest_bucket = 0;
+	h->num_results = 0LL;
+	h->mean = 0.0;
+	h->m2 = 0.0;
+	if (h->sketch) {
+		ddsketch_clear(h->sketch);
+	}
+}
+
+/*
+ * histogram_percentile()
+ *	Estimate quantile "q" (0 to 1) of a histogram's results by interpolating linearly
+ *	within the bucket that it falls in.  Bucket b holds the ages in (bucket_limit[b - 1],
+ *	bucket_limit[b]]; we treat bucket 0 as starting at 0 and the last bucket as ending at
+ *	the top edge of the histogram.
+ */
+double histogram_percentile(const struct histogram *h, double q)
+{
+	if (!h->num_results) {
+		return NAN;
+	}
+
+	const struct bucket_tables *t = h->tables;
+	double target = q * (double)h->num_results;
+	double cumulative = 0.0;
+	for (int i = h->smallest_bucket; i <= h->largest_bucket; i++) {
+		double count = (double)h->buckets[i];
+		if (!count || ((cumulative + count) < target)) {
+			cumulative += count;
+			continue;
+		}
+
+		double lo = (i > 0) ? t->edge[i - 1] : 0.0;
+		double hi = (i < (t->num_buckets - 1)) ? t->edge[i] : t->edge[t->num_buckets];
+		return lo + ((hi - lo) * ((target - cumulative) / count));
+	}
+
+	return t->edge[h->largest_bucket];
+}
+
+/*
+ * histogram_note_bucket()
+ *	Widen the range of buckets that a histogram uses to include bucket "b".
+ */
+static inline void histogram_note_bucket(struct histogram *h, int b)
+{
+	if (h->smallest_bucket > b) {
+		h->smallest_bucket = b;
+	}
+
+	if (h->largest_bucket < b) {
+		h->largest_bucket = b;
+	}
+}
+
+/*
+ * histogram_convert()
+ *	Set histogram "dest" to the results in histogram "src" using bucket layout "tables".
+ *	"dest" must be zeroed or initialized, and is reinitialized with the new layout.
+ *
+ * Each coarse bucket covers exactly the same range of ages as a run of fine ones, so
+ * going from fine to coarse just adds their counts together.  Going the other way we
+ * can't know where in a coarse bucket its results were, so we share each coarse count
+ * out evenly over its fine buckets (giving any remainder to the lower ones).  Either way
+ * the exact mean, variance and quantile sketch carry over unchanged.
+ */
+void histogram_convert(struct histogram *dest, const struct bucket_tables *tables, const struct histogram *src)
+{
+	histogram_destroy(dest);
+	histogram_init(dest, tables, NULL);
+	dest->num_results = src->num_results;
+	dest->mean = src->mean;
+	dest->m2 = src->m2;
+	dest->sketch = src->sketch;
+
+	int src_n = src->tables->buckets_per_order;
+	int dest_n = tables->buckets_per_order;
+	for (int i = src->smallest_bucket; i <= src->largest_bucket; i++) {
+		long int count = src->buckets[i];
+		if (!count) {
+			continue;
+		}
+
+		if (src_n == dest_n) {
+			dest->buckets[i] = count;
+			histogram_note_bucket(dest, i);
+		} else if (src_n > dest_n) {
+			/*
+			 * Fine bucket i covers part of coarse bucket ceil(i / ratio).
+			 */
+			int ratio = src_n / dest_n;
+			int b = (i + ratio - 1) / ratio;
+			if (b >= tables->num_buckets) {
+				b = tables->num_buckets - 1;
+			}
+
+			dest->buckets[b] += count;
+			histogram_note_bucket(dest, b);
+		} else {
+			/*
+			 * Coarse bucket i covers fine buckets (i - 1) * ratio + 1 to i * ratio, apart
+			 * from bucket 0, which only covers fine bucket 0.
+			 */
+			int ratio = dest_n / src_n;
+			int first = (i > 0) ? (((i - 1) * ratio) + 1) : 0;
+			int num = (i > 0) ? ratio : 1;
+			for (int k = 0; k < num; k++) {
+				long int share = (count / num) + ((k < (count % num)) ? 1 : 0);
+				if (share) {
+					dest->buckets[first + k] += share;
+					histogram_note_bucket(dest, first + k);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * histogram_merge()
+ *	Add the results from histogram "src" into histogram "dest".
+ */
+void histogram_merge(struct histogram *dest, const struct histogram *src)
+{
+	histogram_moments_merge(dest->num_results, &dest->mean, &dest->m2, src->num_results, src->mean, src->m2);
+
+	if (dest->sketch && src->sketch) {
+		ddsketch_merge(dest->sketch, src->sketch);
+	}
+
+	for (int i = src->smallest_bucket; i <= src->largest_bucket; i++) {
+		dest->buckets[i] += src->buckets[i];
+	}
+
+	if (dest->smallest_bucket > src->smallest_bucket) {
+		dest->smallest_bucket = src->smallest_bucket;
+	}
+
+	if (dest->largest_bucket < src->largest_bucket) {
+		dest->largest_bucket = src->largest_bucket;
+	}
+
+	dest->num_results += src->num_results;
+}
+
+/*
+ * histogram_add_counts()
+ *	Add "num_results" results to histogram "h", given their count in each of its buckets
+ *	and their mean and M2.  This is how results that were recorded somewhere else, such
+ *	as on a GPU, get merged.  Any sketch that "h" has doesn't see them.
+ */
+void histogram_add_counts(struct histogram *h, const uint64_t *counts, long long int num_results, double mean, double m2)
+{
+	histogram_moments_merge(h->num_results, &h->mean, &h->m2, num_results, mean, m2);
+
+	for (int i = 0; i < h->tables->num_buckets; i++) {
+		if (counts[i]) {
+			h->buckets[i] += (long int)counts[i];
+			histogram_note_bucket(h, i);
+		}
+	}
+
+	h->num_results += num_results;
+}
+
+/*
+ * histogram_ks_distance()
+ *	Return the Kolmogorov-Smirnov distance between two histograms with the same bucket
+ *	layout: the largest difference between their cumulative distributions at any
+ *	bucket edge.
+ */
+double histogram_ks_distance(const struct histogram *a, const struct histogram *b)
+{
+	int first = (a->smallest_bucket < b->smallest_bucket) ? a->smallest_bucket : b->smallest_bucket;
+	int last = (a->largest_bucket > b->largest_bucket) ? a->largest_bucket : b->largest_bucket;
+	double na = (double)a->num_results;
+	double nb = (double)b->num_results;
+
+	long long int ca = 0;
+	long long int cb = 0;
+	double d = 0.0;
+	for (int i = first; i <= last; i++) {
+		ca += a->buckets[i];
+		cb += b->buckets[i];
+		double diff = fabs(((double)ca / na) - ((double)cb / nb));
+		if (d < diff) {
+			d = diff;
+		}
+	}
+
+	return d;
+}
+
+/*
+ * splitmix64()
+ *	Step a splitmix64 generator.  We only use this to expand seeds.
+ */
+uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * sim_seed()
+ *	Derive the seed for simulation "sim" from a master seed.  Each simulation gets
+ *	its own seed so results don't depend on how runs are split across threads.
+ */
+static uint64_t sim_seed(uint64_t master, uint64_t sim)
+{
+	uint64_t x = sim;
+	uint64_t h = splitmix64(&x);
+	x = master ^ h;
+	return splitmix64(&x);
+}
+
+/*
+ * rng_seed()
+ *	Seed a random number generator.
+ */
+static void rng_seed(struct rng *r, uint64_t seed)
+{
+	uint64_t x = seed;
+#ifdef BTB_RNG_PCG64
+	r->state = ((unsigned __int128)splitmix64(&x) << 64) | splitmix64(&x);
+	r->inc = (((unsigned __int128)splitmix64(&x) << 64) | splitmix64(&x)) | 1;
+#else
+	for (int i = 0; i < 4; i++) {
+		r->s[i] = splitmix64(&x);
+	}
+#endif
+}
+
+/*
+ * rng_next()
+ *	Return the next 64 random bits from a generator.
+ */
+static inline uint64_t rng_next(struct rng *r)
+{
+#ifdef BTB_RNG_PCG64
+	const unsigned __int128 mult = ((unsigned __int128)0x2360ed051fc65da4ULL << 64) | 0x4385df649fccf645ULL;
+	r->state = r->state * mult + r->inc;
+	uint64_t v = (uint64_t)(r->state >> 64) ^ (uint64_t)r->state;
+	unsigned int rot = (unsigned int)(r->state >> 122);
+	return (v >> rot) | (v << ((-rot) & 63));
+#else
+	uint64_t *s = r->s;
+	uint64_t x = s[1] * 5;
+	uint64_t res = ((x << 7) | (x >> 57)) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+
+	return res;
+#endif
+}
+
+/*
+ * rng_uniform()
+ *	Return a uniformly distributed double in the range [0, 1) with 53 bits of
+ *	resolution.
+ */
+static inline double rng_uniform(struct rng *r)
+{
+	return (double)(rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * philox4x32()
+ *	Philox4x32-10 counter-based generator: return in "out" 128 random bits for counter
+ *	"ctr" under key "key".
+ */
+static void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+	uint32_t c0 = ctr[0];
+	uint32_t c1 = ctr[1];
+	uint32_t c2 = ctr[2];
+	uint32_t c3 = ctr[3];
+	uint32_t k0 = key[0];
+	uint32_t k1 = key[1];
+
+	for (int i = 0; i < PHILOX_ROUNDS; i++) {
+		if (i) {
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+/*
+ * crn_bits()
+ *	Return 128 bits of common random numbers, as two 64-bit words, for block "block" of
+ *	the current simulation in stream "stream".
+ */
+static void crn_bits(const struct sim_context *ctx, uint32_t block, uint32_t stream, uint64_t bits[2])
+{
+	uint32_t ctr[4] = {ctx->crn_sim, block, stream, 0};
+	uint32_t out[4];
+	philox4x32(ctr, ctx->crn_key, out);
+	bits[0] = ((uint64_t)out[1] << 32) | out[0];
+	bits[1] = ((uint64_t)out[3] << 32) | out[2];
+}
+
+/*
+ * fdlibm_log()
+ *	Return the natural log of "x", which must be a positive normal number.
+ *
+ * This is a branch-free form of the fdlibm log() (accurate to within 1 ulp) so that the
+ * compiler can vectorize loops that use it.  It's always inlined so that each of the
+ * target clones of those loops gets its own copy.
+ */
+static inline __attribute__((always_inline)) double fdlibm_log(double x)
+{
+	const double ln2_hi = 6.93147180369123816490e-01;
+	const double ln2_lo = 1.90821492927058770002e-10;
+	const double lg1 = 6.666666666666735130e-01;
+	const double lg2 = 3.999999999940941908e-01;
+	const double lg3 = 2.857142874366239149e-01;
+	const double lg4 = 2.222219843214978396e-01;
+	const double lg5 = 1.818357216161805012e-01;
+	const double lg6 = 1.531383769920937332e-01;
+	const double lg7 = 1.479819860511658591e-01;
+
+	/*
+	 * Bit patterns for sqrt(2)/2 and 1.5 * 2^52.  Adding a small integer to the last
+	 * gives a double that converts the integer without a cvt instruction (AVX2 has no
+	 * 64-bit integer to double conversion).
+	 */
+	const int64_t sqrt_half = 0x3fe6a09e667f3bcdLL;
+	const int64_t magic = 0x4338000000000000LL;
+	const double magic_d = 6755399441055744.0;
+
+	/*
+	 * Split x into 2^k * m with m in [sqrt(2)/2, sqrt(2)).
+	 */
+	int64_t ix;
+	memcpy(&ix, &x, sizeof(ix));
+	int64_t adj = ix - sqrt_half;
+	int64_t k = adj >> 52;
+	int64_t im = (adj & 0x000fffffffffffffLL) + sqrt_half;
+	double m;
+	memcpy(&m, &im, sizeof(m));
+	int64_t kbits = k + magic;
+	double dk;
+	memcpy(&dk, &kbits, sizeof(dk));
+	dk -= magic_d;
+
+	double f = m - 1.0;
+	double hfsq = 0.5 * f * f;
+	double s = f / (2.0 + f);
+	double z = s * s;
+	double w = z * z;
+	double t1 = w * (lg2 + w * (lg4 + w * lg6));
+	double t2 = z * (lg1 + w * (lg3 + w * (lg5 + w * lg7)));
+	double r = t2 + t1;
+
+	return dk * ln2_hi - ((hfsq - (s * (hfsq + r) + dk * ln2_lo)) - f);
+}
+
+/*
+ * exp_fill()
+ *	Convert "n" sets of 52 random bits into standard exponential variates, -log(1 - u).
+ *	We build clones for AVX-512 and AVX2 and pick the best one for the machine at load
+ *	time.
+ */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void exp_fill(double *out, const uint64_t *bits, int n)
+{
+	const int64_t one = 0x3ff0000000000000LL;
+
+#pragma omp simd
+	for (int i = 0; i < n; i++) {
+		/*
+		 * Put 52 random bits into the mantissa of a double in [1, 2) and form 1 - u from
+		 * that.  It's exact and lies in (0, 1], so the log is always finite.
+		 */
+		int64_t iu = (int64_t)(bits[i] >> 12) | one;
+		double u1;
+		memcpy(&u1, &iu, sizeof(u1));
+		out[i] = -fdlibm_log(2.0 - u1);
+	}
+}
+
+/*
+ * log_fill()
+ *	Replace each of the "n" values in "x", all of which must be positive and normal, with
+ *	its natural log.
+ */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void log_fill(double *x, int n)
+{
+#pragma omp simd
+	for (int i = 0; i < n; i++) {
+		x[i] = fdlibm_log(x[i]);
+	}
+}
+
+/*
+ * sim_exp_refill()
+ *	Generate a new batch of standard exponential variates.
+ */
+static void sim_exp_refill(struct sim_context *ctx)
+{
+	PROFILE_BEGIN(mark);
+	uint64_t bits[EXP_BATCH] __attribute__((aligned(64)));
+	for (int i = 0; i < EXP_BATCH; i++) {
+		bits[i] = rng_next(&ctx->rng);
+	}
+
+	exp_fill(ctx->exp_buf, bits, EXP_BATCH);
+	ctx->exp_next = 0;
+	PROFILE_END(PROFILE_RNG, mark);
+}
+
+/*
+ * sim_seed_context()
+ *	Seed a context's random number generator and discard any pre-generated variates.
+ */
+static void sim_seed_context(struct sim_context *ctx, uint64_t seed)
+{
+	rng_seed(&ctx->rng, seed);
+	ctx->exp_next = EXP_BATCH;
+}
+
+/*
+ * sim_exp()
+ *	Return a standard exponential variate.
+ */
+static inline double sim_exp(struct sim_context *ctx)
+{
+	if (ctx->exp_next == EXP_BATCH) {
+		sim_exp_refill(ctx);
+	}
+
+	return ctx->exp_buf[ctx->exp_next++];
+}
+
+/*
+ * sim_pp()
+ *	Simulate one time period of a Poisson process.
+ */
+static inline double sim_pp(struct sim_context *ctx, double rate)
+{
+	return sim_exp(ctx) / rate;
+}
+
+/*
+ * sim_poisson()
+ *	Return a Poisson variate with mean "mu".  Small means use Knuth's multiplication
+ *	method and larger ones use Hoermann's transformed rejection (PTRS), which takes a
+ *	couple of uniforms however large the mean is.
+ */
+static unsigned int sim_poisson(struct sim_context *ctx, double mu)
+{
+	if (mu < POISSON_PTRS_MIN_MEAN) {
+		double limit = exp(-mu);
+		double p = rng_uniform(&ctx->rng);
+		unsigned int k = 0;
+		while (p > limit) {
+			p *= rng_uniform(&ctx->rng);
+			k++;
+		}
+
+		return k;
+	}
+
+	double smu = sqrt(mu);
+	double log_mu = log(mu);
+	double b = 0.931 + 2.53 * smu;
+	double a = -0.059 + 0.02483 * b;
+	double log_inv_alpha = log(1.1239 + 1.1328 / (b - 3.4));
+	double vr = 0.9277 - 3.6224 / (b - 2.0);
+
+	while (1) {
+		double u = rng_uniform(&ctx->rng) - 0.5;
+		double v = rng_uniform(&ctx->rng);
+		double us = 0.5 - fabs(u);
+		double k = floor((2.0 * a / us + b) * u + mu + 0.43);
+		if ((us >= 0.07) && (v <= vr)) {
+			return (unsigned int)k;
+		}
+
+		if ((k < 0.0) || ((us < 0.013) && (v > us))) {
+			continue;
+		}
+
+		int sign;
+		if ((log(v) + log_inv_alpha - log(a / (us * us) + b)) <= (-mu + k * log_mu - lgamma_r(k + 1.0, &sign))) {
+			return (unsigned int)k;
+		}
+	}
+}
+
+/*
+ * sim_size()
+ *	Return the size of a new transaction.
+ */
+static inline int sim_size(struct sim_context *ctx)
+{
+	const struct size_table *st = ctx->sizes;
+	if (!st) {
+		return TRANSACTION_SIZE;
+	}
+
+	/*
+	 * The top 32 bits pick an entry and the bottom 32 decide between it and its alias.
+	 */
+	uint64_t bits = rng_next(&ctx->rng);
+	uint32_t i = (uint32_t)(((bits >> 32) * st->num_entries) >> 32);
+	const struct size_alias_entry *e = &st->entries[i];
+	return (int)(((uint32_t)bits < e->threshold) ? e->size : e->alias_size);
+}
+
+/*
+ * chunk_pool_init()
+ *	Initialize an empty chunk pool.
+ */
+static void chunk_pool_init(struct chunk_pool *p)
+{
+	memset(p, 0, sizeof(struct chunk_pool));
+}
+
+/*
+ * chunk_pool_destroy()
+ *	Return all of a chunk pool's slabs to the heap.
+ */
+static void chunk_pool_destroy(struct chunk_pool *p)
+{
+	struct chunk_slab *s = p->slabs;
+	while (s) {
+		struct chunk_slab *next = s->next;
+		free(s);
+		s = next;
+	}
+
+	p->slabs = NULL;
+	p->free_list = NULL;
+	p->num_slabs = 0;
+	p->chunks_in_use = 0;
+}
+
+/*
+ * chunk_pool_reset()
+ *	Return every chunk to the free list in one go.  Any queue using the pool must be
+ *	reset too.
+ */
+static void chunk_pool_reset(struct chunk_pool *p)
+{
+	struct pending_chunk *free_list = NULL;
+	for (struct chunk_slab *s = p->slabs; s; s = s->next) {
+		for (int i = 0; i < POOL_SLAB_CHUNKS; i++) {
+			s->chunks[i].next = free_list;
+			free_list = &s->chunks[i];
+		}
+	}
+
+	p->free_list = free_list;
+	p->chunks_in_use = 0;
+}
+
+/*
+ * chunk_pool_alloc()
+ *	Allocate a chunk from a pool.
+ */
+static struct pending_chunk *chunk_pool_alloc(struct chunk_pool *p)
+{
+	PROFILE_BEGIN(mark);
+	struct pending_chunk *c = p->free_list;
+	if (c) {
+		p->free_list = c->next;
+		p->hits++;
+	} else {
+		struct chunk_slab *s = malloc(sizeof(struct chunk_slab));
+		if (!s) {
+			sim_fail("Out of memory!");
+		}
+
+		s->next = p->slabs;
+		p->slabs = s;
+		p->num_slabs++;
+		p->misses++;
+
+		/*
+		 * Keep the first chunk of the new slab and put the rest on the free list.
+		 */
+		for (int i = POOL_SLAB_CHUNKS - 1; i > 0; i--) {
+			s->chunks[i].next = p->free_list;
+			p->free_list = &s->chunks[i];
+		}
+
+		c = &s->chunks[0];
+	}
+
+	c->next = NULL;
+
+	p->chunks_in_use++;
+	if (p->peak_chunks_in_use < p->chunks_in_use) {
+		p->peak_chunks_in_use = p->chunks_in_use;
+	}
+
+	PROFILE_END(PROFILE_ALLOC, mark);
+	return c;
+}
+
+/*
+ * chunk_pool_free()
+ *	Return a chunk to a pool.
+ */
+static inline void chunk_pool_free(struct chunk_pool *p, struct pending_chunk *c)
+{
+	c->next = p->free_list;
+	p->free_list = c;
+	p->chunks_in_use--;
+}
+
+/*
+ * chunk_pool_bytes()
+ *	Return the number of bytes of heap memory held by a pool.
+ */
+static size_t chunk_pool_bytes(const struct chunk_pool *p)
+{
+	return (size_t)p->num_slabs * sizeof(struct chunk_slab);
+}
+
+/*
+ * pending_queue_init()
+ *	Initialize an empty pending transaction queue that takes its chunks from pool "p".
+ *	If every transaction will be "fixed_size" bytes then say so, otherwise pass 0.
+ */
+static void pending_queue_init(struct pending_queue *q, struct chunk_pool *p, int fixed_size)
+{
+	q->pool = p;
+	q->head_chunk = NULL;
+	q->tail_chunk = NULL;
+	q->head = 0;
+	q->tail = 0;
+	q->count = 0;
+	q->fixed_size = fixed_size;
+	q->bytes_pushed = 0;
+	q->bytes_popped = 0;
+}
+
+/*
+ * pending_queue_push()
+ *	Add a transaction to the tail of a pending transaction queue.
+ */
+static inline void pending_queue_push(struct pending_queue *q, double time, int size)
+{
+	if (!q->tail_chunk || (q->tail == PENDING_CHUNK_ENTRIES)) {
+		struct pending_chunk *c = chunk_pool_alloc(q->pool);
+		if (q->tail_chunk) {
+			q->tail_chunk->next = c;
+		} else {
+			q->head_chunk = c;
+			q->head = 0;
+		}
+
+		q->tail_chunk = c;
+		q->tail = 0;
+	}
+
+	q->bytes_pushed += size;
+
+	struct pending_chunk *c = q->tail_chunk;
+	c->time[q->tail] = time;
+	c->end[q->tail] = q->bytes_pushed;
+	q->tail++;
+	q->count++;
+}
+
+/*
+ * pending_queue_fit()
+ *	Work out how many transactions from the head of a pending transaction queue fit,
+ *	in order, into "space" bytes.
+ */
+static unsigned int pending_queue_fit(const struct pending_queue *q, long long int space)
+{
+	if (!q->count) {
+		return 0;
+	}
+
+	/*
+	 * If all of the transactions are the same size then the answer is simple.
+	 */
+	if (q->fixed_size) {
+		long long int n = space / q->fixed_size;
+		return (n < q->count) ? (unsigned int)n : q->count;
+	}
+
+	/*
+	 * Otherwise find the last transaction that ends within "space" bytes of the head.
+	 * Whole chunks are skipped by looking at their last entry, and then we binary search
+	 * the chunk that holds the cut point.
+	 */
+	long long int limit = q->bytes_popped + space;
+	unsigned int n = 0;
+	unsigned int first = q->head;
+	for (struct pending_chunk *c = q->head_chunk; c; c = c->next) {
+		unsigned int last = (c == q->tail_chunk) ? q->tail : PENDING_CHUNK_ENTRIES;
+		if (c->end[last - 1] <= limit) {
+			n += last - first;
+			first = 0;
+			continue;
+		}
+
+		unsigned int lo = first;
+		unsigned int hi = last - 1;
+		while (lo < hi) {
+			unsigned int mid = lo + (hi - lo) / 2;
+			if (c->end[mid] <= limit) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		n += lo - first;
+		break;
+	}
+
+	return n;
+}
+
+/*
+ * pending_queue_drain()
+ *	Remove "n" transactions from the head of a pending transaction queue, recording
+ *	their ages, as of "block_time", in histogram "h".
+ */
+static void pending_queue_drain(struct pending_queue *q, unsigned int n, struct histogram *h, double block_time)
+{
+	while (n) {
+		struct pending_chunk *c = q->head_chunk;
+		unsigned int last = (c == q->tail_chunk) ? q->tail : PENDING_CHUNK_ENTRIES;
+		unsigned int k = last - q->head;
+		if (k > n) {
+			k = n;
+		}
+
+		histogram_add_ages(h, &c->time[q->head], k, block_time);
+		q->bytes_popped = c->end[q->head + k - 1];
+		q->head += k;
+		q->count -= k;
+		n -= k;
+
+		/*
+		 * Once we've drained a chunk we can hand it straight back to the pool.
+		 */
+		if (q->head == PENDING_CHUNK_ENTRIES) {
+			q->head_chunk = c->next;
+			q->head = 0;
+			if (!q->head_chunk) {
+				q->tail_chunk = NULL;
+			}
+
+			chunk_pool_free(q->pool, c);
+		}
+	}
+}
+
+/*
+ * fee_heap_alloc()
+ *	Allocate storage for "capacity" entries in a fee-ordered mempool.
+ */
+static struct fee_entry *fee_heap_alloc(unsigned int capacity)
+{
+	void *alloc;
+	if (posix_memalign(&alloc, 64, (capacity + 4) * sizeof(struct fee_entry))) {
+		sim_fail("Out of memory!");
+	}
+
+	return alloc;
+}
+
+/*
+ * fee_heap_init()
+ *	Initialize an empty fee-ordered mempool.
+ */
+static void fee_heap_init(struct fee_heap *q)
+{
+	q->alloc = fee_heap_alloc(FEE_HEAP_INITIAL_CAPACITY);
+	q->e = q->alloc + 3;
+	q->count = 0;
+	q->capacity = FEE_HEAP_INITIAL_CAPACITY;
+}
+
+/*
+ * fee_heap_destroy()
+ *	Release the storage used by a fee-ordered mempool.
+ */
+static void fee_heap_destroy(struct fee_heap *q)
+{
+	free(q->alloc);
+	q->alloc = NULL;
+	q->e = NULL;
+	q->count = 0;
+	q->capacity = 0;
+}
+
+/*
+ * fee_heap_bytes()
+ *	Return the number of bytes of heap memory held by a fee-ordered mempool.
+ */
+static size_t fee_heap_bytes(const struct fee_heap *q)
+{
+	return q->alloc ? (size_t)(q->capacity + 4) * sizeof(struct fee_entry) : 0;
+}
+
+/*
+ * lazy_backlog_init()
+ *	Initialize an empty lazy backlog.
+ */
+static void lazy_backlog_init(struct lazy_backlog *b)
+{
+	b->segs = (struct backlog_segment *)malloc(LAZY_BACKLOG_INITIAL_CAPACITY * sizeof(struct backlog_segment));
+	if (!b->segs) {
+		sim_fail("Out of memory!");
+	}
+
+	b->head = 0;
+	b->tail = 0;
+	b->capacity = LAZY_BACKLOG_INITIAL_CAPACITY;
+	b->count = 0;
+}
+
+/*
+ * lazy_backlog_destroy()
+ *	Release the storage used by a lazy backlog.
+ */
+static void lazy_backlog_destroy(struct lazy_backlog *b)
+{
+	free(b->segs);
+	b->segs = NULL;
+	b->head = 0;
+	b->tail = 0;
+	b->capacity = 0;
+	b->count = 0;
+}
+
+/*
+ * lazy_backlog_bytes()
+ *	Return the number of bytes of heap memory held by a lazy backlog.
+ */
+static size_t lazy_backlog_bytes(const struct lazy_backlog *b)
+{
+	return (size_t)b->capacity * sizeof(struct backlog_segment);
+}
+
+/*
+ * lazy_backlog_push()
+ *	Add "count" transactions that arrived in the interval ("start", "end"] to the back of
+ *	a lazy backlog.
+ */
+static void lazy_backlog_push(struct lazy_backlog *b, double start, double end, unsigned int count)
+{
+	if (b->tail == b->capacity) {
+		PROFILE_BEGIN(mark);
+
+		/*
+		 * Slide the live segments back to the start of the array if that frees up a
+		 * good amount of room, otherwise grow it.
+		 */
+		unsigned int live = b->tail - b->head;
+		if (b->head >= (b->capacity / 2)) {
+			memmove(b->segs, &b->segs[b->head], live * sizeof(struct backlog_segment));
+		} else {
+			unsigned int capacity = b->capacity * 2;
+			struct backlog_segment *segs = (struct backlog_segment *)malloc(capacity * sizeof(struct backlog_segment));
+			if (!segs) {
+				sim_fail("Out of memory!");
+			}
+
+			memcpy(segs, &b->segs[b->head], live * sizeof(struct backlog_segment));
+			free(b->segs);
+			b->segs = segs;
+			b->capacity = capacity;
+		}
+
+		b->head = 0;
+		b->tail = live;
+		PROFILE_END(PROFILE_ALLOC, mark);
+	}
+
+	struct backlog_segment *s = &b->segs[b->tail++];
+	s->start = start;
+	s->end = end;
+	s->count = count;
+	b->count += count;
+}
+
+/*
+ * fee_entry_before()
+ *	Return true if entry "a" should be confirmed before entry "b".
+ */
+static inline bool fee_entry_before(const struct fee_entry *a, const struct fee_entry *b)
+{
+	return (a->fee_rate > b->fee_rate) | ((a->fee_rate == b->fee_rate) & (a->time < b->time));
+}
+
+/*
+ * fee_heap_push()
+ *	Add a transaction to a fee-ordered mempool.
+ */
+static void fee_heap_push(struct fee_heap *q, double time, float fee_rate, int size)
+{
+	if (q->count == q->capacity) {
+		if (q->capacity > (UINT32_MAX / 2) - 4) {
+			sim_fail("Too many pending transactions!");
+		}
+
+		PROFILE_BEGIN(mark);
+		unsigned int capacity = q->capacity * 2;
+		struct fee_entry *alloc = fee_heap_alloc(capacity);
+		memcpy(alloc + 3, q->e, q->count * sizeof(struct fee_entry));
+		free(q->alloc);
+		q->alloc = alloc;
+		q->e = alloc + 3;
+		q->capacity = capacity;
+		PROFILE_END(PROFILE_ALLOC, mark);
+	}
+
+	struct fee_entry n = {time, fee_rate, size};
+
+	/*
+	 * Sift the new entry up from the bottom of the heap.
+	 */
+	unsigned int i = q->count++;
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 4;
+		if (!fee_entry_before(&n, &q->e[parent])) {
+			break;
+		}
+
+		q->e[i] = q->e[parent];
+		i = parent;
+	}
+
+	q->e[i] = n;
+}
+
+/*
+ * fee_heap_pop()
+ *	Remove the highest priority transaction from a fee-ordered mempool.
+ */
+static void fee_heap_pop(struct fee_heap *q)
+{
+	unsigned int count = --q->count;
+	if (!count) {
+		return;
+	}
+
+	/*
+	 * The last entry almost always belongs near the bottom of the heap, so rather than
+	 * sifting it down from the top we move the hole at the top all the way down to a leaf,
+	 * promoting the best child each time, and then sift the last entry up from there.
+	 * That saves a comparison at every level.
+	 */
+	struct fee_entry *e = q->e;
+	struct fee_entry n = e[count];
+	unsigned int i = 0;
+	while (1) {
+		unsigned int first = (4 * i) + 1;
+		if (first >= count) {
+			break;
+		}
+
+		unsigned int best = first;
+		if ((first + 4) <= count) {
+			unsigned int a = first + fee_entry_before(&e[first + 1], &e[first]);
+			unsigned int b = first + 2 + fee_entry_before(&e[first + 3], &e[first + 2]);
+			best = fee_entry_before(&e[b], &e[a]) ? b : a;
+		} else {
+			for (unsigned int c = first + 1; c < count; c++) {
+				if (fee_entry_before(&e[c], &e[best])) {
+					best = c;
+				}
+			}
+		}
+
+		e[i] = e[best];
+		i = best;
+	}
+
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 4;
+		if (!fee_entry_before(&n, &e[parent])) {
+			break;
+		}
+
+		e[i] = e[parent];
+		i = parent;
+	}
+
+	e[i] = n;
+}
+
+/*
+ * fee_heap_drain()
+ *	Take the highest priority transactions that fit, in order, into "space" bytes,
+ *	recording their ages, as of "block_time", in histogram "h".  Returns the number of
+ *	transactions taken.
+ */
+static unsigned int fee_heap_drain(struct fee_heap *q, long long int space, struct histogram *h, double block_time)
+{
+	unsigned int n = 0;
+	while (q->count && (q->e[0].size <= space)) {
+		space -= q->e[0].size;
+		histogram_add(h, block_time - q->e[0].time);
+		fee_heap_pop(q);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * sim_pending_count()
+ *	Return the number of pending transactions in a lane.
+ */
+static inline unsigned int sim_pending_count(const struct sim_context *ctx, const struct sim_lane *lane)
+{
+	switch (ctx->discipline) {
+	case QUEUE_FEE:
+		return lane->fee_queue.count;
+
+	case QUEUE_LAZY:
+		return lane->backlog.count;
+
+	default:
+		return lane->pending.count;
+	}
+}
+
+/*
+ * sim_profile_time()
+ *	Return the real time at which an arrival at operational time "op" happens.  Arrivals
+ *	only ever move forwards, so we move the context's cursor along the profile rather
+ *	than searching it.  Segments with a rate of zero take no operational time and are
+ *	stepped straight over.
+ */
+static inline double sim_profile_time(struct sim_context *ctx, double op)
+{
+	const struct rate_profile *rp = ctx->profile;
+	const struct rate_segment *s = &rp->segs[ctx->profile_seg];
+	double u = op - ctx->profile_base;
+	while (u >= s->op_end) {
+		if (++ctx->profile_seg == rp->num_segs) {
+			ctx->profile_seg = 0;
+			ctx->profile_base += rp->period;
+			u = op - ctx->profile_base;
+		}
+
+		s = &rp->segs[ctx->profile_seg];
+	}
+
+	return ctx->profile_base + s->start + ((u - s->op_start) * s->inv_rate);
+}
+
+/*
+ * sim_arrivals_reset()
+ *	Put the first transaction arrival of a new simulation at the start of time, or the
+ *	first moment after it that the arrival rate profile isn't zero.
+ */
+void sim_arrivals_reset(struct sim_context *ctx)
+{
+	ctx->next_transaction_secs = 0.0;
+	ctx->next_transaction_op = 0.0;
+	ctx->profile_seg = 0;
+	ctx->profile_base = 0.0;
+	if (ctx->profile) {
+		ctx->next_transaction_secs = sim_profile_time(ctx, 0.0);
+	}
+}
+
+/*
+ * sim_transactions()
+ *	Simulate the number of transactions arriving in "block_duration" seconds.  Every
+ *	lane gets a copy of each one.
+ */
+static int sim_transactions(struct sim_context *ctx, double block_end_secs, double tps)
+{
+	/*
+	 * With a lazy backlog we only need to know how many transactions arrived, and not when.
+	 */
+	if (ctx->discipline == QUEUE_LAZY) {
+		double start = ctx->next_transaction_secs;
+		unsigned int n = sim_poisson(ctx, tps * (block_end_secs - start));
+		if (n) {
+			for (int l = 0; l < ctx->num_lanes; l++) {
+				lazy_backlog_push(&ctx->lanes[l].backlog, start, block_end_secs, n);
+			}
+		}
+
+		ctx->next_transaction_secs = block_end_secs;
+		return (int)n;
+	}
+
+	int transactions = 0;
+
+	while (1) {
+		/*
+		 * Given a start time and a block duration see if the next transaction actually fits into
+		 * that window.  If it doesn't then there are no new transactions.
+		 */
+		if (block_end_secs < ctx->next_transaction_secs) {
+			return transactions;
+		}
+
+		/*
+		 * Create the details of our new transaction and record them in our pending transaction queue.
+		 */
+		int size = sim_size(ctx);
+		if (ctx->discipline == QUEUE_FEE) {
+			double fee = MEAN_FEE * sim_exp(ctx);
+			for (int l = 0; l < ctx->num_lanes; l++) {
+				fee_heap_push(&ctx->lanes[l].fee_queue, ctx->next_transaction_secs, (float)(fee / size), size);
+			}
+		} else {
+			for (int l = 0; l < ctx->num_lanes; l++) {
+				pending_queue_push(&ctx->lanes[l].pending, ctx->next_transaction_secs, size);
+			}
+		}
+
+		transactions++;
+
+		/*
+		 * Work out when the next transaction arrival is.  With a rate profile we step
+		 * along in operational time and then map that back to real time.
+		 */
+		double transaction_arrival = sim_pp(ctx, tps);
+		if (ctx->profile) {
+			ctx->next_transaction_op += transaction_arrival;
+			ctx->next_transaction_secs = sim_profile_time(ctx, ctx->next_transaction_op);
+		} else {
+			ctx->next_transaction_secs += transaction_arrival;
+		}
+	}
+}
+
+/*
+ * one_minus_exp()
+ *	Return 1 - exp(-x) for x >= 0.  When draining a big segment "x" is nearly always
+ *	small, and then a Taylor series to x^8 gets the same answer to within 1 ulp for a
+ *	fraction of the cost of expm1().
+ */
+static inline double one_minus_exp(double x)
+{
+	if (x >= 0x1.0p-6) {
+		return -expm1(-x);
+	}
+
+	double p = 1.0 / 40320.0;
+	p = 1.0 / 5040.0 - x * p;
+	p = 1.0 / 720.0 - x * p;
+	p = 1.0 / 120.0 - x * p;
+	p = 1.0 / 24.0 - x * p;
+	p = 1.0 / 6.0 - x * p;
+	p = 0.5 - x * p;
+	p = 1.0 - x * p;
+	return x * p;
+}
+
+/*
+ * lazy_backlog_drain()
+ *	Take the oldest "n" transactions from a lane's lazy backlog, recording their ages, as
+ *	of "block_time", in the lane's histogram.
+ *
+ * We make up the arrival times as we go.  The first of the "k" transactions left in a
+ * segment arrives at the minimum of "k" uniform times in the segment, which we can get
+ * from one exponential variate, and the rest are still uniformly distributed over what
+ * is left of the segment.  When we don't take all of a segment we move its start up to
+ * the last arrival that we took.
+ */
+static void lazy_backlog_drain(struct sim_context *ctx, struct sim_lane *lane, unsigned int n, double block_time)
+{
+	struct lazy_backlog *b = &lane->backlog;
+	double time[LAZY_BATCH];
+
+	b->count -= n;
+	while (n) {
+		struct backlog_segment *s = &b->segs[b->head];
+		unsigned int k = (s->count < n) ? s->count : n;
+		if (k > LAZY_BATCH) {
+			k = LAZY_BATCH;
+		}
+
+		double t = s->start;
+		for (unsigned int i = 0; i < k; i++) {
+			t += (s->end - t) * one_minus_exp(sim_exp(ctx) / (double)(s->count - i));
+			time[i] = t;
+		}
+
+		histogram_add_ages(&lane->hist, time, k, block_time);
+		s->start = t;
+		s->count -= k;
+		n -= k;
+
+		if (!s->count) {
+			b->head++;
+		}
+	}
+
+	if (b->head == b->tail) {
+		b->head = 0;
+		b->tail = 0;
+	}
+}
+
+/*
+ * create_block()
+ *	Take as many of a lane's pending transactions as will fit and simulate a block.
+ */
+static int create_block(struct sim_context *ctx, struct sim_lane *lane, double block_found_time)
+{
+	/*
+	 * We take transactions strictly in priority order and stop at the first one that won't
+	 * fit.  This isn't actually correct but it's a good approximation :-)
+	 */
+	if (ctx->discipline == QUEUE_FEE) {
+		return (int)fee_heap_drain(&lane->fee_queue, lane->block_size, &lane->hist, block_found_time);
+	}
+
+	if (ctx->discipline == QUEUE_LAZY) {
+		long long int fit = lane->block_size / TRANSACTION_SIZE;
+		unsigned int transactions = (fit < lane->backlog.count) ? (unsigned int)fit : lane->backlog.count;
+		lazy_backlog_drain(ctx, lane, transactions, block_found_time);
+		return (int)transactions;
+	}
+
+	struct pending_queue *q = &lane->pending;
+	unsigned int transactions = pending_queue_fit(q, lane->block_size);
+	pending_queue_drain(q, transactions, &lane->hist, block_found_time);
+
+	return (int)transactions;
+}
+
+/*
+ * now_ns()
+ *	Return the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * block_ring_push()
+ *	Add a record to a block statistics ring.  If the ring is full we wait for the writer
+ *	to make some room; we never drop a record.
+ */
+static void block_ring_push(struct block_ring *br, const struct block_record *rec)
+{
+	uint64_t head = br->head;
+	if ((head - br->cached_tail) == BLOCK_RING_ENTRIES) {
+		while (1) {
+			br->cached_tail = __atomic_load_n(&br->tail, __ATOMIC_ACQUIRE);
+			if ((head - br->cached_tail) != BLOCK_RING_ENTRIES) {
+				break;
+			}
+
+			sched_yield();
+		}
+	}
+
+	br->records[head & (BLOCK_RING_ENTRIES - 1)] = *rec;
+	__atomic_store_n(&br->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * sim_oldest_age()
+ *	Return the age, at "now", of the oldest pending transaction in a lane.  The
+ *	fee-ordered queue and the lazy backlog don't keep track of this so they give NaN, and
+ *	so does an empty queue.
+ */
+static double sim_oldest_age(const struct sim_context *ctx, const struct sim_lane *lane, double now)
+{
+	const struct pending_queue *q = &lane->pending;
+	if ((ctx->discipline != QUEUE_FIFO) || !q->count) {
+		return NAN;
+	}
+
+	return now - q->head_chunk->time[q->head];
+}
+
+/*
+ * block_schedule_fill()
+ *	Work out the time at which each of "num_blocks" blocks is found, for the simulation
+ *	with seed "seed".
+ *
+ * The hash rate grows as exp(g * t) and the difficulty starts out matching it.  With the
+ * difficulty fixed at D, the expected number of blocks found by time t since the start
+ * of a retarget period at t0 is (exp(g * t) - exp(g * t0)) / (g * D * TARGET_BLOCK_INTERVAL),
+ * so block i of the period is found at t0 + log(1 + c * S_i) / g, where S_i is the sum
+ * of the first i + 1 standard exponential variates and c = g * D * TARGET_BLOCK_INTERVAL
+ * * exp(-g * t0).  That turns each period into a prefix sum between two vectorized
+ * passes.
+ */
+static void block_schedule_fill(struct block_schedule *bs, uint64_t seed, int num_blocks)
+{
+	if (bs->capacity < num_blocks) {
+		free(bs->time);
+		bs->capacity = 0;
+		bs->time = (double *)malloc((size_t)num_blocks * sizeof(double));
+		if (!bs->time) {
+			sim_fail("Out of memory!");
+		}
+
+		bs->capacity = num_blocks;
+	}
+
+	struct rng rng;
+	rng_seed(&rng, seed ^ BLOCK_SCHEDULE_SEED_KEY);
+
+	uint64_t bits[RETARGET_INTERVAL] __attribute__((aligned(64)));
+	double g = bs->growth;
+	double difficulty = 1.0;
+	double period_start = 0.0;
+
+	for (int first = 0; first < num_blocks; first += RETARGET_INTERVAL) {
+		int n = num_blocks - first;
+		if (n > RETARGET_INTERVAL) {
+			n = RETARGET_INTERVAL;
+		}
+
+		for (int i = 0; i < n; i++) {
+			bits[i] = rng_next(&rng);
+		}
+
+		double *t = &bs->time[first];
+		exp_fill(t, bits, n);
+
+		if (g == 0.0) {
+			double mean = difficulty * TARGET_BLOCK_INTERVAL;
+			double sum = 0.0;
+			for (int i = 0; i < n; i++) {
+				sum += t[i];
+				t[i] = period_start + (mean * sum);
+			}
+		} else {
+			double c = g * difficulty * TARGET_BLOCK_INTERVAL * exp(-g * period_start);
+			double sum = 0.0;
+			for (int i = 0; i < n; i++) {
+				sum += t[i];
+				t[i] = 1.0 + (c * sum);
+			}
+
+			log_fill(t, n);
+
+			double inv_g = 1.0 / g;
+#pragma omp simd
+			for (int i = 0; i < n; i++) {
+				t[i] = period_start + (t[i] * inv_g);
+			}
+		}
+
+		/*
+		 * Retarget the difficulty at the end of each full period.
+		 */
+		double period_end = t[n - 1];
+		if (n == RETARGET_INTERVAL) {
+			double adjust = RETARGET_TIMESPAN / (period_end - period_start);
+			if (adjust > RETARGET_MAX_ADJUST) {
+				adjust = RETARGET_MAX_ADJUST;
+			} else if (adjust < (1.0 / RETARGET_MAX_ADJUST)) {
+				adjust = 1.0 / RETARGET_MAX_ADJUST;
+			}
+
+			difficulty *= adjust;
+		}
+
+		period_start = period_end;
+	}
+}
+
+/*
+ * mine()
+ *	Simulate a set of blocks being mined.  Block statistics, and the count of
+ *	transactions handled, are for the first lane.
+ */
+static void mine(struct sim_context *ctx, double tps, int num_blocks, double *cumulative_time, int *transactions_handled)
+{
+	int cumulative_transactions = 0;
+	int cumulative_transactions_handled = 0;
+	for (int i = 0; i < num_blocks; i++) {
+		/*
+		 * With common random numbers each block starts new streams for its interval and
+		 * its arrivals.  Interarrival times are memoryless so we can throw away the next
+		 * arrival that we'd already drawn and draw it again from the start of the block.
+		 */
+		double crn_interval = 0.0;
+		if (ctx->crn) {
+			uint64_t bits[2];
+			crn_bits(ctx, (uint32_t)i, CRN_STREAM_BLOCK, bits);
+			crn_interval = -log1p(-((double)(bits[0] >> 11) * 0x1.0p-53));
+			sim_seed_context(ctx, bits[1]);
+			if (ctx->discipline != QUEUE_LAZY) {
+				ctx->next_transaction_secs = *cumulative_time + sim_pp(ctx, tps);
+			}
+		}
+
+		/*
+		 * Find the next block.
+		 */
+		double block_duration;
+		if (ctx->schedule.enabled) {
+			block_duration = ctx->schedule.time[i] - *cumulative_time;
+			*cumulative_time = ctx->schedule.time[i];
+		} else if (ctx->crn) {
+			block_duration = crn_interval * TARGET_BLOCK_INTERVAL;
+			*cumulative_time += block_duration;
+		} else {
+			PROFILE_BEGIN(interval_mark);
+			block_duration = sim_pp(ctx, 1.0 / TARGET_BLOCK_INTERVAL);
+			PROFILE_END(PROFILE_BLOCK_INTERVAL, interval_mark);
+
+			/*
+			 * What is the time at which this block is found?
+			 */
+			*cumulative_time += block_duration;
+		}
+
+		/*
+		 * Find the transactions that will arrive in that new block.
+		 */
+		uint64_t start_ns = ctx->timing ? now_ns() : 0;
+
+		PROFILE_BEGIN(generate_mark);
+		int t = sim_transactions(ctx, *cumulative_time, tps);
+		PROFILE_END(PROFILE_GENERATE, generate_mark);
+		cumulative_transactions += t;
+
+		uint64_t generated_ns = ctx->timing ? now_ns() : 0;
+
+		int transactions_handled = 0;
+		for (int l = 0; l < ctx->num_lanes; l++) {
+			struct sim_lane *lane = &ctx->lanes[l];
+			unsigned int pending = sim_pending_count(ctx, lane);
+			if (ctx->stats.peak_pending < pending) {
+				ctx->stats.peak_pending = pending;
+			}
+
+			PROFILE_BEGIN(confirm_mark);
+			int handled = create_block(ctx, lane, *cumulative_time);
+			PROFILE_END(PROFILE_CONFIRM, confirm_mark);
+			ctx->stats.transactions_confirmed += handled;
+			if (l == 0) {
+				transactions_handled = handled;
+			}
+		}
+
+		cumulative_transactions_handled += transactions_handled;
+		cumulative_transactions -= transactions_handled;
+
+		if (ctx->timing) {
+			uint64_t confirmed_ns = now_ns();
+			ctx->stats.generate_ns += generated_ns - start_ns;
+			ctx->stats.confirm_ns += confirmed_ns - generated_ns;
+		}
+
+		ctx->stats.transactions_generated += t;
+
+		if (ctx->block_ring) {
+			struct block_record rec;
+			rec.time = *cumulative_time;
+			rec.interval = block_duration;
+			rec.oldest_age = sim_oldest_age(ctx, &ctx->lanes[0], *cumulative_time);
+			rec.sim = ctx->sim_index;
+			rec.rate = ctx->rate_index;
+			rec.block = i;
+			rec.transactions = (uint32_t)transactions_handled;
+			rec.backlog = (uint32_t)cumulative_transactions;
+			block_ring_push(ctx->block_ring, &rec);
+		}
+	}
+
+	ctx->stats.blocks += num_blocks;
+	*transactions_handled = cumulative_transactions_handled;
+}
+
+
+/*
+ * sim_context_init()
+ *	Initialize a simulation context.
+ */
+void sim_context_init(struct sim_context *ctx, const struct sim_config *cfg, const struct bucket_tables *tables)
+{
+	memset(ctx, 0, sizeof(struct sim_context));
+	ctx->discipline = cfg->discipline;
+	ctx->sizes = cfg->sizes;
+	chunk_pool_init(&ctx->pool);
+
+	ctx->lanes = calloc(cfg->num_block_sizes, sizeof(struct sim_lane));
+	if (!ctx->lanes) {
+		sim_fail("Out of memory!");
+	}
+
+	ctx->num_lanes = cfg->num_block_sizes;
+
+	for (int l = 0; l < ctx->num_lanes; l++) {
+		struct sim_lane *lane = &ctx->lanes[l];
+		lane->block_size = cfg->block_sizes[l];
+		pending_queue_init(&lane->pending, &ctx->pool, cfg->sizes ? 0 : TRANSACTION_SIZE);
+		if (cfg->discipline == QUEUE_FEE) {
+			fee_heap_init(&lane->fee_queue);
+		} else if (cfg->discipline == QUEUE_LAZY) {
+			lazy_backlog_init(&lane->backlog);
+		}
+
+		if (cfg->sketch_accuracy > 0.0) {
+			ddsketch_init(&lane->sketch, cfg->sketch_accuracy);
+			histogram_init(&lane->hist, tables, &lane->sketch);
+		} else {
+			histogram_init(&lane->hist, tables, NULL);
+		}
+	}
+}
+
+/*
+ * sim_context_reset()
+ *	Clean up the pending transactions left by the last simulation.  The chunk pool keeps
+ *	its slabs so that the next simulation doesn't have to allocate them again.
+ */
+static void sim_context_reset(struct sim_context *ctx)
+{
+	chunk_pool_reset(&ctx->pool);
+	for (int l = 0; l < ctx->num_lanes; l++) {
+		struct sim_lane *lane = &ctx->lanes[l];
+		pending_queue_init(&lane->pending, &ctx->pool, ctx->sizes ? 0 : TRANSACTION_SIZE);
+		lane->fee_queue.count = 0;
+		lane->backlog.head = 0;
+		lane->backlog.tail = 0;
+		lane->backlog.count = 0;
+	}
+
+	sim_arrivals_reset(ctx);
+}
+
+/*
+ * sim_stats_merge()
+ *	Add the counters in "src" into "dest".
+ */
+void sim_stats_merge(struct sim_stats *dest, const struct sim_stats *src)
+{
+	dest->blocks += src->blocks;
+	dest->transactions_generated += src->transactions_generated;
+	dest->transactions_confirmed += src->transactions_confirmed;
+	dest->generate_ns += src->generate_ns;
+	dest->confirm_ns += src->confirm_ns;
+	dest->pool_hits += src->pool_hits;
+	dest->pool_misses += src->pool_misses;
+	dest->pending_bytes += src->pending_bytes;
+
+	if (dest->peak_pending < src->peak_pending) {
+		dest->peak_pending = src->peak_pending;
+	}
+
+	if (dest->peak_chunks < src->peak_chunks) {
+		dest->peak_chunks = src->peak_chunks;
+	}
+}
+
+/*
+ * sim_context_stats()
+ *	Fill in the allocator counters for a context and return all of its counters.
+ */
+const struct sim_stats *sim_context_stats(struct sim_context *ctx)
+{
+	ctx->stats.pool_hits = ctx->pool.hits;
+	ctx->stats.pool_misses = ctx->pool.misses;
+	ctx->stats.pending_bytes = chunk_pool_bytes(&ctx->pool);
+	for (int l = 0; l < ctx->num_lanes; l++) {
+		ctx->stats.pending_bytes += fee_heap_bytes(&ctx->lanes[l].fee_queue) + lazy_backlog_bytes(&ctx->lanes[l].backlog);
+	}
+
+	ctx->stats.peak_chunks = ctx->pool.peak_chunks_in_use;
+	return &ctx->stats;
+}
+
+/*
+ * sim_context_destroy()
+ *	Release everything held by a simulation context.
+ */
+void sim_context_destroy(struct sim_context *ctx)
+{
+	chunk_pool_destroy(&ctx->pool);
+	for (int l = 0; l < ctx->num_lanes; l++) {
+		struct sim_lane *lane = &ctx->lanes[l];
+		fee_heap_destroy(&lane->fee_queue);
+		lazy_backlog_destroy(&lane->backlog);
+		if (lane->hist.sketch) {
+			ddsketch_destroy(lane->hist.sketch);
+		}
+
+		histogram_destroy(&lane->hist);
+	}
+
+	free(ctx->lanes);
+	ctx->lanes = NULL;
+	free(ctx->schedule.time);
+}
+
+
+/*
+ * sim_simulate()
+ *	Run simulation number "sim" of a run with master seed "master", mining "num_blocks"
+ *	blocks at "tps" transactions per second, and then clean up after it.  With common
+ *	random numbers the seed comes instead from "crn_sim", the simulation's number within
+ *	its rate.
+ */
+void sim_simulate(struct sim_context *ctx, uint64_t master, uint64_t sim, uint32_t crn_sim, double tps, int num_blocks)
+{
+	/*
+	 * Randomize!  Every simulation at every rate gets its own seed.
+	 */
+	uint64_t seed = sim_seed(master, sim);
+	if (ctx->crn) {
+		uint64_t bits[2];
+		ctx->crn_sim = crn_sim;
+		crn_bits(ctx, 0, CRN_STREAM_SCHEDULE, bits);
+		seed = bits[0];
+	}
+
+	sim_seed_context(ctx, seed);
+	if (ctx->schedule.enabled) {
+		PROFILE_BEGIN(schedule_mark);
+		block_schedule_fill(&ctx->schedule, seed, num_blocks);
+		PROFILE_END(PROFILE_BLOCK_INTERVAL, schedule_mark);
+	}
+
+	double cumulative_time = 0.0;
+	int transactions_handled;
+	mine(ctx, tps, num_blocks, &cumulative_time, &transactions_handled);
+
+	sim_context_reset(ctx);
+}
+
+
+/*
+ * Simulation context for library callers.  This wraps a single lane simulation context
+ * that's kept, along with everything that it has allocated, from one run to the next.
+ * Each run's results are collected in the lane's histogram and only added to "results"
+ * once every simulation in the run has finished.
+ */
+struct btb_context {
+	struct sim_config cfg;			/* Configuration that "sim" was made with */
+	struct sim_context sim;			/* Simulation context */
+	struct histogram results;		/* Results of the runs so far, including merged ones */
+	uint64_t seed;				/* Master seed for the simulations */
+	long long int next_sim;			/* Number of the next simulation to run */
+	long long int num_sims;			/* Simulations in the results, including merged ones */
+};
+
+/*
+ * btb_config_init()
+ *	Fill in a library configuration with the defaults.
+ */
+void btb_config_init(struct btb_config *cfg)
+{
+	memset(cfg, 0, sizeof(struct btb_config));
+	cfg->num_blocks = 1008;
+	cfg->queue = BTB_QUEUE_FIFO;
+	cfg->block_size = BLOCK_SIZE;
+	cfg->buckets_per_order = FINE_BUCKETS_PER_ORDER;
+}
+
+/*
+ * btb_reset()
+ *	Throw away a library context's results and start numbering its simulations again
+ *	from master seed "seed".
+ */
+void btb_reset(struct btb_context *ctx, uint64_t seed)
+{
+	ctx->seed = seed;
+	ctx->next_sim = 0;
+	ctx->num_sims = 0;
+	ctx->sim.crn_key[0] = (uint32_t)seed;
+	ctx->sim.crn_key[1] = (uint32_t)(seed >> 32);
+	histogram_clear(&ctx->results);
+}
+
+/*
+ * btb_init()
+ *	Create a library context, or return NULL if the configuration isn't valid or we run
+ *	out of memory.
+ */
+struct btb_context *btb_init(const struct btb_config *cfg)
+{
+	if ((cfg->num_blocks < 1) || (cfg->block_size < TRANSACTION_SIZE) || (cfg->block_size > MAX_BLOCK_SIZE) ||
+	    !(cfg->hash_growth >= 0.0)) {
+		return NULL;
+	}
+
+	enum queue_discipline discipline;
+	switch (cfg->queue) {
+	case BTB_QUEUE_FIFO:
+		discipline = QUEUE_FIFO;
+		break;
+
+	case BTB_QUEUE_FEE:
+		discipline = QUEUE_FEE;
+		break;
+
+	case BTB_QUEUE_LAZY:
+		discipline = QUEUE_LAZY;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	const struct bucket_tables *tables = bucket_tables_find(cfg->buckets_per_order);
+	if (!tables || !bucket_tables_init()) {
+		return NULL;
+	}
+
+	struct btb_context *ctx = calloc(1, sizeof(struct btb_context));
+	if (!ctx) {
+		return NULL;
+	}
+
+	struct sim_config *sc = &ctx->cfg;
+	sc->num_blocks = cfg->num_blocks;
+	sc->discipline = discipline;
+	sc->num_block_sizes = 1;
+	sc->block_sizes[0] = cfg->block_size;
+	sc->hash_model = cfg->hash_model;
+	sc->hash_growth = cfg->hash_growth;
+	sc->crn = cfg->crn;
+	sc->buckets_per_order = cfg->buckets_per_order;
+
+	jmp_buf fail;
+	if (setjmp(fail)) {
+		sim_fail_jump = NULL;
+		sim_context_destroy(&ctx->sim);
+		histogram_destroy(&ctx->results);
+		free(ctx);
+		return NULL;
+	}
+
+	sim_fail_jump = &fail;
+	sim_context_init(&ctx->sim, sc, tables);
+	histogram_init(&ctx->results, tables, NULL);
+	sim_fail_jump = NULL;
+
+	ctx->sim.crn = cfg->crn;
+	ctx->sim.schedule.enabled = cfg->hash_model;
+	ctx->sim.schedule.growth = cfg->hash_model ? (log1p(cfg->hash_growth) / RETARGET_TIMESPAN) : 0.0;
+	sim_arrivals_reset(&ctx->sim);
+	btb_reset(ctx, cfg->seed);
+
+	return ctx;
+}
+
+/*
+ * btb_run()
+ *	Run "num_sims" more simulations at "tps" in a library context.
+ */
+bool btb_run(struct btb_context *ctx, double tps, int num_sims)
+{
+	/*
+	 * Simulations are numbered with an int, as they are on the command line, so we can't
+	 * run more than INT_MAX of them between resets.
+	 */
+	if (!(tps >= 0.0) || (num_sims < 0) || (num_sims > INT_MAX - ctx->next_sim)) {
+		return false;
+	}
+
+	/*
+	 * If a simulation fails then we come back here with the context part way through
+	 * it.  Clean up after it, and roll the whole run back: none of its results have
+	 * reached "results" yet, and the simulations will be numbered the same way again.
+	 */
+	long long int first = ctx->next_sim;
+	jmp_buf fail;
+	if (setjmp(fail)) {
+		sim_fail_jump = NULL;
+		sim_context_reset(&ctx->sim);
+		ctx->next_sim = first;
+		return false;
+	}
+
+	histogram_clear(&ctx->sim.lanes[0].hist);
+
+	sim_fail_jump = &fail;
+	for (int i = 0; i < num_sims; i++) {
+		long long int sim = ctx->next_sim++;
+		ctx->sim.sim_index = (int)sim;
+		sim_simulate(&ctx->sim, ctx->seed, (uint64_t)sim, (uint32_t)sim, tps, ctx->cfg.num_blocks);
+	}
+
+	sim_fail_jump = NULL;
+	histogram_merge(&ctx->results, &ctx->sim.lanes[0].hist);
+	ctx->num_sims += num_sims;
+
+	return true;
+}
+
+/*
+ * btb_merge()
+ *	Add the results of library context "src" to those of "dest".
+ */
+bool btb_merge(struct btb_context *dest, const struct btb_context *src)
+{
+	const struct histogram *hs = &src->results;
+	struct histogram *hd = &dest->results;
+	if (hs->tables != hd->tables) {
+		return false;
+	}
+
+	histogram_merge(hd, hs);
+	dest->num_sims += src->num_sims;
+	return true;
+}
+
+/*
+ * btb_results()
+ *	Summarize a library context's results.  "num_sims" counts those merged in as well as
+ *	the context's own.
+ */
+void btb_results(const struct btb_context *ctx, struct btb_results *res)
+{
+	const struct histogram *h = &ctx->results;
+	res->num_sims = ctx->num_sims;
+	res->num_results = h->num_results;
+	res->mean = h->num_results ? h->mean : NAN;
+	res->stddev = (h->num_results > 1) ? sqrt(h->m2 / (double)(h->num_results - 1)) : NAN;
+}
+
+/*
+ * btb_percentile()
+ *	Estimate quantile "q" of a library context's results.
+ */
+double btb_percentile(const struct btb_context *ctx, double q)
+{
+	return histogram_percentile(&ctx->results, q);
+}
+
+/*
+ * btb_buckets()
+ *	Return a library context's bucket counts, and optionally their edges.
+ */
+const long int *btb_buckets(const struct btb_context *ctx, const double **edges, int *num_buckets)
+{
+	const struct histogram *h = &ctx->results;
+	if (edges) {
+		*edges = h->tables->edge;
+	}
+
+	*num_buckets = h->tables->num_buckets;
+	return h->buckets;
+}
+
+/*
+ * btb_destroy()
+ *	Release everything held by a library context.
+ */
+void btb_destroy(struct btb_context *ctx)
+{
+	sim_context_destroy(&ctx->sim);
+	histogram_destroy(&ctx->results);
+	free(ctx);
+}
@@ -0,0 +1,616 @@
+/*
+ * sim.h
+ *	Simulation core shared by btb and libbtb: histograms, transaction sizes and arrival
+ *	profiles, pending transaction queues and the simulation context that runs them.
+ *
+ * Copyright (C) 2015 David Hudson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Histogram layout.  The buckets are evenly spaced in log10(age) and cover the powers of
+ * 10 from 10^-NEGATIVE_ORDERS to 10^POSITIVE_ORDERS seconds.  There are two resolutions:
+ * the fine one is what the original articles used, and the coarse one is small enough to
+ * stay in the L1 cache while we're recording ages.  NUM_BUCKETS is the larger size, so
+ * it's enough for either when reading or writing results files.
+ */
+#define NEGATIVE_ORDERS 1
+#define POSITIVE_ORDERS 10
+#define FINE_BUCKETS_PER_ORDER 1000
+#define COARSE_BUCKETS_PER_ORDER 100
+#define NUM_FINE_BUCKETS (FINE_BUCKETS_PER_ORDER * (POSITIVE_ORDERS + NEGATIVE_ORDERS))
+#define NUM_COARSE_BUCKETS (COARSE_BUCKETS_PER_ORDER * (POSITIVE_ORDERS + NEGATIVE_ORDERS))
+#define NUM_BUCKETS NUM_FINE_BUCKETS
+
+/*
+ * Default block size limit and the (fixed) size of each transaction, both in bytes.
+ * TPS rates are always relative to the default block size, so a TPS of 3.5 fills 1 MB
+ * blocks whatever size of block we're simulating.
+ */
+#define BLOCK_SIZE (1024 * 1024)
+#define TRANSACTION_SIZE ((1024 * 1024) / 2100)
+
+/*
+ * Largest block size limit that we'll simulate, the most block sizes that we'll
+ * simulate side by side, and the most transaction rates that a TPS range can expand to.
+ */
+#define MAX_BLOCK_SIZE (1024LL * 1024 * 1024)
+#define MAX_LANES 16
+#define MAX_RATES 100000
+
+/*
+ * Mean time between blocks, in seconds, that the difficulty aims for.
+ */
+#define TARGET_BLOCK_INTERVAL 600.0
+
+/*
+ * Difficulty retargeting.  Every RETARGET_INTERVAL blocks the difficulty is scaled so
+ * that those blocks would have taken RETARGET_TIMESPAN seconds, but never by more than
+ * a factor of RETARGET_MAX_ADJUST either way.
+ */
+#define RETARGET_INTERVAL 2016
+#define RETARGET_TIMESPAN (RETARGET_INTERVAL * TARGET_BLOCK_INTERVAL)
+#define RETARGET_MAX_ADJUST 4.0
+
+/*
+ * Entry in a transaction size alias table.  A draw picks an entry uniformly and then
+ * takes "size" with probability threshold / 2^32, or "alias_size" otherwise.  We keep
+ * the alias's size rather than its index so each draw only touches one entry.
+ */
+struct size_alias_entry {
+	uint32_t threshold;			/* Probability of "size", scaled by 2^32 */
+	uint32_t size;				/* Size of this entry's transactions */
+	uint32_t alias_size;			/* Size taken when "size" isn't */
+};
+
+/*
+ * Transaction size distribution.  The table is mapped read-only from a file and shared
+ * by all of the simulation threads.
+ */
+struct size_table {
+	const struct size_alias_entry *entries;	/* Alias table entries */
+	uint32_t num_entries;			/* Number of entries */
+	uint32_t max_size;			/* Largest transaction size */
+	double mean_size;			/* Mean transaction size */
+	void *map;				/* Mapping of the whole file */
+	size_t map_size;			/* Size of the mapping */
+};
+
+/*
+ * Segment of an arrival rate profile.  Arrivals are a Poisson process in "operational
+ * time", which runs at the segment's relative rate compared with real time, so we can
+ * generate them just as we would at a constant rate and then map them back.
+ */
+struct rate_segment {
+	double start;				/* Real time at which the segment starts in the cycle */
+	double op_start;			/* Operational time at which it starts */
+	double op_end;				/* Operational time at which it ends */
+	double inv_rate;			/* Real seconds per operational second */
+};
+
+/*
+ * Arrival rate profile.  This repeats with a period of "period" seconds, and its rates
+ * are scaled to average 1 so that a cycle is as long in operational time as in real
+ * time and the TPS that we're given is still the mean rate.  It's only read once it's
+ * been loaded, so all of the simulation threads share it.
+ */
+struct rate_profile {
+	struct rate_segment *segs;		/* Segments of one cycle, in order */
+	int num_segs;				/* Number of segments */
+	double period;				/* Length of a cycle in seconds */
+};
+
+/*
+ * Philox4x32-10 constants: the round multipliers and the Weyl sequence that bumps the
+ * key between rounds.  The GPU backend's generator uses them too.
+ */
+#define PHILOX_M0 0xd2511f53U
+#define PHILOX_M1 0xcd9e8d57U
+#define PHILOX_W0 0x9e3779b9U
+#define PHILOX_W1 0xbb67ae85U
+#define PHILOX_ROUNDS 10
+
+/*
+ * Number of mantissa bits used to index the bucket lookup table.  With 8 bits each
+ * table entry spans a factor of 1 + 1/256 in age, or about 1.7 buckets.
+ */
+#define BUCKET_LOOKUP_BITS 8
+#define BUCKET_LOOKUP_SHIFT (52 - BUCKET_LOOKUP_BITS)
+
+/*
+ * Number of exponential variates generated in each batch.
+ */
+#define EXP_BATCH 256
+
+/*
+ * Number of transactions held in each pending queue chunk, and the number of chunks
+ * that the pool allocates from the heap at a time.
+ */
+#define PENDING_CHUNK_ENTRIES 4096
+#define POOL_SLAB_CHUNKS 16
+
+/*
+ * Chunk of pending transactions.  Within a chunk the details of each transaction are
+ * held in separate arrays.  Rather than the size of each transaction we record the
+ * total number of bytes pushed onto the queue up to and including it; that's a running
+ * prefix sum of the sizes so we can find how many transactions fit in a block with a
+ * binary search.
+ */
+struct pending_chunk {
+	struct pending_chunk *next;		/* Next chunk in the queue or on the free list */
+	double time[PENDING_CHUNK_ENTRIES];	/* Time at which each transaction was generated */
+	long long int end[PENDING_CHUNK_ENTRIES];
+						/* Queue bytes up to the end of each transaction */
+};
+
+/*
+ * Slab of chunks allocated in one go by a chunk pool.
+ */
+struct chunk_slab {
+	struct chunk_slab *next;		/* Next slab owned by the pool */
+	struct pending_chunk chunks[POOL_SLAB_CHUNKS];
+};
+
+/*
+ * Pool allocator for pending queue chunks.  Chunks are carved out of slabs and recycled
+ * through a free list.  Slabs are only returned to the heap when the pool is destroyed,
+ * so the pool's size is set by the deepest backlog seen.
+ */
+struct chunk_pool {
+	struct chunk_slab *slabs;		/* All slabs owned by the pool */
+	struct pending_chunk *free_list;	/* Chunks available for re-use */
+	int num_slabs;				/* Number of slabs allocated */
+	int chunks_in_use;			/* Number of chunks currently handed out */
+	int peak_chunks_in_use;			/* Largest value of chunks_in_use */
+	long long int hits;			/* Allocations satisfied from the free list */
+	long long int misses;			/* Allocations that needed a new slab */
+};
+
+/*
+ * Pending transaction queue.  Transactions are strictly first-in, first-out so we keep
+ * them in a singly linked queue of chunks.  Chunks are added at the tail as they fill
+ * and handed back to the pool as soon as they have been drained.
+ */
+struct pending_queue {
+	struct chunk_pool *pool;		/* Pool supplying our chunks */
+	struct pending_chunk *head_chunk;	/* Chunk holding the oldest transaction */
+	struct pending_chunk *tail_chunk;	/* Chunk that new transactions are added to */
+	unsigned int head;			/* Index of the oldest transaction in head_chunk */
+	unsigned int tail;			/* Index of the next free entry in tail_chunk */
+	unsigned int count;			/* Number of transactions in the queue */
+	int fixed_size;				/* Size of every transaction, or 0 if they vary */
+	long long int bytes_pushed;		/* Total bytes of transactions ever pushed */
+	long long int bytes_popped;		/* Total bytes of transactions ever popped */
+};
+
+/*
+ * Order in which pending transactions are taken into blocks.
+ */
+enum queue_discipline {
+	QUEUE_FIFO,				/* Oldest transaction first */
+	QUEUE_FEE,				/* Highest fee rate first */
+	QUEUE_LAZY				/* Oldest first, with arrival times made on demand */
+};
+
+/*
+ * Entry in a fee-ordered mempool.  This is 16 bytes so the four children of a node in
+ * the heap share one 64-byte cache line.
+ */
+struct fee_entry {
+	double time;				/* Time at which the transaction was generated */
+	float fee_rate;				/* Fee per byte */
+	int size;				/* Size of the transaction in bytes */
+};
+
+/*
+ * Fee-ordered mempool.  This is a 4-ary max-heap on fee rate, with older transactions
+ * first when fee rates are equal.  The entries live in one array that only grows, and
+ * we offset it by 3 entries so that every group of siblings is cache line aligned.
+ */
+struct fee_heap {
+	struct fee_entry *alloc;		/* Allocated storage */
+	struct fee_entry *e;			/* Heap entries (alloc + 3) */
+	unsigned int count;			/* Number of transactions in the heap */
+	unsigned int capacity;			/* Number of entries that "e" can hold */
+};
+
+/*
+ * Run of transactions that arrived in the interval ("start", "end"].  Given how many
+ * there are, the arrival times of a Poisson process are uniformly distributed over the
+ * interval, so we don't need to know them until a block takes the transactions.
+ */
+struct backlog_segment {
+	double start;				/* Time of the last transaction taken, or the start of the interval */
+	double end;				/* End of the interval */
+	unsigned int count;			/* Number of transactions still in the interval */
+};
+
+/*
+ * Lazy FIFO backlog.  Each block interval adds one segment however many transactions
+ * arrive in it, so a deeply overloaded simulation needs very little memory.
+ */
+struct lazy_backlog {
+	struct backlog_segment *segs;		/* Segments, oldest first, from "head" to "tail" */
+	unsigned int head;			/* Index of the oldest segment */
+	unsigned int tail;			/* Index after the newest segment */
+	unsigned int capacity;			/* Number of segments that "segs" can hold */
+	unsigned int count;			/* Total number of transactions in the backlog */
+};
+
+/*
+ * Per-block statistics record.  These are streamed out to the "--block-stats" file.
+ */
+struct block_record {
+	double time;				/* Time at which the block was found */
+	double interval;			/* Time since the previous block */
+	double oldest_age;			/* Age of the oldest pending transaction, or NaN */
+	int64_t sim;				/* Simulation index within the rate */
+	int32_t rate;				/* Index of the transaction arrival rate */
+	int32_t block;				/* Block index within the simulation */
+	uint32_t transactions;			/* Transactions included in the block */
+	uint32_t backlog;			/* Transactions still pending after the block */
+};
+
+/*
+ * Number of records in each worker's block statistics ring.  This must be a power of 2.
+ */
+#define BLOCK_RING_ENTRIES 4096
+
+/*
+ * Single-producer, single-consumer ring of block statistics records.  Each simulation
+ * worker owns one and the block statistics writer drains them all.  The two indices
+ * only ever increase and live on separate cache lines so the producer and the consumer
+ * don't fight over them.  The producer keeps its own copy of the consumer's index and
+ * only re-reads the real one when the ring looks full.
+ */
+struct block_ring {
+	uint64_t head __attribute__((aligned(64)));
+						/* Next record to write (written by the producer) */
+	uint64_t cached_tail;			/* Producer's last view of "tail" */
+	uint64_t tail __attribute__((aligned(64)));
+						/* Next record to read (written by the consumer) */
+	struct block_record records[BLOCK_RING_ENTRIES] __attribute__((aligned(64)));
+};
+
+/*
+ * Random number generator state.  xoshiro256** is used by default; building with
+ * BTB_RNG_PCG64 defined selects PCG64 (XSL-RR 128/64) instead.  Either way the
+ * state is small, owned by one simulation context and never shared.
+ */
+struct rng {
+#ifdef BTB_RNG_PCG64
+	unsigned __int128 state;		/* LCG state */
+	unsigned __int128 inc;			/* LCG increment (always odd) */
+#else
+	uint64_t s[4];				/* xoshiro256** state */
+#endif
+};
+
+/*
+ * Name of the random number generator, for the benchmark results.
+ */
+#ifdef BTB_RNG_PCG64
+#define RNG_NAME "pcg64"
+#else
+#define RNG_NAME "xoshiro256**"
+#endif
+
+/*
+ * Range of ages covered by a quantile sketch.  Ages outside it are counted in the first
+ * or last bin.
+ */
+#define SKETCH_MIN_AGE 1e-3
+#define SKETCH_MAX_AGE 1e12
+
+/*
+ * DDSketch quantile sketch.  Bin k counts the ages in (gamma^(k - 1), gamma^k], with the
+ * bins offset so that SKETCH_MIN_AGE falls in bin 0.  Any quantile it reports is within a
+ * factor of 1 +/- alpha of a true value of that quantile, where gamma = (1 + alpha) /
+ * (1 - alpha).  Sketches with the same alpha merge by adding their bins.
+ */
+struct ddsketch {
+	double alpha;				/* Relative accuracy */
+	double gamma;				/* Ratio between bin boundaries */
+	double inv_log_gamma;			/* 1 / log(gamma) */
+	int offset;				/* Index of the bin holding SKETCH_MIN_AGE */
+	int num_bins;				/* Number of bins */
+	long long int count;			/* Number of ages recorded */
+	long long int *bins;			/* Count of ages in each bin */
+};
+
+/*
+ * Bucket boundary tables for one histogram resolution, of N buckets per power of 10.
+ *
+ * edge[i] is 10^((i - offset) / N).  The output labels bucket i with the range edge[i]
+ * to edge[i + 1].
+ *
+ * limit[b] is the largest age that lands in bucket b, which is edge[b].  The last bucket
+ * catches everything above it so its limit is infinite.
+ *
+ * lookup[] is indexed by the top bits of an age's IEEE-754 representation (the exponent
+ * plus BUCKET_LOOKUP_BITS of mantissa), which increase monotonically with the age.  Each
+ * entry holds the first bucket that any age with those top bits can land in.
+ */
+struct bucket_tables {
+	int buckets_per_order;			/* Number of buckets per power of 10 (N) */
+	int num_buckets;			/* Total number of buckets */
+	double *edge;				/* Bucket edges (num_buckets + 1 of them) */
+	double *limit;				/* Largest age in each bucket */
+	uint16_t *lookup;			/* First possible bucket for each age key */
+	int64_t lookup_base;			/* Age key of lookup[0] */
+	int64_t lookup_size;			/* Number of entries in lookup[] */
+};
+
+/*
+ * Histogram of transaction confirmation times.  Alongside the buckets we keep the exact
+ * mean and sum of squared differences from the mean (Welford's M2) of every age, and can
+ * feed them all into a quantile sketch as well.  The buckets are allocated to suit the
+ * layout, so a coarse histogram takes a tenth of the memory of a fine one.
+ */
+struct histogram {
+	const struct bucket_tables *tables;	/* Layout of the buckets */
+	long int *buckets;			/* Count of results in each of "tables->num_buckets" buckets */
+	int smallest_bucket;			/* Smallest bucket index used so far */
+	int largest_bucket;			/* Largest bucket index used so far */
+	long long int num_results;		/* Total number of results recorded */
+	double mean;				/* Mean of the results */
+	double m2;				/* Sum of squared differences from the mean */
+	struct ddsketch *sketch;		/* Quantile sketch fed with the results, or NULL */
+};
+
+/*
+ * Counters describing the work done by the simulation.  Times are only collected when
+ * a context has timing enabled.
+ */
+struct sim_stats {
+	long long int blocks;			/* Number of blocks mined */
+	long long int transactions_generated;	/* Transactions created by sim_transactions() */
+	long long int transactions_confirmed;	/* Transactions taken by create_block() */
+	unsigned int peak_pending;		/* Deepest pending transaction queue */
+	uint64_t generate_ns;			/* Time spent in sim_transactions() */
+	uint64_t confirm_ns;			/* Time spent in create_block() */
+	long long int pool_hits;		/* Chunk allocations from the free list */
+	long long int pool_misses;		/* Chunk allocations that needed a new slab */
+	size_t pending_bytes;			/* Heap memory held for pending transactions */
+	int peak_chunks;			/* Most chunks used by any one pending queue */
+	int threads;				/* Worker threads that sim_run() actually started */
+};
+
+/*
+ * Precomputed block schedule.  With a hash rate model we work out the time at which
+ * every block of a simulation is found before we simulate any transactions.
+ */
+struct block_schedule {
+	bool enabled;				/* True if blocks follow the hash rate model */
+	double growth;				/* Exponential hash rate growth, per second */
+	double *time;				/* Time at which each block is found */
+	int capacity;				/* Number of entries that "time" can hold */
+};
+
+/*
+ * One block size scenario, or lane, of a simulation context.  Every lane sees the same
+ * transaction arrivals and blocks but has its own block size limit, pending transactions
+ * and results.
+ *
+ * Depending on the queue discipline the pending transactions are either held in FIFO
+ * order in "pending", in fee order in "fee_queue" or as runs of arrivals in "backlog".
+ */
+struct sim_lane {
+	long long int block_size;		/* Block size limit in bytes */
+	struct pending_queue pending;		/* FIFO pending transactions */
+	struct fee_heap fee_queue;		/* Fee-ordered pending transactions */
+	struct lazy_backlog backlog;		/* Lazy FIFO pending transactions */
+	struct histogram hist;			/* Results collected by this lane */
+	struct ddsketch sketch;			/* Storage for "hist"'s sketch, if it has one */
+};
+
+/*
+ * Simulation context.  Each worker thread owns one of these so that nothing in
+ * the simulation hot path is shared between threads.
+ */
+struct sim_context {
+	/*
+	 * Block size scenarios, all of which are fed from the same arrivals.  The lanes'
+	 * FIFO queues share one chunk pool.  With a lazy backlog "next_transaction_secs" is
+	 * the time up to which we've generated arrivals.
+	 */
+	enum queue_discipline discipline;
+	struct chunk_pool pool;
+	struct sim_lane *lanes;
+	int num_lanes;
+	double next_transaction_secs;
+
+	/*
+	 * Distribution of transaction sizes, or NULL if every transaction is
+	 * TRANSACTION_SIZE bytes.
+	 */
+	const struct size_table *sizes;
+
+	/*
+	 * Arrival rate profile, or NULL if transactions arrive at a constant rate.  We keep a
+	 * cursor on the segment that the next arrival is in, the operational time of that
+	 * arrival and the start of the current cycle.
+	 */
+	const struct rate_profile *profile;
+	int profile_seg;
+	double profile_base;
+	double next_transaction_op;
+
+	/*
+	 * Random number generation.  The generator is seeded once per simulation with a
+	 * seed derived from the master seed for the run.
+	 */
+	struct rng rng;
+
+	/*
+	 * Common random numbers.  If "crn" is set then every block reseeds "rng" from a
+	 * Philox counter made up of the simulation number, "crn_sim", and the block number,
+	 * under a key made from the master seed.
+	 */
+	bool crn;
+	uint32_t crn_key[2];
+	uint32_t crn_sim;
+
+	/*
+	 * Block times for the current simulation, if we're modelling the hash rate.
+	 */
+	struct block_schedule schedule;
+
+	/*
+	 * Batch of standard exponential variates and the index of the next one to use.
+	 */
+	double exp_buf[EXP_BATCH] __attribute__((aligned(64)));
+	int exp_next;
+
+	/*
+	 * Per-block statistics, streamed out through "block_ring" if it's not NULL, and the
+	 * rate and simulation that we're working on.
+	 */
+	struct block_ring *block_ring;
+	int rate_index;
+	int sim_index;
+
+	/*
+	 * Performance counters.
+	 */
+	bool timing;
+	struct sim_stats stats;
+};
+
+/*
+ * Output formats for the results.
+ */
+enum output_format {
+	OUTPUT_TEXT,				/* Human readable table (the original format) */
+	OUTPUT_CSV,				/* One CSV row per bucket, for columnar tools */
+	OUTPUT_BINARY,				/* Header and raw bucket counts per rate */
+	OUTPUT_SUMMARY				/* Mean, standard deviation and percentiles per rate */
+};
+
+/*
+ * Convergence monitoring.  In "--target-ci" mode each rate is split into up to
+ * CI_MAX_BATCHES batches of simulations, and we stop simulating a rate once we've seen
+ * at least CI_MIN_BATCHES of them and the 95% confidence interval of every monitored
+ * percentile is narrow enough.
+ */
+#define CI_MAX_PERCENTILES 8
+#define CI_MAX_BATCHES 1000
+#define CI_MIN_BATCHES 10
+
+/*
+ * Configuration of a simulation run.
+ */
+struct sim_config {
+	double *tps;				/* Transaction arrival rates to simulate */
+	int num_rates;				/* Number of arrival rates */
+	int num_blocks;				/* Number of blocks per simulation */
+	int num_sims;				/* Number of simulations at each rate */
+	int num_threads;			/* Number of simulation threads */
+	uint64_t seed;				/* Master seed for the run */
+	bool seed_given;			/* Was "seed" given on the command line? */
+	enum output_format output_format;	/* Format of the results */
+	enum queue_discipline discipline;	/* Order in which transactions are confirmed */
+	const struct size_table *sizes;		/* Transaction size distribution, or NULL */
+	int num_block_sizes;			/* Number of block size limits to simulate */
+	long long int block_sizes[MAX_LANES];	/* Block size limits, in bytes */
+	bool show_block_size;			/* Label the results with their block sizes? */
+	const struct rate_profile *profile;	/* Arrival rate profile, or NULL */
+	bool hash_model;			/* Model hash rate growth and retargeting? */
+	double hash_growth;			/* Hash rate growth per retarget timespan (0.1 is 10%) */
+	bool crn;				/* Use common random numbers across rates? */
+	bool gpu;				/* Run the simulations on a GPU (btb-gpu only)? */
+	const char *checkpoint_name;		/* File to checkpoint the run to, or NULL */
+	int checkpoint_interval;		/* Seconds between checkpoints */
+	bool resume;				/* Resume from the checkpoint file? */
+	const char *block_stats_name;		/* File to stream block statistics to, or NULL */
+	const char *live_name;			/* File to publish live results in, or NULL */
+	double sketch_accuracy;			/* Relative accuracy of quantile sketches, or 0 */
+	int buckets_per_order;			/* Histogram resolution to simulate with */
+	int output_buckets_per_order;		/* Histogram resolution to output, or 0 for the same */
+	double target_ci;			/* Relative confidence interval to stop at, or 0 */
+	int num_ci_percentiles;			/* Number of percentiles to monitor */
+	double ci_percentiles[CI_MAX_PERCENTILES];
+						/* Percentiles to monitor (0 to 1) */
+	bool quiet;				/* Suppress progress reports? */
+	bool timing;				/* Time the phases of each block? */
+};
+
+/*
+ * Start and report on a simulation thread's profile in a profiling build ("make
+ * PROFILE=1").  Otherwise these do nothing.
+ */
+#ifdef BTB_PROFILE
+void profile_thread_start(void);
+void profile_thread_report(int worker);
+#define PROFILE_THREAD_START() profile_thread_start()
+#define PROFILE_THREAD_REPORT(worker) profile_thread_report(worker)
+#else
+#define PROFILE_THREAD_START() do { } while (0)
+#define PROFILE_THREAD_REPORT(worker) do { } while (0)
+#endif
+
+/*
+ * Bucket tables.
+ */
+bool bucket_tables_init(void);
+const struct bucket_tables *bucket_tables_find(int buckets_per_order);
+
+/*
+ * Quantile sketches.
+ */
+void ddsketch_init(struct ddsketch *s, double alpha);
+void ddsketch_destroy(struct ddsketch *s);
+double ddsketch_quantile(const struct ddsketch *s, double q);
+
+/*
+ * Histograms.
+ */
+void histogram_init(struct histogram *h, const struct bucket_tables *tables, struct ddsketch *sketch);
+void histogram_destroy(struct histogram *h);
+void histogram_clear(struct histogram *h);
+double histogram_percentile(const struct histogram *h, double q);
+void histogram_convert(struct histogram *dest, const struct bucket_tables *tables, const struct histogram *src);
+void histogram_merge(struct histogram *dest, const struct histogram *src);
+void histogram_add_counts(struct histogram *h, const uint64_t *counts, long long int num_results, double mean, double m2);
+double histogram_ks_distance(const struct histogram *a, const struct histogram *b);
+
+/*
+ * Simulation contexts.
+ */
+void sim_context_init(struct sim_context *ctx, const struct sim_config *cfg, const struct bucket_tables *tables);
+void sim_arrivals_reset(struct sim_context *ctx);
+void sim_simulate(struct sim_context *ctx, uint64_t master, uint64_t sim, uint32_t crn_sim, double tps, int num_blocks);
+const struct sim_stats *sim_context_stats(struct sim_context *ctx);
+void sim_stats_merge(struct sim_stats *dest, const struct sim_stats *src);
+void sim_context_destroy(struct sim_context *ctx);
+
+/*
+ * Utilities.
+ */
+uint64_t splitmix64(uint64_t *x);
+uint64_t now_ns(void);
+
+#endif /* SIM_H */
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# check-gpu.sh
+#	Check btb-gpu's "--gpu" results against its CPU results for "make check-gpu".  Each
+#	case runs the same batches on the CPU with "--queue fifo" and on the GPU, and the
+#	two have to pass a Kolmogorov-Smirnov test with "btb --ks compare".  Exits with 1 if
+#	any don't.
+#
+# The GPU numbers its simulations' random numbers differently, so the results can never
+# be exactly the same.  The cases are sized, as the scenarios in tests/scenarios are,
+# so that cutting the block size by 5% fails them.
+#
+# The btb-gpu to test is $BTB, or ./btb-gpu by default.
+#
+BTB=${BTB:-./btb-gpu}
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+
+#
+# Each case is a name, a seed, a number of batches and the btb options and arguments for
+# each batch.  Batch i runs with the seed plus i.
+#
+FAILED=0
+while read -r NAME SEED BATCHES ARGS; do
+	echo "$NAME: $BATCHES batches of $ARGS on the CPU and the GPU"
+	: > "$TMP/cpu.bin"
+	: > "$TMP/gpu.bin"
+	I=0
+	while [ $I -lt "$BATCHES" ]; do
+		if ! $BTB --seed $((SEED + I)) --output-format binary --output-resolution coarse --queue fifo $ARGS >> "$TMP/cpu.bin" 2> "$TMP/btb.err" ||
+		   ! $BTB --seed $((SEED + I)) --output-format binary --output-resolution coarse --gpu $ARGS >> "$TMP/gpu.bin" 2> "$TMP/btb.err"; then
+			cat "$TMP/btb.err"
+			break
+		fi
+
+		I=$((I + 1))
+	done
+
+	if [ $I -lt "$BATCHES" ]; then
+		echo "$NAME: FAIL (btb failed)"
+		FAILED=$((FAILED + 1))
+	elif ! $BTB --ks compare "$TMP/cpu.bin" "$TMP/gpu.bin"; then
+		FAILED=$((FAILED + 1))
+	fi
+done << EOF
+load		100	8	--tps-range 2.0:3.2:0.6 72 125
+overload	200	8	--tps-range 3.5:5.0:1.5 144 40
+big		300	8	--block-size 2M 5.0 144 100
+EOF
+
+if [ $FAILED -ne 0 ]; then
+	echo "$FAILED checks failed"
+	exit 1
+fi
+
+echo "All checks passed"
@@ -0,0 +1,204 @@
+#!/bin/sh
+#
+# check.sh
+#	Run each of the regression scenarios in tests/scenarios and compare its results
+#	with its golden results, using "btb compare".  Exits with 1 if any don't match.
+#
+# The results have to be exactly the same unless we're given "--ks", which only checks
+# that they pass a Kolmogorov-Smirnov test.  That's for changes that are meant to give
+# different random numbers, such as a new generator.
+#
+# "tests/check.sh --update" (or "make check-update") writes new golden results instead.
+# Only do that once the differences are understood!  Each golden file is the output of
+# its scenario's batches, so it can always be made again from tests/scenarios.
+#
+# After the scenarios come the consistency checks, which run btb two ways that have to
+# give the same results: a --crn sweep and its rates one at a time, --block-size lanes
+# and separate runs, a resumed checkpoint and an uninterrupted run, and so on.  Those are
+# always exact, even with "--ks", because both sides use the same random numbers.
+#
+# The btb to test is $BTB, or ./btb by default.  If $LIBCHECK is set then it's the
+# tests/libcheck program, which checks libbtb against btb.
+#
+BTB=${BTB:-./btb}
+DIR=$(dirname "$0")
+GOLDEN=$DIR/golden
+
+UPDATE=0
+COMPARE=compare
+case "$1" in
+--update)
+	UPDATE=1
+	;;
+--ks)
+	COMPARE="--ks compare"
+	;;
+esac
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+
+#
+# Scenarios can use "@DIR@" for this directory and "@TMP@" for the scratch directory,
+# where the size table built from sizes.txt goes.
+#
+if ! $BTB --build-size-table "$DIR/sizes.txt" "$TMP/sizes.tbl" > "$TMP/sizes.err" 2>&1; then
+	cat "$TMP/sizes.err"
+	exit 2
+fi
+
+#
+# The results are compared at the coarse resolution, which keeps the golden files small
+# without changing how the simulation runs.
+#
+FAILED=0
+while read -r NAME SEED BATCHES ARGS; do
+	case "$NAME" in
+	""|\#*)
+		continue
+		;;
+	esac
+
+	ARGS=$(echo "$ARGS" | sed -e "s|@DIR@|$DIR|g" -e "s|@TMP@|$TMP|g")
+	echo "$NAME: $BATCHES batches of $ARGS"
+	: > "$TMP/$NAME.bin"
+	I=0
+	while [ $I -lt "$BATCHES" ]; do
+		if ! $BTB --seed $((SEED + I)) --output-format binary --output-resolution coarse $ARGS >> "$TMP/$NAME.bin" 2> "$TMP/$NAME.err"; then
+			cat "$TMP/$NAME.err"
+			break
+		fi
+
+		I=$((I + 1))
+	done
+
+	if [ $I -lt "$BATCHES" ]; then
+		echo "$NAME: FAIL (btb failed)"
+		FAILED=$((FAILED + 1))
+	elif [ $UPDATE -eq 1 ]; then
+		cp "$TMP/$NAME.bin" "$GOLDEN/$NAME.bin" || exit 2
+	elif ! $BTB $COMPARE "$GOLDEN/$NAME.bin" "$TMP/$NAME.bin"; then
+		FAILED=$((FAILED + 1))
+	fi
+done < "$DIR/scenarios"
+
+if [ $UPDATE -eq 1 ]; then
+	if [ $FAILED -ne 0 ]; then
+		echo "$FAILED scenarios failed"
+		exit 1
+	fi
+
+	echo "Golden results updated"
+	exit 0
+fi
+
+#
+# bin()
+#	Run btb with binary output, keeping its progress reports in case they're needed.
+#
+bin() {
+	$BTB --output-format binary "$@" 2>> "$TMP/btb.err"
+}
+
+#
+# same()
+#	Check that results files "$2" and "$3", which come from the same simulations run in
+#	different ways, are exactly the same.
+#
+same() {
+	echo "$1"
+	if [ ! -s "$2" ] || [ ! -s "$3" ]; then
+		cat "$TMP/btb.err"
+		echo "$1: FAIL (btb failed)"
+		FAILED=$((FAILED + 1))
+	elif ! $BTB compare "$2" "$3"; then
+		FAILED=$((FAILED + 1))
+	fi
+
+	: > "$TMP/btb.err"
+}
+
+#
+# fails()
+#	Check that a btb command that ought to be refused is.
+#
+fails() {
+	NAME=$1
+	shift
+	echo "$NAME"
+	if $BTB "$@" > /dev/null 2>&1; then
+		echo "$NAME: FAIL (btb didn't refuse)"
+		FAILED=$((FAILED + 1))
+	fi
+}
+
+bin --seed 9 --crn --tps-range 2.0:3.2:0.6 72 40 > "$TMP/crn-range.bin"
+: > "$TMP/crn-rates.bin"
+for TPS in 2.0 2.6 3.2; do
+	bin --seed 9 --crn $TPS 72 40 >> "$TMP/crn-rates.bin"
+done
+same "crn: a --tps-range sweep sees the same random numbers as each rate on its own" "$TMP/crn-range.bin" "$TMP/crn-rates.bin"
+
+bin --seed 10 --block-size 1M,2M 3.3 144 20 > "$TMP/lanes.bin"
+bin --seed 10 --block-size 1M 3.3 144 20 > "$TMP/lanes-apart.bin"
+bin --seed 10 --block-size 2M 3.3 144 20 >> "$TMP/lanes-apart.bin"
+same "lanes: --block-size 1M,2M is the same as 1M and 2M run separately" "$TMP/lanes.bin" "$TMP/lanes-apart.bin"
+
+echo "3600 1" > "$TMP/flat.txt"
+bin --seed 11 --rate-profile "$TMP/flat.txt" 3.3 144 20 > "$TMP/flat.bin"
+bin --seed 11 3.3 144 20 > "$TMP/steady.bin"
+same "profile: a flat --rate-profile is the same as none" "$TMP/flat.bin" "$TMP/steady.bin"
+
+bin --seed 12 --resolution coarse 3.3 144 20 > "$TMP/coarse.bin"
+bin --seed 12 --output-resolution coarse 3.3 144 20 > "$TMP/fine.bin"
+same "resolution: --resolution coarse is the same as converting fine results" "$TMP/coarse.bin" "$TMP/fine.bin"
+
+bin --seed 13 3.3 144 20 > "$TMP/merge-a.bin"
+bin --seed 14 3.3 144 20 > "$TMP/merge-b.bin"
+bin --seed 15 --queue fee 3.3 144 20 > "$TMP/merge-fee.bin"
+cat "$TMP/merge-a.bin" "$TMP/merge-b.bin" > "$TMP/merge-both.bin"
+bin merge "$TMP/merge-a.bin" "$TMP/merge-b.bin" > "$TMP/merged.bin"
+same "merge: merging two runs adds up their results" "$TMP/merge-both.bin" "$TMP/merged.bin"
+fails "merge: the same run can't be merged twice" merge "$TMP/merge-a.bin" "$TMP/merge-a.bin"
+fails "merge: runs with different queues can't be merged" merge "$TMP/merge-a.bin" "$TMP/merge-fee.bin"
+
+#
+# Stop a run as soon as it's saved a checkpoint, then resume it.  If it finishes first
+# then it's resumed from its final checkpoint, which still has to give the same results.
+#
+bin --seed 16 --threads 2 3.3 1008 120 > "$TMP/whole.bin"
+bin --seed 16 --threads 2 --checkpoint "$TMP/ck" --checkpoint-interval 1 3.3 1008 120 > /dev/null &
+PID=$!
+while [ ! -s "$TMP/ck" ] && kill -0 $PID 2> /dev/null; do
+	sleep 0.1
+done
+kill $PID 2> /dev/null
+wait $PID 2> /dev/null
+bin --seed 16 --threads 2 --checkpoint "$TMP/ck" --resume 3.3 1008 120 > "$TMP/resumed.bin"
+same "resume: a resumed run is the same as an uninterrupted one" "$TMP/whole.bin" "$TMP/resumed.bin"
+
+bin --seed 17 --live "$TMP/live" 3.3 144 20 > "$TMP/live-run.bin"
+bin watch "$TMP/live" > "$TMP/live-watch.bin"
+same "watch: the final --live results are the run's results" "$TMP/live-run.bin" "$TMP/live-watch.bin"
+
+if [ -n "$LIBCHECK" ]; then
+	echo "libbtb: btb_run() and btb_merge() give the same results as btb"
+	bin --seed 18 3.3 144 20 > "$TMP/lib-a.bin"
+	bin --seed 19 3.3 144 20 > "$TMP/lib-b.bin"
+	$BTB --output-format summary merge "$TMP/lib-a.bin" | tail -n 1 > "$TMP/lib-expected.txt"
+	$BTB --output-format summary merge "$TMP/lib-a.bin" "$TMP/lib-b.bin" | tail -n 1 >> "$TMP/lib-expected.txt"
+	if ! $LIBCHECK 18 3.3 144 20 > "$TMP/lib.txt"; then
+		echo "libbtb: FAIL (libcheck failed)"
+		FAILED=$((FAILED + 1))
+	elif ! diff "$TMP/lib-expected.txt" "$TMP/lib.txt"; then
+		echo "libbtb: FAIL (differs)"
+		FAILED=$((FAILED + 1))
+	fi
+fi
+
+if [ $FAILED -ne 0 ]; then
+	echo "$FAILED checks failed"
+	exit 1
+fi
+
+echo "All checks passed"
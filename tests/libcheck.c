@@ -0,0 +1,133 @@
+/*
+ * libcheck.c
+ *	Check libbtb for "make check".  Runs "num_sims" simulations of "num_blocks" blocks
+ *	at "tps" from master seed "seed" and then from "seed" plus 1, and prints a summary
+ *	row for the first run and then for the two runs merged.  tests/check.sh compares
+ *	them with what "btb merge" makes of btb's own results for the same runs.
+ *
+ * Along the way it checks the things that btb can't show: that btb_reset() gives the
+ * same results again, and that a btb_run() that fails leaves the results alone.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btb.h"
+
+/*
+ * fail()
+ *	Report a failed check and exit.
+ */
+static void fail(const char *msg)
+{
+	fprintf(stderr, "libcheck: %s\n", msg);
+	exit(1);
+}
+
+/*
+ * print_summary()
+ *	Print a context's results in the same form as a row of btb's summary output.
+ */
+static void print_summary(const struct btb_context *ctx, double tps, int num_blocks)
+{
+	struct btb_results res;
+
+	btb_results(ctx, &res);
+	printf("%f,%d,%lld,%lld,%.6f,%.6f,%.6f,%.6f,%.6f\n", tps, num_blocks, res.num_sims, res.num_results,
+	       res.mean, res.stddev, btb_percentile(ctx, 0.5), btb_percentile(ctx, 0.9), btb_percentile(ctx, 0.99));
+}
+
+/*
+ * same_results()
+ *	Return true if two contexts' results are exactly the same.
+ */
+static bool same_results(const struct btb_context *a, const struct btb_context *b)
+{
+	struct btb_results ra, rb;
+	const long int *ba, *bb;
+	int na, nb;
+
+	btb_results(a, &ra);
+	btb_results(b, &rb);
+	ba = btb_buckets(a, NULL, &na);
+	bb = btb_buckets(b, NULL, &nb);
+	return (ra.num_sims == rb.num_sims) && (ra.num_results == rb.num_results) && (na == nb) &&
+	       !memcmp(ba, bb, sizeof(long int) * na);
+}
+
+int main(int argc, char **argv)
+{
+	struct btb_config cfg;
+	struct btb_context *first, *second, *copy;
+	unsigned long long seed;
+	double tps;
+	int num_blocks, num_sims;
+
+	if (argc != 5) {
+		fprintf(stderr, "usage: %s <seed> <tps> <num-blocks> <num-sims>\n", argv[0]);
+		exit(2);
+	}
+
+	seed = strtoull(argv[1], NULL, 0);
+	tps = atof(argv[2]);
+	num_blocks = atoi(argv[3]);
+	num_sims = atoi(argv[4]);
+
+	btb_config_init(&cfg);
+	cfg.num_blocks = num_blocks;
+	cfg.seed = seed;
+	first = btb_init(&cfg);
+	copy = btb_init(&cfg);
+	cfg.seed = seed + 1;
+	second = btb_init(&cfg);
+	if (!first || !second || !copy) {
+		fail("btb_init() failed");
+	}
+
+	/*
+	 * Running the simulations in two goes has to number them just as btb's one run does.
+	 */
+	if (!btb_run(first, tps, num_sims / 2) || !btb_run(first, tps, num_sims - (num_sims / 2))) {
+		fail("btb_run() failed");
+	}
+
+	print_summary(first, tps, num_blocks);
+
+	/*
+	 * Runs that can't be done have to fail without touching the results so far.
+	 */
+	if (!btb_run(copy, tps, num_sims)) {
+		fail("btb_run() failed");
+	}
+
+	if (btb_run(copy, -1.0, 1) || btb_run(copy, tps, -1) || btb_run(copy, tps, INT_MAX)) {
+		fail("btb_run() accepted invalid arguments");
+	}
+
+	if (!same_results(first, copy)) {
+		fail("btb_run() changed the results when it failed");
+	}
+
+	/*
+	 * After a reset to the second seed, "copy" has to give exactly what "second" gives.
+	 */
+	btb_reset(copy, seed + 1);
+	if (!btb_run(copy, tps, num_sims) || !btb_run(second, tps, num_sims)) {
+		fail("btb_run() failed");
+	}
+
+	if (!same_results(second, copy)) {
+		fail("btb_reset() didn't start the simulations again");
+	}
+
+	if (!btb_merge(first, second)) {
+		fail("btb_merge() failed");
+	}
+
+	print_summary(first, tps, num_blocks);
+
+	btb_destroy(first);
+	btb_destroy(second);
+	btb_destroy(copy);
+	return 0;
+}